@@ -0,0 +1,95 @@
+//
+//  IMPBlendFilter.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+/// Layer compositing filter: blends overlay image with the source one
+public class IMPBlendFilter:IMPFilter{
+
+    /// Overlay image. It is sampled to the destination size.
+    /// The filter passes the source through while overlay is not set.
+    public var overlay:IMPImageProvider?{
+        didSet{
+            updateKernel()
+            dirty = true
+        }
+    }
+
+    /// Blending mode and opacity.
+    /// Every mode has its own specialized kernel, so changing the mode switches kernel
+    /// rather than branching per pixel.
+    ///
+    public var blending:IMPBlending = IMPBlending(mode: IMPBlendingMode.NORMAL, opacity: 1) {
+        didSet{
+            updateKernel()
+            memcpy(opacityBuffer.contents(), &blending.opacity, sizeof(Float))
+            dirty = true
+        }
+    }
+
+    ///  Create layer compositing filter.
+    ///
+    ///  - parameter context: device context
+    ///
+    public required init(context: IMPContext) {
+        super.init(context: context)
+        defer{
+            self.blending = IMPBlending(mode: IMPBlendingMode.NORMAL, opacity: 1)
+        }
+    }
+
+    public override func configure(function: IMPFunction, command: MTLComputeCommandEncoder) {
+        if kernel == function {
+            command.setTexture(overlay?.texture, atIndex: 2)
+            command.setBuffer(opacityBuffer, offset: 0, atIndex: 0)
+        }
+    }
+
+    static let kernelNames = [
+        "kernel_blendLuminosity",
+        "kernel_blendNormal",
+        "kernel_blendMultiply",
+        "kernel_blendScreen",
+        "kernel_blendOverlay",
+        "kernel_blendLinearLight",
+        "kernel_blendLighten",
+        "kernel_blendDarken",
+        "kernel_blendColorDodge",
+        "kernel_blendLinearDodge",
+        "kernel_blendColorBurn",
+        "kernel_blendLinearBurn"
+    ]
+
+    var kernel:IMPFunction?
+    var kernels = [Int:IMPFunction]()
+
+    lazy var opacityBuffer:MTLBuffer = {
+        return self.context.device.newBufferWithLength(sizeof(Float), options: .CPUCacheModeDefaultCache)
+    }()
+
+    func updateKernel() {
+        let mode = min(Int(blending.mode.rawValue), Int(kIMP_BlendingModes)-1)
+
+        if kernels[mode] == nil {
+            kernels[mode] = IMPFunction(context: context, name: IMPBlendFilter.kernelNames[mode])
+        }
+
+        let next = overlay == nil ? nil : kernels[mode]
+
+        guard next != kernel else { return }
+
+        if let old = kernel {
+            removeFunction(old)
+        }
+        kernel = next
+        if let function = kernel {
+            addFunction(function)
+        }
+    }
+}
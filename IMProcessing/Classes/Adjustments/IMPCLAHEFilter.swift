@@ -0,0 +1,186 @@
+//
+//  IMPCLAHEFilter.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+///
+/// Contrast limited adaptive histogram equalization. Luma histograms of grid tiles are computed
+/// by the tile histogram kernel in one pass, every histogram is clipped at clipLimit,
+/// the excess is redistributed, and the tile CDF becomes the tile LUT. Pixels are mapped
+/// by the bilinear interpolation of the four nearest tile LUTs.
+///
+public class IMPCLAHEFilter:IMPFilter,IMPAdjustmentProtocol{
+
+    public static let defaultAdjustment = IMPAdjustment(
+        blending: IMPBlending(mode: IMPBlendingMode.NORMAL, opacity: 1))
+
+    public var adjustment:IMPAdjustment!{
+        didSet{
+            self.updateBuffer(&adjustmentBuffer, context:context, adjustment:&adjustment, size:sizeof(IMPAdjustment))
+            self.dirty = true
+        }
+    }
+
+    /// Tiles grid size
+    public var grid = (width:8, height:8) {
+        didSet{
+            grid = (max(grid.width, 1), max(grid.height, 1))
+            var size = float2(Float(grid.width), Float(grid.height))
+            memcpy(gridBuffer.contents(), &size, sizeof(float2))
+            luts = nil
+            dirty = true
+        }
+    }
+
+    /// Clip limit, multiple of the mean bin count, values <= 1 disable equalization:
+    /// the filter passes the source through without computing histograms
+    public var clipLimit:Float = 2 {
+        didSet{
+            if clipLimit > 1 {
+                addFunction(kernel)
+            }
+            else {
+                removeFunction(kernel)
+            }
+            dirty = true
+        }
+    }
+
+    public var adjustmentBuffer:MTLBuffer?
+    public var kernel:IMPFunction!
+
+    public required init(context: IMPContext) {
+        super.init(context: context)
+        kernel = IMPFunction(context: self.context, name: "kernel_adjustCLAHE")
+        kernel_claheTileHistogram = IMPFunction(context: self.context, name: "kernel_claheTileHistogram")
+        self.addFunction(kernel)
+        defer{
+            self.adjustment = IMPCLAHEFilter.defaultAdjustment
+            self.grid = (8,8)
+        }
+    }
+
+    public override func apply() -> IMPImageProvider {
+        if dirty && clipLimit > 1 {
+            if let texture = source?.texture {
+                updateLuts(texture)
+            }
+        }
+        return super.apply()
+    }
+
+    public override func configure(function: IMPFunction, command: MTLComputeCommandEncoder) {
+        if kernel == function {
+            command.setTexture(luts, atIndex: 2)
+            command.setBuffer(adjustmentBuffer, offset: 0, atIndex: 0)
+            command.setBuffer(gridBuffer, offset: 0, atIndex: 1)
+        }
+    }
+
+    ///  Clip histogram, redistribute the excess uniformly and build normalized CDF
+    ///
+    ///  - parameter histogram: bins counts
+    ///  - parameter clipLimit: clip limit, multiple of the mean bin count, identity LUT if <= 1
+    ///  - parameter lut:       kIMP_HistogramSize LUT values in [0,1]
+    public static func equalization(histogram:UnsafePointer<UInt32>, clipLimit:Float, lut:UnsafeMutablePointer<Float>) {
+
+        let size = Int(kIMP_HistogramSize)
+
+        var bins  = [Float](count: size, repeatedValue: 0)
+        var total = Float(0)
+        for i in 0 ..< size {
+            bins[i] = Float(histogram[i])
+            total  += bins[i]
+        }
+
+        guard total > 0 && clipLimit > 1 else {
+            for i in 0 ..< size { lut[i] = Float(i)/Float(size - 1) }
+            return
+        }
+
+        let limit = clipLimit * total / Float(size)
+
+        var excess = Float(0)
+        for i in 0 ..< size where bins[i] > limit {
+            excess += bins[i] - limit
+            bins[i] = limit
+        }
+
+        let share = excess / Float(size)
+        var cdf   = Float(0)
+        for i in 0 ..< size {
+            cdf += bins[i] + share
+            lut[i] = min(cdf / total, 1)
+        }
+    }
+
+    func updateLuts(texture:MTLTexture) {
+
+        let tiles = grid.width * grid.height
+        let size  = Int(kIMP_HistogramSize)
+
+        let length = tiles * sizeof(IMPHistogramBuffer)
+        if histogramBuffer?.length != length {
+            histogramBuffer = context.device.newBufferWithLength(length, options: .CPUCacheModeDefaultCache)
+        }
+
+        //
+        // one threadgroup per tile, luma is the last channel of the histogram buffer
+        //
+        let threadgroups      = MTLSizeMake(grid.width, grid.height, 1)
+        let threadgroupCounts = MTLSizeMake(size, 1, 1)
+
+        context.execute(complete: true) { (commandBuffer) in
+            let commandEncoder = commandBuffer.computeCommandEncoder()
+            commandEncoder.setComputePipelineState(self.kernel_claheTileHistogram.pipeline!)
+            commandEncoder.setTexture(texture, atIndex: 0)
+            commandEncoder.setBuffer(self.histogramBuffer, offset: 0, atIndex: 0)
+            commandEncoder.dispatchThreadgroups(threadgroups, threadsPerThreadgroup:threadgroupCounts)
+            commandEncoder.endEncoding()
+
+            #if os(OSX)
+                let blitEncoder = commandBuffer.blitCommandEncoder()
+                blitEncoder.synchronizeResource(self.histogramBuffer!)
+                blitEncoder.endEncoding()
+            #endif
+        }
+
+        var lutsData = [Float](count: tiles * size, repeatedValue: 0)
+
+        let histograms = UnsafePointer<IMPHistogramBuffer>(histogramBuffer!.contents())
+        let clipLimit  = self.clipLimit
+
+        lutsData.withUnsafeMutableBufferPointer { (lutsData) -> Void in
+            let lut = lutsData.baseAddress
+            dispatch_apply(tiles, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (i) in
+                let luma = UnsafePointer<UInt32>(histograms + i) + (Int(kIMP_HistogramMaxChannels) - 1) * size
+                IMPCLAHEFilter.equalization(luma, clipLimit: clipLimit, lut: lut + i * size)
+            }
+        }
+
+        let tables = (0 ..< tiles).map { (i) -> [Float] in
+            return Array(lutsData[i * size ..< (i + 1) * size])
+        }
+
+        if luts == nil {
+            luts = context.device.texture1DArray(tables)
+        }
+        else {
+            luts?.update(tables)
+        }
+    }
+
+    private var kernel_claheTileHistogram:IMPFunction!
+    private var histogramBuffer:MTLBuffer?
+    private var luts:MTLTexture?
+
+    private lazy var gridBuffer:MTLBuffer = {
+        return self.context.device.newBufferWithLength(sizeof(float2), options: .CPUCacheModeDefaultCache)
+    }()
+}
@@ -117,8 +117,18 @@ public func * (left:IMPColor, right:Float) -> IMPColor {
 }
 
 public extension IMPBlendingMode{
-    static let LUMNINOSITY = IMPBlendingMode(0)
-    static let NORMAL      = IMPBlendingMode(1)
+    static let LUMNINOSITY  = IMPBlendingMode(0)
+    static let NORMAL       = IMPBlendingMode(1)
+    static let MULTIPLY     = IMPBlendingMode(2)
+    static let SCREEN       = IMPBlendingMode(3)
+    static let OVERLAY      = IMPBlendingMode(4)
+    static let LINEAR_LIGHT = IMPBlendingMode(5)
+    static let LIGHTEN      = IMPBlendingMode(6)
+    static let DARKEN       = IMPBlendingMode(7)
+    static let COLOR_DODGE  = IMPBlendingMode(8)
+    static let LINEAR_DODGE = IMPBlendingMode(9)
+    static let COLOR_BURN   = IMPBlendingMode(10)
+    static let LINEAR_BURN  = IMPBlendingMode(11)
 }
 
 public extension IMPRegion{
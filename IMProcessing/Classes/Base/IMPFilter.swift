@@ -12,6 +12,7 @@
     import Cocoa
 #endif
 import Metal
+import simd
 
 public protocol IMPFilterProtocol:IMPContextProvider {
     var source:IMPImageProvider? {get set}
@@ -76,8 +77,8 @@ public class IMPFilter: NSObject,IMPFilterProtocol {
     
     public var destinationSize:MTLSize?{
         didSet{
-            if let ov = oldValue{
-                if ov != destinationSize! {
+            if let ov = oldValue, let nv = destinationSize {
+                if ov != nv {
                     dirty = true
                 }
             }
@@ -294,6 +295,27 @@ public class IMPFilter: NSObject,IMPFilterProtocol {
         return nil
     }
     
+    ///  Prepare CPU pass of main(source:destination:): read rgba pixels of the source and recreate
+    ///  the destination texture when it differs from the source size or format or is the source itself.
+    ///  The result is written by IMPImageProvider.update(pixels:).
+    ///
+    ///  - returns: destination provider, source pixels and size, nil when the source format has no pixels access
+    public final func cpuPass(source source: IMPImageProvider, destination provider:IMPImageProvider)
+        -> (destination:IMPImageProvider, pixels:[float4], width:Int, height:Int)? {
+            
+            guard let input = source.texture, let pixels = input.pixels(context) else { return nil }
+            
+            if provider.texture?.width != input.width || provider.texture?.height != input.height
+                || provider.texture?.pixelFormat != input.pixelFormat || provider === source {
+                let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+                    input.pixelFormat,
+                    width: input.width, height: input.height, mipmapped: false)
+                provider.texture = context.device.newTextureWithDescriptor(descriptor)
+            }
+            
+            return (provider, pixels, input.width, input.height)
+    }
+    
     func internal_main(source source: IMPImageProvider , destination provider:IMPImageProvider) -> IMPImageProvider {
         
         var currentFilter = self
@@ -29,6 +29,7 @@
 
 #endif
 import Metal
+import simd
 
 public extension IMPImageOrientation {
     //
@@ -81,7 +82,22 @@ public class IMPImageProvider: IMPTextureProvider,IMPContextProvider {
     public var orientation = IMPImageOrientation.Up
     
     public var context:IMPContext!
-    public var texture:MTLTexture?
+    public var texture:MTLTexture?{
+        didSet{
+            _pyramid?.invalidate()
+        }
+    }
+    
+    /// Mip pyramid of the texture shared by every filter attached to the provider.
+    /// The pyramid is built lazily and dropped every time the texture changes.
+    public var pyramid:IMPImagePyramid {
+        if _pyramid == nil {
+            _pyramid = IMPImagePyramid(provider: self)
+        }
+        return _pyramid!
+    }
+    
+    private var _pyramid:IMPImagePyramid?
     
     public var width:Float {
         get {
@@ -118,7 +134,16 @@ public class IMPImageProvider: IMPTextureProvider,IMPContextProvider {
     
     public weak var filter:IMPFilter?
     
+    ///  Write rgba pixels to the texture in place, the pyramid levels of the previous pixels are dropped
+    ///
+    ///  - parameter pixels: width*height pixels, see MTLTexture.update(pixels:)
+    public func update(pixels pixels:[float4]){
+        texture?.update(pixels: pixels)
+        _pyramid?.invalidate()
+    }
+    
     public func completeUpdate(){
+        _pyramid?.invalidate()
         filter?.executeNewSourceObservers(self)
         filter?.dirty = true
     }
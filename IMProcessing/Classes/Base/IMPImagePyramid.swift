@@ -0,0 +1,244 @@
+//
+//  IMPImagePyramid.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+///
+/// Lazily built mip pyramid of an image provider texture. Level 0 is the texture itself,
+/// every next level is half size of the previous one. Levels are built on the first request
+/// and shared by every consumer of the provider until the texture changes.
+///
+public class IMPImagePyramid: IMPContextProvider {
+
+    /// Downsampling filter of levels
+    public enum Filter {
+        /// 2x2 box average
+        case Box
+        /// Lanczos-3 resampling
+        case Lanczos
+    }
+
+    public var context:IMPContext!
+
+    public var filter:Filter = .Box {
+        didSet{
+            if oldValue != filter {
+                invalidate()
+            }
+        }
+    }
+
+    public init(provider:IMPImageProvider) {
+        self.provider = provider
+        self.context = provider.context
+    }
+
+    /// Number of levels built
+    public var count:Int {
+        return levels.count + 1
+    }
+
+    ///  Drop all levels, they will be built again on the next request.
+    ///  Levels can still be read by command buffers in flight, so they are released, not purged:
+    ///  command buffers retain their textures until they complete.
+    public func invalidate() {
+        levels.removeAll()
+    }
+
+    ///  Get pyramid level
+    ///
+    ///  - parameter index: level index, 0 is the provider texture
+    ///
+    ///  - returns: texture of the level or the smallest one when the index exceeds 1x1 level
+    public func level(index:Int) -> MTLTexture? {
+
+        guard let texture = provider?.texture else { return nil }
+
+        if index <= 0 {
+            return texture
+        }
+
+        build(texture, count: index)
+
+        if levels.isEmpty {
+            return texture
+        }
+
+        return levels[min(index, levels.count) - 1]
+    }
+
+    ///  Get the smallest level which has at least the pixels count
+    ///
+    ///  - parameter pixels: minimum width*height of the level
+    ///
+    ///  - returns: level texture
+    public func texture(atLeast pixels:Int) -> MTLTexture? {
+
+        guard let source = provider?.texture else { return nil }
+
+        var index  = 0
+        var width  = source.width
+        var height = source.height
+
+        while width > 1 || height > 1 {
+            let (w,h) = IMPImagePyramid.halfSize(width, height)
+            if w * h < pixels {
+                break
+            }
+            (width,height) = (w,h)
+            index += 1
+        }
+
+        return level(index)
+    }
+
+    ///  Get the smallest level which is not smaller than the scaled texture
+    ///
+    ///  - parameter scale: scale factor of the provider texture
+    ///
+    ///  - returns: level texture
+    public func texture(scale scale:Float) -> MTLTexture? {
+
+        guard let source = provider?.texture else { return nil }
+
+        let width  = Int(floor(Float(source.width)  * scale))
+        let height = Int(floor(Float(source.height) * scale))
+
+        return texture(atLeast: max(width * height, 1))
+    }
+
+    static func halfSize(width:Int, _ height:Int) -> (Int,Int) {
+        return (max((width + 1) / 2, 1), max((height + 1) / 2, 1))
+    }
+
+    func build(texture:MTLTexture, count:Int) {
+
+        var input = levels.last ?? texture
+
+        if filter == .Lanczos {
+            while levels.count < count && (input.width > 1 || input.height > 1) {
+                let (width,height) = IMPImagePyramid.halfSize(input.width, input.height)
+                input = resampler.resample(input, width: width, height: height)
+                levels.append(input)
+            }
+            return
+        }
+
+        guard levels.count < count && (input.width > 1 || input.height > 1) else { return }
+
+        context.execute { (commandBuffer) in
+
+            while self.levels.count < count && (input.width > 1 || input.height > 1) {
+
+                let (width,height) = IMPImagePyramid.halfSize(input.width, input.height)
+
+                let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+                    texture.pixelFormat,
+                    width: width, height: height, mipmapped: false)
+
+                let output = self.context.device.newTextureWithDescriptor(descriptor)
+
+                let function = self.kernel_resampleHalfBox
+                let threadgroupCounts = MTLSizeMake(function.groupSize.width, function.groupSize.height, 1)
+                let threadgroups = MTLSizeMake(
+                    (width  + threadgroupCounts.width ) / threadgroupCounts.width ,
+                    (height + threadgroupCounts.height) / threadgroupCounts.height,
+                    1)
+
+                let commandEncoder = commandBuffer.computeCommandEncoder()
+                commandEncoder.setComputePipelineState(function.pipeline!)
+                commandEncoder.setTexture(input,  atIndex: 0)
+                commandEncoder.setTexture(output, atIndex: 1)
+                commandEncoder.dispatchThreadgroups(threadgroups, threadsPerThreadgroup:threadgroupCounts)
+                commandEncoder.endEncoding()
+
+                self.levels.append(output)
+                input = output
+            }
+        }
+    }
+
+    private weak var provider:IMPImageProvider?
+    private var levels = [MTLTexture]()
+
+    lazy var kernel_resampleHalfBox:IMPFunction = {
+        return IMPFunction(context: self.context, name: "kernel_resampleHalfBox")
+    }()
+
+    lazy var resampler:IMPLanczosResampler = {
+        return IMPLanczosResampler(context: self.context)
+    }()
+}
+
+///
+/// Downscaled copy of a provider texture analyzers read 1:1. It starts from the nearest level
+/// of the provider pyramid, so analyzers of one source share the levels, and resamples the level
+/// to the exact size. The copy is reused between updates.
+///
+public class IMPAnalysisDownscaler: IMPContextProvider {
+
+    public var context:IMPContext!
+
+    /// Lanczos downscaling resampler
+    public lazy var resampler:IMPLanczosResampler = {
+        return IMPLanczosResampler(context: self.context)
+    }()
+
+    lazy var areaResampler:IMPAreaResampler = {
+        return IMPAreaResampler(context: self.context)
+    }()
+
+    public init(context:IMPContext) {
+        self.context = context
+    }
+
+    ///  Get the downscaled texture
+    ///
+    ///  - parameter texture:  provider texture
+    ///  - parameter pyramid:  provider pyramid, the texture itself is resampled when nil
+    ///  - parameter scale:    downscale factor, the texture is returned as is when it is not less than 1
+    ///  - parameter sampling: downscaling method
+    ///
+    ///  - returns: floor(size*scale) texture
+    public func texture(texture:MTLTexture, pyramid:IMPImagePyramid?, scale:Float, sampling:IMPHistogramSampling) -> MTLTexture {
+
+        guard scale < 1 else { return texture }
+
+        let width  = max(Int(floor(Float(texture.width)  * scale)), 1)
+        let height = max(Int(floor(Float(texture.height) * scale)), 1)
+
+        var level = pyramid?.texture(scale: scale) ?? texture
+
+        if sampling == .Area {
+            //
+            // box levels are exact area averages only while every level halves the size without a remainder
+            //
+            let k = texture.width / level.width
+            if pyramid?.filter != .Box || k & (k - 1) != 0
+                || level.width * k != texture.width || level.height * k != texture.height {
+                level = texture
+            }
+        }
+
+        if level.width == width && level.height == height {
+            return level
+        }
+
+        switch sampling {
+        case .Area:
+            scaledTexture = areaResampler.resample(level, width: width, height: height, destination: scaledTexture)
+        case .Lanczos:
+            scaledTexture = resampler.resample(level, width: width, height: height, destination: scaledTexture)
+        }
+
+        return scaledTexture!
+    }
+
+    private var scaledTexture:MTLTexture?
+}
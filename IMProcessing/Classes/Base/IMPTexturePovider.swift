@@ -8,6 +8,8 @@
 
 import Foundation
 import Metal
+import Accelerate
+import simd
 
 public protocol IMPTextureProvider{
     var texture:MTLTexture?{ get set }
@@ -133,4 +135,116 @@ public extension MTLTexture {
             self.replaceRegion(region, mipmapLevel:0, slice:index, withBytes:curve, bytesPerRow:bytesPerRow, bytesPerImage:0)
         }
     }
-}
\ No newline at end of file
+    
+    ///  Texture pixel format can be read by pixels(_:) and written by update(pixels:)
+    public var hasPixelsAccess:Bool {
+        switch pixelFormat {
+        case .RGBA8Unorm, .BGRA8Unorm, .RGBA16Unorm, .RGBA16Float, .RGBA32Float:
+            return true
+        default:
+            return false
+        }
+    }
+    
+    ///  Read texture pixels to the rgba float vectors, BGRA8Unorm pixels are swizzled to rgba.
+    ///  RGBA8Unorm, BGRA8Unorm, RGBA16Unorm, RGBA16Float and RGBA32Float formats are supported.
+    ///
+    ///  - parameter context: device context
+    ///
+    ///  - returns: width*height pixels or nil when the pixel format is not supported
+    public func pixels(context:IMPContext) -> [float4]? {
+        
+        let isByte  = pixelFormat == .RGBA8Unorm || pixelFormat == .BGRA8Unorm
+        let isWord  = pixelFormat == .RGBA16Unorm
+        let isHalf  = pixelFormat == .RGBA16Float
+        let isFloat = pixelFormat == .RGBA32Float
+        
+        guard isByte || isWord || isHalf || isFloat else { return nil }
+        
+        let bytesPerRow = width * 4 * (isByte ? sizeof(UInt8) : isWord || isHalf ? sizeof(UInt16) : sizeof(Float))
+        let buffer      = context.device.newBufferWithLength(bytesPerRow * height, options: .CPUCacheModeDefaultCache)
+        
+        //
+        // Use blit encoder to copy data from device memory, texture.getBytes does not work on OSX
+        //
+        context.execute(complete: true) { (commandBuffer) in
+            let blitEncoder = commandBuffer.blitCommandEncoder()
+            blitEncoder.copyFromTexture(self,
+                sourceSlice: 0,
+                sourceLevel: 0,
+                sourceOrigin: MTLOrigin(x: 0, y: 0, z: 0),
+                sourceSize: MTLSize(width: self.width, height: self.height, depth: 1),
+                toBuffer: buffer,
+                destinationOffset: 0,
+                destinationBytesPerRow: bytesPerRow,
+                destinationBytesPerImage: 0)
+            blitEncoder.endEncoding()
+        }
+        
+        if pixelFormat == .BGRA8Unorm {
+            IMPSwapRedBlue8(buffer.contents(), bytesPerRow, buffer.contents(), bytesPerRow, width, height)
+        }
+        
+        var pixels = [float4](count: width * height, repeatedValue: float4(0))
+        
+        if isFloat {
+            memcpy(&pixels, buffer.contents(), buffer.length)
+        }
+        else {
+            pixels.withUnsafeMutableBufferPointer({ (p) -> Void in
+                let floatsPerRow = self.width * sizeof(float4)
+                if isByte {
+                    IMPConvertRGBA8ToFloat(buffer.contents(), bytesPerRow, p.baseAddress, floatsPerRow, self.width, self.height)
+                }
+                else if isWord {
+                    IMPConvertRGBA16ToFloat(buffer.contents(), bytesPerRow, p.baseAddress, floatsPerRow, self.width, self.height)
+                }
+                else {
+                    IMPConvertHalfToFloat(buffer.contents(), bytesPerRow, p.baseAddress, floatsPerRow, self.width, self.height)
+                }
+            })
+        }
+        
+        return pixels
+    }
+    
+    ///  Write rgba float vectors to the texture, pixels are swizzled back for BGRA8Unorm.
+    ///  RGBA8Unorm, BGRA8Unorm, RGBA16Unorm, RGBA16Float and RGBA32Float formats are supported.
+    ///
+    ///  - parameter pixels: width*height pixels
+    public func update(pixels pixels:[float4]){
+        
+        if width * height != pixels.count {
+            fatalError("MTLTexture.update(pixels:[float4]) is not equal texture size...")
+        }
+        
+        let region = MTLRegionMake2D(0, 0, width, height)
+        
+        if pixelFormat == .RGBA32Float {
+            self.replaceRegion(region, mipmapLevel: 0, withBytes: pixels, bytesPerRow: width * sizeof(float4))
+        }
+        else if pixelFormat == .RGBA8Unorm || pixelFormat == .BGRA8Unorm {
+            var bytes = [UInt8](count: pixels.count * 4, repeatedValue: 0)
+            IMPConvertFloatToRGBA8(pixels, width * sizeof(float4), &bytes, width * 4, width, height)
+            if pixelFormat == .BGRA8Unorm {
+                bytes.withUnsafeMutableBufferPointer({ (p) -> Void in
+                    IMPSwapRedBlue8(p.baseAddress, self.width * 4, p.baseAddress, self.width * 4, self.width, self.height)
+                })
+            }
+            self.replaceRegion(region, mipmapLevel: 0, withBytes: bytes, bytesPerRow: width * 4)
+        }
+        else if pixelFormat == .RGBA16Unorm || pixelFormat == .RGBA16Float {
+            var words = [UInt16](count: pixels.count * 4, repeatedValue: 0)
+            if pixelFormat == .RGBA16Unorm {
+                IMPConvertFloatToRGBA16(pixels, width * sizeof(float4), &words, width * 4 * sizeof(UInt16), width, height)
+            }
+            else {
+                IMPConvertFloatToHalf(pixels, width * sizeof(float4), &words, width * 4 * sizeof(UInt16), width, height)
+            }
+            self.replaceRegion(region, mipmapLevel: 0, withBytes: words, bytesPerRow: width * 4 * sizeof(UInt16))
+        }
+        else {
+            fatalError("MTLTexture.update(pixels:[float4]) has wrong pixel format...")
+        }
+    }
+}
@@ -51,9 +51,21 @@ extern "C" {
     
     typedef enum : uint {
         LUMINOSITY = 0,
-        NORMAL
+        NORMAL,
+        MULTIPLY,
+        SCREEN,
+        OVERLAY,
+        LINEAR_LIGHT,
+        LIGHTEN,
+        DARKEN,
+        COLOR_DODGE,
+        LINEAR_DODGE,
+        COLOR_BURN,
+        LINEAR_BURN
     }IMPBlendingMode;
     
+    #define kIMP_BlendingModes 12
+    
     typedef struct {
         IMPBlendingMode    mode;
         float              opacity;
@@ -103,6 +115,15 @@ extern "C" {
         float luma;
     }IMPFilmGrainColor;
     
+    ///  @brief Third order recursive filter: y[i] = b*x[i] + a1*y[i-1] + a2*y[i-2] + a3*y[i-3]
+    typedef struct {
+        ///  @brief b, a1, a2, a3
+        float4 coefficients;
+        ///  @brief Triggs–Sdika matrix rows scaled by b, xyz: backward initial conditions
+        ///  from the last three forward outputs
+        float4 boundary[3];
+    } IMPIIRFilterCoefficients;
+
     typedef struct {
         bool                isColored;
         float               size;
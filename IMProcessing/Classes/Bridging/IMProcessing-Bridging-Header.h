@@ -15,6 +15,7 @@
 
 #include "IMPExif.h"
 #include "IMPJpegturbo.h"
+#include "IMPPixelConversion.h"
 
 #endif
 
@@ -0,0 +1,34 @@
+//
+//  IMPBoxFilter.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+/// Box blur filter backed by summed area tables: cost per pixel does not depend on radius
+public class IMPBoxFilter: IMPFilter {
+    
+    /// Window radius, window size is 2*radius+1
+    public var radius:Int = 0 {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+        
+        guard radius > 0 else { return nil }
+        
+        guard let cpu = cpuPass(source: source, destination: provider) else { return nil }
+        
+        let table = IMPSummedAreaTable(pixels: cpu.pixels, width: cpu.width, height: cpu.height)
+        
+        cpu.destination.update(pixels: table.box(radius: radius))
+        
+        return cpu.destination
+    }
+}
@@ -11,6 +11,14 @@ import simd
 
 public class IMPGaussianBlurFilter: IMPFilter {
     
+    public enum Backend {
+        /// Metal kernels with linear sampling taps
+        case GPU
+        /// Cache blocked IMPSeparableGaussianBlur, textures of other formats are blurred by GPU.
+        /// BGRA8Unorm sources are swizzled to rgba by MTLTexture.pixels(_:), so blending matches the kernels
+        case CPU
+    }
+    
     public static let defaultAdjustment = IMPAdjustment(blending: IMPBlending(mode: NORMAL, opacity: 1))
     
     public var adjustment:IMPAdjustment!{
@@ -28,6 +36,13 @@ public class IMPGaussianBlurFilter: IMPFilter {
         }
     }
     
+    public var backend:Backend = .GPU {
+        didSet{
+            update()
+            dirty = true
+        }
+    }
+    
     var adjustmentBuffer:MTLBuffer!
     var horizontal_pass_kernel : IMPFunction!
     var vertical_pass_kernel   : IMPFunction!
@@ -37,6 +52,9 @@ public class IMPGaussianBlurFilter: IMPFilter {
         super.init(context: context)
         horizontal_pass_kernel = IMPFunction(context: context, name: "kernel_gaussianSampledBlurHorizontalPass")
         vertical_pass_kernel   = IMPFunction(context: context, name: "kernel_gaussianSampledBlurVerticalPass")
+        addSourceObserver { (source) -> Void in
+            self.updateFunctions()
+        }
         defer{
             radius = 0
             adjustment = IMPGaussianBlurFilter.defaultAdjustment
@@ -61,6 +79,9 @@ public class IMPGaussianBlurFilter: IMPFilter {
     }
     
     func update(){
+        
+        cpuBlur.radius = radius
+        
         let kernel: [Float] = radius.gaussianKernel
         let inputs: [Float] = kernel.gaussianInputs
         
@@ -68,15 +89,31 @@ public class IMPGaussianBlurFilter: IMPFilter {
         let offsets:[Float] = inputs.gaussianOffsets(weights)
         
         if weights.count>0{
+            weightsTexure =  context.device.texture1D(weights)
+            offsetsTexture = context.device.texture1D(offsets)
+        }
+        
+        gpuWeightsCount = weights.count
+        
+        updateFunctions()
+    }
+    
+    //
+    // CPU backend can not read every pixel format: such sources are blurred by kernels
+    //
+    var cpuApplicable:Bool {
+        return backend == .CPU && source?.texture?.hasPixelsAccess ?? true
+    }
+    
+    func updateFunctions() {
+        if gpuWeightsCount > 0 && !cpuApplicable {
             if empty {
                 empty = false
                 addFunction(horizontal_pass_kernel)
                 addFunction(vertical_pass_kernel)
             }
-            weightsTexure =  context.device.texture1D(weights)
-            offsetsTexture = context.device.texture1D(offsets)
         }
-        else{
+        else if !empty {
             empty = true
             removeAllFunctions()
         }
@@ -92,6 +129,30 @@ public class IMPGaussianBlurFilter: IMPFilter {
             }
         }
     }
+    
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+        
+        guard cpuApplicable && cpuBlur.weights.count > 1 else { return nil }
+        
+        guard let cpu = cpuPass(source: source, destination: provider) else { return nil }
+        
+        if cpuResult.count != cpu.pixels.count {
+            cpuResult = [float4](count: cpu.pixels.count, repeatedValue: float4(0))
+        }
+        
+        cpuResult.withUnsafeMutableBufferPointer { (result) -> Void in
+            self.cpuBlur.apply(cpu.pixels, destination: result.baseAddress,
+                width: cpu.width, height: cpu.height, blending: self.adjustment.blending)
+        }
+        
+        cpu.destination.update(pixels: cpuResult)
+        
+        return cpu.destination
+    }
+    
+    private var cpuBlur = IMPSeparableGaussianBlur(radius: 0)
+    private var cpuResult = [float4]()
+    private var gpuWeightsCount = 0
 }
 
 
@@ -0,0 +1,56 @@
+//
+//  IMPGuidedFilter.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+/// Edge-aware smoothing filter: flat areas are smoothed like by the box blur,
+/// edges with variance much more than epsilon are kept, so no halos appear around them.
+/// Cost per pixel does not depend on radius.
+public class IMPGuidedFilter: IMPFilter {
+
+    /// Window radius, window size is 2*radius+1
+    public var radius:Int = 0 {
+        didSet{
+            dirty = true
+        }
+    }
+
+    /// Regularization, squared edge contrast in [0,1] color units
+    public var epsilon:Float = 0.01 {
+        didSet{
+            dirty = true
+        }
+    }
+
+    /// Coefficients subsampling factor
+    public var subsampling:Int = 4 {
+        didSet{
+            dirty = true
+        }
+    }
+
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+
+        guard radius > 0 else { return nil }
+
+        guard var cpu = cpuPass(source: source, destination: provider) else { return nil }
+
+        let smoothing = IMPGuidedSmoothing(radius: radius, epsilon: epsilon, subsampling: subsampling)
+
+        let (width, height) = (cpu.width, cpu.height)
+
+        cpu.pixels.withUnsafeMutableBufferPointer { (pixels) -> Void in
+            smoothing.apply(pixels.baseAddress, width: width, height: height)
+        }
+
+        cpu.destination.update(pixels: cpu.pixels)
+
+        return cpu.destination
+    }
+}
@@ -0,0 +1,154 @@
+//
+//  IMPGuidedSmoothing.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import simd
+
+///
+/// CPU edge-aware smoothing of RGBA float pixels by the fast guided filter (He, Sun).
+/// Every color channel is its own guide: q = mean(a) * I + mean(b), where
+/// a = var(I)/(var(I)+epsilon) and b = (1-a) * mean(I) in the window.
+///
+/// Coefficients are computed on the image subsampled by the area average and upsampled
+/// bilinearly, box means are read from summed area tables, so cost per pixel does not
+/// depend on radius. Alpha is passed through.
+///
+public struct IMPGuidedSmoothing {
+
+    /// Window radius in full resolution pixels
+    public var radius:Int
+
+    /// Regularization: edges with variance much more than epsilon are preserved
+    public var epsilon:Float
+
+    /// Coefficients subsampling factor, 1 is the original guided filter
+    public var subsampling:Int
+
+    public init(radius:Int, epsilon:Float = 0.01, subsampling:Int = 4) {
+        self.radius = radius
+        self.epsilon = epsilon
+        self.subsampling = subsampling
+    }
+
+    ///  Smooth pixels in place
+    ///
+    ///  - parameter pixels: rgba pixels
+    ///  - parameter width:  image width
+    ///  - parameter height: image height
+    ///  - parameter stride: pixels per row, width by default
+    public func apply(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+
+        guard radius > 0 && width > 0 && height > 0 else { return }
+
+        let stride = stride > 0 ? stride : width
+        let queue  = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)
+
+        let s      = max(min(subsampling, radius), 1)
+        let r      = max(radius / s, 1)
+        let w      = (width  + s - 1) / s
+        let h      = (height + s - 1) / s
+
+        //
+        // subsampled guide
+        //
+        var low = [float4](count: w * h, repeatedValue: float4(0))
+
+        low.withUnsafeMutableBufferPointer { (low) -> Void in
+            let l = low.baseAddress
+            dispatch_apply(h, queue) { (y) in
+                let y0 = y * s
+                let y1 = min(y0 + s, height)
+                for x in 0 ..< w {
+                    let x0  = x * s
+                    let x1  = min(x0 + s, width)
+                    var sum = float4(0)
+                    for j in y0 ..< y1 {
+                        let p = pixels + j * stride
+                        for i in x0 ..< x1 {
+                            sum += p[i]
+                        }
+                    }
+                    l[y * w + x] = sum * (1 / Float((x1 - x0) * (y1 - y0)))
+                }
+            }
+        }
+
+        //
+        // linear coefficients of every window
+        //
+        let guide = IMPSummedAreaTable(pixels: low, width: w, height: h)
+        let eps   = float4(epsilon)
+        let one   = float4(1)
+
+        var a = [float4](count: w * h, repeatedValue: float4(0))
+        var b = [float4](count: w * h, repeatedValue: float4(0))
+
+        a.withUnsafeMutableBufferPointer { (a) -> Void in
+            b.withUnsafeMutableBufferPointer { (b) -> Void in
+                let pa = a.baseAddress
+                let pb = b.baseAddress
+                dispatch_apply(h, queue) { (y) in
+                    for x in 0 ..< w {
+                        let mean     = guide.mean(x: x - r, y: y - r, width: 2 * r + 1, height: 2 * r + 1)
+                        let variance = guide.variance(x: x - r, y: y - r, width: 2 * r + 1, height: 2 * r + 1)
+                        var k        = variance / (variance + eps)
+                        k.w = 1
+                        let i = y * w + x
+                        pa[i] = k
+                        pb[i] = (one - k) * mean
+                    }
+                }
+            }
+        }
+
+        //
+        // mean coefficients of windows covering the pixel
+        //
+        let meanA = IMPSummedAreaTable(pixels: a, width: w, height: h).box(radius: r)
+        let meanB = IMPSummedAreaTable(pixels: b, width: w, height: h).box(radius: r)
+
+        //
+        // bilinear upsampling of coefficients and the output
+        //
+        let scale = 1 / Float(s)
+
+        dispatch_apply(height, queue) { (y) in
+
+            let fy = max((Float(y) + 0.5) * scale - 0.5, 0)
+            let y0 = min(Int(fy), h - 1)
+            let y1 = min(y0 + 1, h - 1)
+            let wy = fy - Float(y0)
+
+            let p  = pixels + y * stride
+
+            for x in 0 ..< width {
+
+                let fx = max((Float(x) + 0.5) * scale - 0.5, 0)
+                let x0 = min(Int(fx), w - 1)
+                let x1 = min(x0 + 1, w - 1)
+                let wx = fx - Float(x0)
+
+                let i00 = y0 * w + x0
+                let i10 = y0 * w + x1
+                let i01 = y1 * w + x0
+                let i11 = y1 * w + x1
+
+                let ka  = IMPGuidedSmoothing.bilinear(meanA[i00], meanA[i10], meanA[i01], meanA[i11], wx: wx, wy: wy)
+                let kb  = IMPGuidedSmoothing.bilinear(meanB[i00], meanB[i10], meanB[i01], meanB[i11], wx: wx, wy: wy)
+
+                p[x] = ka * p[x] + kb
+            }
+        }
+    }
+
+    @inline(__always) static func bilinear(v00:float4, _ v10:float4, _ v01:float4, _ v11:float4, wx:Float, wy:Float) -> float4 {
+        let top    = v00 + (v10 - v00) * wx
+        let bottom = v01 + (v11 - v01) * wx
+        return top + (bottom - top) * wy
+    }
+}
@@ -0,0 +1,182 @@
+//
+//  IMPIIRGaussianBlur.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import simd
+
+///
+/// CPU Young–van Vliet recursive gaussian blur of RGBA float pixels.
+/// Cost per pixel does not depend on sigma.
+///
+/// Recursions run in place with the state in a few vectors per line: the forward pass starts
+/// from the steady state of the first sample, the backward pass starts from the Triggs–Sdika
+/// initial conditions, so edges are handled without padding and scratch memory is bounded
+/// by the lines processed together.
+///
+/// Horizontal pass runs blocks of rows interleaved, so independent recursions
+/// fill the pipeline, vertical pass runs across contiguous rows in column bands,
+/// so the image is never transposed. Blocks and bands are processed concurrently.
+///
+public struct IMPIIRGaussianBlur {
+
+    /// Rows processed together by the horizontal pass
+    public static let rowsPerBlock   = 8
+
+    /// Columns processed together by the vertical pass
+    public static let columnsPerBand = 64
+
+    /// Gaussian sigma
+    public var sigma:Float {
+        didSet{
+            update()
+        }
+    }
+
+    public init(sigma:Float) {
+        self.sigma = sigma
+        update()
+    }
+
+    ///  Blur pixels in place
+    ///
+    ///  - parameter pixels: rgba pixels
+    ///  - parameter width:  image width
+    ///  - parameter height: image height
+    ///  - parameter stride: pixels per row, width by default
+    public func apply(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+
+        guard width > 1 && height > 1 && sigma > 0.5 else { return }
+
+        let stride = stride > 0 ? stride : width
+        let filter = self.filter
+
+        let queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)
+
+        //
+        // horizontal stage
+        //
+        let rowsPerBlock = IMPIIRGaussianBlur.rowsPerBlock
+        let blocks = (height + rowsPerBlock - 1) / rowsPerBlock
+
+        dispatch_apply(blocks, queue) { (block) in
+            let y0    = block * rowsPerBlock
+            let rows  = min(rowsPerBlock, height - y0)
+            let state = UnsafeMutablePointer<float4>.alloc(rows * 4)
+            defer { state.dealloc(rows * 4) }
+            IMPIIRGaussianBlur.recursion(pixels + y0 * stride, lines: rows, lineStep: stride,
+                length: width, sampleStep: 1, state: state, filter: filter)
+        }
+
+        //
+        // vertical stage
+        //
+        let columnsPerBand = IMPIIRGaussianBlur.columnsPerBand
+        let bands = (width + columnsPerBand - 1) / columnsPerBand
+
+        dispatch_apply(bands, queue) { (band) in
+            let x0      = band * columnsPerBand
+            let columns = min(columnsPerBand, width - x0)
+            let state   = UnsafeMutablePointer<float4>.alloc(columns * 4)
+            defer { state.dealloc(columns * 4) }
+            IMPIIRGaussianBlur.recursion(pixels + x0, lines: columns, lineStep: 1,
+                length: height, sampleStep: stride, state: state, filter: filter)
+        }
+    }
+
+    ///  Forward and backward recursions of lines processed together
+    ///
+    ///  - parameter pixels:     first sample of the first line
+    ///  - parameter lines:      lines count
+    ///  - parameter lineStep:   pixels between first samples of neighbour lines
+    ///  - parameter length:     samples per line
+    ///  - parameter sampleStep: pixels between neighbour samples of a line
+    ///  - parameter state:      scratch of lines*4 vectors
+    ///  - parameter filter:     recursive filter coefficients
+    static func recursion(pixels:UnsafeMutablePointer<float4>, lines:Int, lineStep:Int, length:Int, sampleStep:Int,
+                          state:UnsafeMutablePointer<float4>, filter:IMPIIRFilterCoefficients) {
+
+        //
+        // Coefficients are captured as locals, so they live in registers inside loops
+        //
+        let b  = filter.coefficients.x
+        let a1 = filter.coefficients.y
+        let a2 = filter.coefficients.z
+        let a3 = filter.coefficients.w
+        let m0 = filter.boundary.0
+        let m1 = filter.boundary.1
+        let m2 = filter.boundary.2
+
+        let s1   = state
+        let s2   = state + lines
+        let s3   = state + lines * 2
+        let edge = state + lines * 3
+
+        let last = (length - 1) * sampleStep
+
+        for k in 0 ..< lines {
+            let p   = pixels + k * lineStep
+            s1[k]   = p[0]
+            s2[k]   = p[0]
+            s3[k]   = p[0]
+            edge[k] = p[last]
+        }
+
+        //
+        // forward
+        //
+        for i in 0 ..< length {
+            let p = pixels + i * sampleStep
+            for k in 0 ..< lines {
+                let j = k * lineStep
+                let y = b * p[j] + a1 * s1[k] + a2 * s2[k] + a3 * s3[k]
+                p[j]  = y
+                s3[k] = s2[k]
+                s2[k] = s1[k]
+                s1[k] = y
+            }
+        }
+
+        //
+        // backward initial conditions
+        //
+        for k in 0 ..< lines {
+            let u  = edge[k]
+            let d1 = s1[k] - u
+            let d2 = s2[k] - u
+            let d3 = s3[k] - u
+            let v0 = u + m0.x * d1 + m0.y * d2 + m0.z * d3
+            let v1 = u + m1.x * d1 + m1.y * d2 + m1.z * d3
+            let v2 = u + m2.x * d1 + m2.y * d2 + m2.z * d3
+            pixels[k * lineStep + last] = v0
+            s1[k] = v0
+            s2[k] = v1
+            s3[k] = v2
+        }
+
+        //
+        // backward
+        //
+        for i in (0 ..< length - 1).reverse() {
+            let p = pixels + i * sampleStep
+            for k in 0 ..< lines {
+                let j = k * lineStep
+                let y = b * p[j] + a1 * s1[k] + a2 * s2[k] + a3 * s3[k]
+                p[j]  = y
+                s3[k] = s2[k]
+                s2[k] = s1[k]
+                s1[k] = y
+            }
+        }
+    }
+
+    private var filter = IMPIIRFilterCoefficients()
+
+    private mutating func update() {
+        filter = sigma.iirGaussianFilter
+    }
+}
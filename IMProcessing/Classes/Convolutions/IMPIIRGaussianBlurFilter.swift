@@ -11,6 +11,20 @@ import simd
 
 public class IMPIIRGaussianBlurFilter: IMPFilter {
     
+    /// Blur backends, every one writes opaque alpha
+    public enum Backend {
+        /// Metal kernels
+        case GPU
+        /// Row-parallel IMPIIRGaussianBlur, used for RGBA8, RGBA16 and RGBA32Float textures
+        case CPU
+        /// IMPStackedBoxBlur approximation, integer sums for RGBA8 and RGBA16 textures
+        case Box
+        /// The cheaper of GPU and CPU by cost per pixel measured for the image size.
+        /// Both run the same recursion, so the choice does not change the result;
+        /// Box is not a candidate, it is not the IIR response
+        case Auto
+    }
+    
     public var radius:Int!{
         didSet{
             update()
@@ -18,6 +32,28 @@ public class IMPIIRGaussianBlurFilter: IMPFilter {
         }
     }
     
+    /// Metal kernels by default, CPU backends are opt-in
+    public var backend:Backend = .GPU {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    /// Box filters count of the Box backend
+    public var boxPasses:Int = 3 {
+        didSet{
+            boxBlur.passes = boxPasses
+            dirty = true
+        }
+    }
+    
+    /// Lines filtered by one GPU dispatch, the GPU scratch is linesPerBatch*max(width,height)*16 bytes
+    public var linesPerBatch:Int = 512 {
+        didSet{
+            dirty = true
+        }
+    }
+    
     public required init(context: IMPContext) {
         super.init(context: context)
         kernel_iirFilterHorizontal = IMPFunction(context: context, name: "kernel_iirFilterHorizontal")
@@ -34,19 +70,13 @@ public class IMPIIRGaussianBlurFilter: IMPFilter {
         }
         
         if dirty {
-            if let t = source?.texture{
+            if let inputTexture = source?.texture{
                 
                 executeSourceObservers(source)
                 
-                let inputTexture:MTLTexture! = self.source!.texture
-                
                 let width  = inputTexture.width
                 let height = inputTexture.height
                 
-                let threadgroupCounts = MTLSizeMake(1, 1, 1);
-                let threadgroupsX = MTLSizeMake(1, t.height,1);
-                let threadgroupsY = MTLSizeMake(t.width,1,1);
-
                 if self._destination.texture?.width != width || self._destination.texture?.height != height {
                     let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
                         inputTexture.pixelFormat,
@@ -54,73 +84,111 @@ public class IMPIIRGaussianBlurFilter: IMPFilter {
                     
                     self._destination.texture = self.context.device.newTextureWithDescriptor(descriptor)
                 }
-
-                let forwardWidth  = width+radius*3
-                let forwardHeight = height+radius*3
-                let length = forwardWidth * forwardHeight * 4 * sizeof(Float)
-
-                if self.inoutBuffer?.length != length {
-                    self.inoutBuffer = context.device.newBufferWithLength(length, options: .CPUCacheModeDefaultCache)
+                
+                let (method, trial) = backend == .Auto ? autoBackend(width * height) : (backend, false)
+                let start = NSDate.timeIntervalSinceReferenceDate()
+                
+                if method != .GPU {
+                    if cpuApply(inputTexture, destination: self._destination.texture!, box: method == .Box) {
+                        measure(method, time: NSDate.timeIntervalSinceReferenceDate() - start, pixels: width * height)
+                        executeDestinationObservers(_destination)
+                        dirty = false
+                        return _destination
+                    }
+                    else if backend == .Auto {
+                        //
+                        // the format can not be read on CPU, the method is never chosen for it again
+                        //
+                        measure(method, time: Double.infinity, pixels: width * height)
+                    }
                 }
 
-                if self.inoutBuffer2?.length != length {
-                    self.inoutBuffer2 = context.device.newBufferWithLength(length, options: .CPUCacheModeDefaultCache)
+                //
+                // every line keeps only its forward outputs, edges are initialized analytically,
+                // so the scratch is not padded and does not need to be cleared. Lines are streamed
+                // by batches through one scratch, so its size does not depend on the image area.
+                //
+                let lines  = min(max(linesPerBatch, 1), max(width, height))
+                let length = lines * max(width, height) * sizeof(float4)
+                
+                if self.scratchBuffer?.length != length {
+                    self.scratchBuffer = context.device.newBufferWithLength(length, options: .CPUCacheModeDefaultCache)
                 }
-
-                self.bsizeBuffer = self.bsizeBuffer ?? self.context.device.newBufferWithLength(sizeof(int2), options: .CPUCacheModeDefaultCache)
-                var bsize:int2 = int2(Int32(forwardWidth),Int32(forwardHeight))
-                memcpy(self.bsizeBuffer!.contents(), &bsize, self.bsizeBuffer!.length)
-
-                context.execute{ (commandBuffer) -> Void in
+                
+                let rowBatches    = (height + lines - 1) / lines
+                let columnBatches = (width  + lines - 1) / lines
+                
+                //
+                // (first line, lines) of every batch, offsets of constant buffers are 256 bytes aligned
+                //
+                let batchStride = 256
+                let batchLength = (rowBatches + columnBatches) * batchStride
+                
+                if self.batchBuffer?.length < batchLength {
+                    self.batchBuffer = context.device.newBufferWithLength(batchLength, options: .CPUCacheModeDefaultCache)
+                }
+                
+                for i in 0 ..< rowBatches + columnBatches {
+                    let first = i < rowBatches ? i * lines : (i - rowBatches) * lines
+                    var batch = uint2(UInt32(first), UInt32(lines))
+                    memcpy(self.batchBuffer!.contents() + i * batchStride, &batch, sizeof(uint2))
+                }
+                
+                let horizontal = kernel_iirFilterHorizontal.pipeline!
+                let vertical   = kernel_iirFilterVertical.pipeline!
+                
+                let threadsX = min(horizontal.threadExecutionWidth, lines)
+                let threadsY = min(vertical.threadExecutionWidth,   lines)
+                
+                let threadgroupCountsX = MTLSizeMake(1, threadsX, 1)
+                let threadgroupCountsY = MTLSizeMake(threadsY, 1, 1)
+                let threadgroupsX      = MTLSizeMake(1, (lines + threadsX - 1) / threadsX, 1)
+                let threadgroupsY      = MTLSizeMake((lines + threadsY - 1) / threadsY, 1, 1)
+                
+                //
+                //  Auto backend waits for the GPU only to measure its cost once for the size class
+                //
+                context.execute(complete: trial){ (commandBuffer) -> Void in
                     
                     //
                     // horizontal stage
                     //
-                    var blitEncoder = commandBuffer.blitCommandEncoder()
-                    blitEncoder.fillBuffer(self.inoutBuffer!, range: NSRange(location: 0, length: self.inoutBuffer!.length), value: 0)
-                    blitEncoder.fillBuffer(self.inoutBuffer2!,range: NSRange(location: 0, length:self.inoutBuffer2!.length), value: 0)
-                    blitEncoder.endEncoding()
-
-                    var commandEncoder = commandBuffer.computeCommandEncoder()
+                    for i in 0 ..< rowBatches {
+                        let commandEncoder = commandBuffer.computeCommandEncoder()
+                        
+                        commandEncoder.setComputePipelineState(horizontal)
+                        
+                        commandEncoder.setTexture(inputTexture,    atIndex: 0)
+                        commandEncoder.setTexture(self._destination.texture,    atIndex: 1)
+                        commandEncoder.setBuffer(self.scratchBuffer, offset: 0, atIndex: 0)
+                        commandEncoder.setBuffer(self.filterBuffer,  offset: 0, atIndex: 1)
+                        commandEncoder.setBuffer(self.batchBuffer,   offset: i * batchStride, atIndex: 2)
+                        
+                        commandEncoder.dispatchThreadgroups(threadgroupsX, threadsPerThreadgroup:threadgroupCountsX)
+                        commandEncoder.endEncoding()
+                    }
                     
-                    commandEncoder.setComputePipelineState(self.kernel_iirFilterHorizontal.pipeline!)
-                    
-                    commandEncoder.setTexture(inputTexture,    atIndex: 0)
-                    commandEncoder.setTexture(self._destination.texture,    atIndex: 1)
-                    commandEncoder.setTexture(self.bTexture,   atIndex: 2)
-                    commandEncoder.setTexture(self.aTexture,   atIndex: 3)
-                    commandEncoder.setBuffer(self.inoutBuffer,  offset: 0, atIndex: 0)
-                    commandEncoder.setBuffer(self.inoutBuffer2, offset: 0, atIndex: 1)
-                    commandEncoder.setBuffer(self.bsizeBuffer,  offset: 0, atIndex: 2)
-                    commandEncoder.setBuffer(self.radiusBuffer, offset: 0, atIndex: 3)
-
-                    commandEncoder.dispatchThreadgroups(threadgroupsX, threadsPerThreadgroup:threadgroupCounts)
-                    commandEncoder.endEncoding()
-
-                
                     //
                     // vertical stage
                     //
-                    blitEncoder = commandBuffer.blitCommandEncoder()
-                    blitEncoder.fillBuffer(self.inoutBuffer!, range: NSRange(location: 0, length: self.inoutBuffer!.length), value: 0)
-                    blitEncoder.fillBuffer(self.inoutBuffer2!,range: NSRange(location: 0, length:self.inoutBuffer2!.length), value: 0)
-                    blitEncoder.endEncoding()
-                    
-                    commandEncoder = commandBuffer.computeCommandEncoder()
-                    
-                    commandEncoder.setComputePipelineState(self.kernel_iirFilterVertical.pipeline!)
-                    
-                    commandEncoder.setTexture(self._destination.texture,    atIndex: 0)
-                    commandEncoder.setTexture(self._destination.texture,    atIndex: 1)
-                    commandEncoder.setTexture(self.bTexture,   atIndex: 2)
-                    commandEncoder.setTexture(self.aTexture,   atIndex: 3)
-                    commandEncoder.setBuffer(self.inoutBuffer,  offset: 0, atIndex: 0)
-                    commandEncoder.setBuffer(self.inoutBuffer2, offset: 0, atIndex: 1)
-                    commandEncoder.setBuffer(self.bsizeBuffer,  offset: 0, atIndex: 2)
-                    commandEncoder.setBuffer(self.radiusBuffer, offset: 0, atIndex: 3)
-                    
-                    commandEncoder.dispatchThreadgroups(threadgroupsY, threadsPerThreadgroup:threadgroupCounts)
-                    commandEncoder.endEncoding()
+                    for i in rowBatches ..< rowBatches + columnBatches {
+                        let commandEncoder = commandBuffer.computeCommandEncoder()
+                        
+                        commandEncoder.setComputePipelineState(vertical)
+                        
+                        commandEncoder.setTexture(self._destination.texture,    atIndex: 0)
+                        commandEncoder.setTexture(self._destination.texture,    atIndex: 1)
+                        commandEncoder.setBuffer(self.scratchBuffer, offset: 0, atIndex: 0)
+                        commandEncoder.setBuffer(self.filterBuffer,  offset: 0, atIndex: 1)
+                        commandEncoder.setBuffer(self.batchBuffer,   offset: i * batchStride, atIndex: 2)
+                        
+                        commandEncoder.dispatchThreadgroups(threadgroupsY, threadsPerThreadgroup:threadgroupCountsY)
+                        commandEncoder.endEncoding()
+                    }
+                }
+                
+                if trial {
+                    measure(.GPU, time: NSDate.timeIntervalSinceReferenceDate() - start, pixels: width * height)
                 }
                 
                 executeDestinationObservers(_destination)
@@ -152,28 +220,187 @@ public class IMPIIRGaussianBlurFilter: IMPFilter {
 //        return destinationContainer
 //    }
     
+    ///
+    /// Seconds per pixel of backends measured on previous applies, keyed by the image size class:
+    /// fixed costs of copies and command buffers weigh differently for small and large images
+    ///
+    private struct Measurement: Hashable {
+        let backend:Backend
+        let sizeClass:Int
+        var hashValue: Int { return backend.hashValue &* 31 &+ sizeClass }
+    }
+    
+    private var costs = [Measurement:Double]()
+    
+    static func sizeClass(pixels:Int) -> Int {
+        //
+        // power of 2 buckets of pixels count
+        //
+        return Int(log2(Double(max(pixels, 1))))
+    }
+    
+    func measure(method:Backend, time:NSTimeInterval, pixels:Int) {
+        let key  = Measurement(backend: method, sizeClass: IMPIIRGaussianBlurFilter.sizeClass(pixels))
+        let cost = time / Double(max(pixels, 1))
+        if let c = costs[key] {
+            costs[key] = c * 0.75 + cost * 0.25
+        }
+        else {
+            costs[key] = cost
+        }
+    }
+    
+    func autoBackend(pixels:Int) -> (backend:Backend, trial:Bool) {
+        let sizeClass = IMPIIRGaussianBlurFilter.sizeClass(pixels)
+        //
+        // every method is O(1) per pixel for the radius: candidates are measured once
+        // for the image size, then the cheapest wins
+        //
+        var best:(backend:Backend, cost:Double)? = nil
+        for backend in [Backend.GPU, .CPU] {
+            guard let cost = costs[Measurement(backend: backend, sizeClass: sizeClass)] else { return (backend, true) }
+            if best == nil || cost < best!.cost {
+                best = (backend, cost)
+            }
+        }
+        return (best!.backend, false)
+    }
+    
+    func cpuApply(source:MTLTexture, destination:MTLTexture, box:Bool = false) -> Bool {
+        
+        let isByte  = source.pixelFormat == .RGBA8Unorm || source.pixelFormat == .BGRA8Unorm
+        let isWord  = source.pixelFormat == .RGBA16Unorm
+        let isFloat = source.pixelFormat == .RGBA32Float
+        
+        guard isByte || isWord || isFloat else { return false }
+        
+        let width       = source.width
+        let height      = source.height
+        let count       = width * height * 4
+        let bytesPerRow = width * 4 * (isByte ? sizeof(UInt8) : isWord ? sizeof(UInt16) : sizeof(Float))
+        let region      = MTLSize(width: width, height: height, depth: 1)
+        
+        if pixelBuffer?.length != bytesPerRow * height {
+            pixelBuffer = context.device.newBufferWithLength(bytesPerRow * height, options: .CPUCacheModeDefaultCache)
+        }
+        
+        if (isByte || isWord) && !box && floatBuffer?.length != count * sizeof(Float) {
+            floatBuffer = context.device.newBufferWithLength(count * sizeof(Float), options: .CPUCacheModeDefaultCache)
+        }
+        
+        let buffer = pixelBuffer!
+        
+        context.execute(complete: true) { (commandBuffer) in
+            let blitEncoder = commandBuffer.blitCommandEncoder()
+            blitEncoder.copyFromTexture(source,
+                sourceSlice: 0,
+                sourceLevel: 0,
+                sourceOrigin: MTLOrigin(x: 0, y: 0, z: 0),
+                sourceSize: region,
+                toBuffer: buffer,
+                destinationOffset: 0,
+                destinationBytesPerRow: bytesPerRow,
+                destinationBytesPerImage: 0)
+            blitEncoder.endEncoding()
+        }
+        
+        if box && isByte {
+            //
+            // integer sums run on the texture data directly
+            //
+            boxBlur.apply(bytes: UnsafeMutablePointer<UInt8>(buffer.contents()), width: width, height: height)
+        }
+        else if box && isWord {
+            boxBlur.apply(words: UnsafeMutablePointer<UInt16>(buffer.contents()), width: width, height: height)
+        }
+        else {
+            
+            let pixels = isFloat ? UnsafeMutablePointer<Float>(buffer.contents()) : UnsafeMutablePointer<Float>(floatBuffer!.contents())
+            let floatsPerRow = width * sizeof(float4)
+            
+            if isByte {
+                IMPConvertRGBA8ToFloat(buffer.contents(), bytesPerRow, pixels, floatsPerRow, width, height)
+            }
+            else if isWord {
+                IMPConvertRGBA16ToFloat(buffer.contents(), bytesPerRow, pixels, floatsPerRow, width, height)
+            }
+            
+            if box {
+                boxBlur.apply(UnsafeMutablePointer<float4>(pixels), width: width, height: height)
+            }
+            else {
+                cpuBlur.apply(UnsafeMutablePointer<float4>(pixels), width: width, height: height)
+            }
+            
+            if isByte {
+                IMPConvertFloatToRGBA8(pixels, floatsPerRow, buffer.contents(), bytesPerRow, width, height)
+            }
+            else if isWord {
+                IMPConvertFloatToRGBA16(pixels, floatsPerRow, buffer.contents(), bytesPerRow, width, height)
+            }
+        }
+        
+        //
+        // kernels write opaque pixels, so do all backends
+        //
+        IMPIIRGaussianBlurFilter.opaque(buffer.contents(), width: width, height: height,
+                                        size: isByte ? sizeof(UInt8) : isWord ? sizeof(UInt16) : sizeof(Float))
+        
+        context.execute(complete: true) { (commandBuffer) in
+            let blitEncoder = commandBuffer.blitCommandEncoder()
+            blitEncoder.copyFromBuffer(buffer,
+                sourceOffset: 0,
+                sourceBytesPerRow: bytesPerRow,
+                sourceBytesPerImage: 0,
+                sourceSize: region,
+                toTexture: destination,
+                destinationSlice: 0,
+                destinationLevel: 0,
+                destinationOrigin: MTLOrigin(x: 0, y: 0, z: 0))
+            blitEncoder.endEncoding()
+        }
+        
+        return true
+    }
+    
+    static func opaque(pixels:UnsafeMutablePointer<Void>, width:Int, height:Int, size:Int) {
+        dispatch_apply(height, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (y) in
+            let count = width * 4
+            switch size {
+            case sizeof(UInt8):
+                let row = UnsafeMutablePointer<UInt8>(pixels) + y * count
+                for x in 3.stride(to: count, by: 4) { row[x] = UInt8.max }
+            case sizeof(UInt16):
+                let row = UnsafeMutablePointer<UInt16>(pixels) + y * count
+                for x in 3.stride(to: count, by: 4) { row[x] = UInt16.max }
+            default:
+                let row = UnsafeMutablePointer<Float>(pixels) + y * count
+                for x in 3.stride(to: count, by: 4) { row[x] = 1 }
+            }
+        }
+    }
+    
     func update(){
         if radius>1{
-            radiusBuffer = radiusBuffer ?? context.device.newBufferWithLength(sizeofValue(radius), options: .CPUCacheModeDefaultCache)
-            memcpy(radiusBuffer.contents(), &radius, radiusBuffer.length)
-            let (b,a) = radius.float.iirGaussianCoefficients
-            bTexture = context.device.texture1D(b)
-            aTexture = context.device.texture1D(a)
+            cpuBlur.sigma = radius.float
+            boxBlur.sigma = radius.float
+            var filter = radius.float.iirGaussianFilter
+            filterBuffer = filterBuffer ?? context.device.newBufferWithLength(sizeof(IMPIIRFilterCoefficients), options: .CPUCacheModeDefaultCache)
+            memcpy(filterBuffer.contents(), &filter, filterBuffer.length)
         }
     }
     
     private var kernel_iirFilterHorizontal:IMPFunction!
     private var kernel_iirFilterVertical:IMPFunction!
     
-    private var radiusBuffer:MTLBuffer!
-    private var inoutBuffer :MTLBuffer?
-    private var inoutBuffer2:MTLBuffer?
-    //private var texture     :MTLTexture?
-    private var bsizeBuffer:MTLBuffer?
+    private var filterBuffer:MTLBuffer!
+    private var scratchBuffer:MTLBuffer?
+    private var batchBuffer:MTLBuffer?
     
-
-    var bTexture:MTLTexture!
-    var aTexture:MTLTexture!
+    private var cpuBlur = IMPIIRGaussianBlur(sigma: 0)
+    private var boxBlur = IMPStackedBoxBlur(sigma: 0)
+    private var pixelBuffer:MTLBuffer?
+    private var floatBuffer:MTLBuffer?
 }
 
 
@@ -207,6 +434,45 @@ public extension Float {
         }
     }
 
+    ///
+    /// Young–van Vliet coefficients with the Triggs–Sdika boundary matrix.
+    /// Forward pass starts from the steady state of the first sample, backward pass
+    /// starts from y[N-1], y[N], y[N+1] = u + M * (w[N-1]-u, w[N-2]-u, w[N-3]-u),
+    /// where w is the forward output and u is the last sample, so the result equals
+    /// the filter of the infinitely replicated edges without any padding.
+    ///
+    public var iirGaussianFilter: IMPIIRFilterCoefficients {
+        get {
+            let (b,a) = self.iirGaussianCoefficients
+
+            //
+            // B. Triggs, M. Sdika, Boundary conditions for Young-van Vliet recursive filtering
+            //
+            let a1 = a[1]
+            let a2 = a[2]
+            let a3 = a[3]
+
+            let scale = b[0]/((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3))
+
+            let m0 = float4( 1 - a3*a1 - a3*a3 - a2,
+                             (a3 + a1) * (a2 + a3*a1),
+                             a3 * (a1 + a3*a2),
+                             0) * scale
+            let m1 = float4( a1 + a3*a2,
+                             (1 - a2) * (a2 + a3*a1),
+                             -a3 * (a3*a1 + a3*a3 + a2 - 1),
+                             0) * scale
+            let m2 = float4( a3*a1 + a2 + a1*a1 - a2*a2,
+                             a1*a2 + a3*a2*a2 - a1*a3*a3 - a3*a3*a3 - a3*a2 + a3,
+                             a3 * (a1 + a3*a2),
+                             0) * scale
+
+            return IMPIIRFilterCoefficients(
+                coefficients: float4(b[0], a1, a2, a3),
+                boundary: (m0, m1, m2))
+        }
+    }
+
     public var iirGaussianCoefficients2: (b:[Float],a:[Float]) {
         
         //
@@ -250,3 +516,7 @@ public func * (left:[Float],right:Float) -> [Float] {
     return ret
 }
 
+
+private func == (left:IMPIIRGaussianBlurFilter.Measurement, right:IMPIIRGaussianBlurFilter.Measurement) -> Bool {
+    return left.backend == right.backend && left.sizeClass == right.sizeClass
+}
@@ -0,0 +1,293 @@
+//
+//  IMPMorphology.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import simd
+
+///
+/// CPU grayscale morphology of RGBA float pixels with flat rectangular and line
+/// structuring elements. Every 1D pass is van Herk/Gil–Werman: the line is split
+/// into blocks of the window size, block prefix and suffix extremums are computed,
+/// and the window extremum is the extremum of one suffix and one prefix value, so
+/// cost per pixel does not depend on radius.
+///
+/// Pixels outside of the image do not contribute to the window. Horizontal pass
+/// runs rows concurrently, vertical pass runs across contiguous rows in column bands,
+/// so the image is never transposed.
+///
+public struct IMPMorphology {
+
+    /// Structuring element
+    public enum Element {
+        /// (2*radiusX+1) x (2*radiusY+1) rectangle
+        case Rectangle(radiusX:Int, radiusY:Int)
+        /// 2*radius+1 horizontal line
+        case HorizontalLine(radius:Int)
+        /// 2*radius+1 vertical line
+        case VerticalLine(radius:Int)
+
+        var radius:(x:Int, y:Int) {
+            switch self {
+            case .Rectangle(let x, let y):
+                return (max(x, 0), max(y, 0))
+            case .HorizontalLine(let x):
+                return (max(x, 0), 0)
+            case .VerticalLine(let y):
+                return (0, max(y, 0))
+            }
+        }
+    }
+
+    /// Morphology operation
+    public enum Operation {
+        case Erode
+        case Dilate
+        /// Erode then dilate
+        case Open
+        /// Dilate then erode
+        case Close
+        /// Dilate minus erode of colors, alpha is kept
+        case Gradient
+    }
+
+    /// Columns processed together by the vertical pass
+    public static let columnsPerBand = 64
+
+    /// Structuring element
+    public var element:Element
+
+    public init(element:Element) {
+        self.element = element
+    }
+
+    ///  Apply operation to pixels in place
+    ///
+    ///  - parameter operation: morphology operation
+    ///  - parameter pixels:    rgba pixels
+    ///  - parameter width:     image width
+    ///  - parameter height:    image height
+    ///  - parameter stride:    pixels per row, width by default
+    public func apply(operation:Operation, pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+
+        guard width > 0 && height > 0 else { return }
+
+        let stride = stride > 0 ? stride : width
+
+        switch operation {
+        case .Erode:
+            extremum(pixels, width: width, height: height, stride: stride, dilate: false)
+        case .Dilate:
+            extremum(pixels, width: width, height: height, stride: stride, dilate: true)
+        case .Open:
+            extremum(pixels, width: width, height: height, stride: stride, dilate: false)
+            extremum(pixels, width: width, height: height, stride: stride, dilate: true)
+        case .Close:
+            extremum(pixels, width: width, height: height, stride: stride, dilate: true)
+            extremum(pixels, width: width, height: height, stride: stride, dilate: false)
+        case .Gradient:
+            let eroded = UnsafeMutablePointer<float4>.alloc(width * height)
+            let alpha  = UnsafeMutablePointer<Float>.alloc(width * height)
+            defer {
+                eroded.dealloc(width * height)
+                alpha.dealloc(width * height)
+            }
+
+            for y in 0 ..< height {
+                let p = pixels + y * stride
+                let a = alpha + y * width
+                eroded.advancedBy(y * width).assignFrom(p, count: width)
+                for x in 0 ..< width {
+                    a[x] = p[x].w
+                }
+            }
+
+            extremum(pixels, width: width, height: height, stride: stride, dilate: true)
+            extremum(eroded, width: width, height: height, stride: width, dilate: false)
+
+            //
+            // gradient of colors only, the source alpha is kept
+            //
+            dispatch_apply(height, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (y) in
+                let p = pixels + y * stride
+                let e = eroded + y * width
+                let a = alpha  + y * width
+                for x in 0 ..< width {
+                    p[x] = float4(rgb: p[x].xyz - e[x].xyz, a: a[x])
+                }
+            }
+        }
+    }
+
+    ///  Erode pixels in place
+    public func erode(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+        apply(.Erode, pixels: pixels, width: width, height: height, stride: stride)
+    }
+
+    ///  Dilate pixels in place
+    public func dilate(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+        apply(.Dilate, pixels: pixels, width: width, height: height, stride: stride)
+    }
+
+    func extremum(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int, dilate:Bool) {
+
+        let radius = element.radius
+        let queue  = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)
+
+        //
+        // out of image pixels are the identity of the operation
+        //
+        let identity = float4(dilate ? -Float.infinity : Float.infinity)
+
+        //
+        // horizontal stage
+        //
+        if radius.x > 0 {
+
+            let r      = radius.x
+            let window = 2 * r + 1
+            let length = width + 2 * r
+            let strips = min(NSProcessInfo.processInfo().activeProcessorCount, height)
+            let rows   = (height + strips - 1) / strips
+
+            dispatch_apply(strips, queue) { (strip) in
+
+                let y0 = strip * rows
+                let y1 = min(y0 + rows, height)
+
+                guard y0 < y1 else { return }
+
+                let line   = UnsafeMutablePointer<float4>.alloc(length)
+                let prefix = UnsafeMutablePointer<float4>.alloc(length)
+                let suffix = UnsafeMutablePointer<float4>.alloc(length)
+
+                defer {
+                    line.dealloc(length)
+                    prefix.dealloc(length)
+                    suffix.dealloc(length)
+                }
+
+                for i in 0 ..< r {
+                    line[i] = identity
+                    line[r + width + i] = identity
+                }
+
+                for y in y0 ..< y1 {
+
+                    let p = pixels + y * stride
+
+                    (line + r).assignFrom(p, count: width)
+
+                    IMPMorphology.blocks(line, prefix: prefix, suffix: suffix, length: length, window: window, dilate: dilate)
+
+                    //
+                    // window [x, x+2r] of the padded line spans at most two blocks
+                    //
+                    for x in 0 ..< width {
+                        p[x] = IMPMorphology.extremum(suffix[x], prefix[x + 2 * r], dilate: dilate)
+                    }
+                }
+            }
+        }
+
+        //
+        // vertical stage
+        //
+        if radius.y > 0 {
+
+            let r      = radius.y
+            let window = 2 * r + 1
+            let length = height + 2 * r
+
+            let columnsPerBand = IMPMorphology.columnsPerBand
+            let bands = (width + columnsPerBand - 1) / columnsPerBand
+
+            dispatch_apply(bands, queue) { (band) in
+
+                let x0 = band * columnsPerBand
+                let x1 = min(x0 + columnsPerBand, width)
+                let n  = x1 - x0
+
+                let prefix = UnsafeMutablePointer<float4>.alloc(length * n)
+                let suffix = UnsafeMutablePointer<float4>.alloc(length * n)
+
+                defer {
+                    prefix.dealloc(length * n)
+                    suffix.dealloc(length * n)
+                }
+
+                @inline(__always) func row(y:Int) -> UnsafeMutablePointer<float4>? {
+                    let i = y - r
+                    return i >= 0 && i < height ? pixels + i * stride + x0 : nil
+                }
+
+                //
+                // the same block scans as the horizontal stage, a whole band row at a time
+                //
+                for y in 0 ..< length {
+                    let g = prefix + y * n
+                    let s = row(y)
+                    if y % window == 0 {
+                        for x in 0 ..< n { g[x] = s?[x] ?? identity }
+                    }
+                    else {
+                        let gp = g - n
+                        if let s = s {
+                            for x in 0 ..< n { g[x] = IMPMorphology.extremum(gp[x], s[x], dilate: dilate) }
+                        }
+                        else {
+                            g.assignFrom(gp, count: n)
+                        }
+                    }
+                }
+
+                for y in (0 ..< length).reverse() {
+                    let h = suffix + y * n
+                    let s = row(y)
+                    if (y + 1) % window == 0 || y == length - 1 {
+                        for x in 0 ..< n { h[x] = s?[x] ?? identity }
+                    }
+                    else {
+                        let hn = h + n
+                        if let s = s {
+                            for x in 0 ..< n { h[x] = IMPMorphology.extremum(hn[x], s[x], dilate: dilate) }
+                        }
+                        else {
+                            h.assignFrom(hn, count: n)
+                        }
+                    }
+                }
+
+                for y in 0 ..< height {
+                    let p = pixels + y * stride + x0
+                    let h = suffix + y * n
+                    let g = prefix + (y + 2 * r) * n
+                    for x in 0 ..< n {
+                        p[x] = IMPMorphology.extremum(h[x], g[x], dilate: dilate)
+                    }
+                }
+            }
+        }
+    }
+
+    ///  Block prefix and suffix extremums of a line
+    static func blocks(line:UnsafePointer<float4>, prefix:UnsafeMutablePointer<float4>, suffix:UnsafeMutablePointer<float4>,
+                       length:Int, window:Int, dilate:Bool) {
+
+        for i in 0 ..< length {
+            prefix[i] = i % window == 0 ? line[i] : extremum(prefix[i - 1], line[i], dilate: dilate)
+        }
+
+        for i in (0 ..< length).reverse() {
+            suffix[i] = (i + 1) % window == 0 || i == length - 1 ? line[i] : extremum(suffix[i + 1], line[i], dilate: dilate)
+        }
+    }
+
+    @inline(__always) static func extremum(a:float4, _ b:float4, dilate:Bool) -> float4 {
+        return dilate ? max(a, b) : min(a, b)
+    }
+}
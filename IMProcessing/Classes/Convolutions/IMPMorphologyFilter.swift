@@ -0,0 +1,53 @@
+//
+//  IMPMorphologyFilter.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+/// Erode, dilate, open, close and morphological gradient filter.
+/// Cost per pixel does not depend on the structuring element size.
+public class IMPMorphologyFilter: IMPFilter {
+
+    public typealias Operation = IMPMorphology.Operation
+    public typealias Element   = IMPMorphology.Element
+
+    /// Morphology operation
+    public var operation:Operation = .Erode {
+        didSet{
+            dirty = true
+        }
+    }
+
+    /// Structuring element
+    public var element:Element = .Rectangle(radiusX: 0, radiusY: 0) {
+        didSet{
+            dirty = true
+        }
+    }
+
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+
+        let radius = element.radius
+
+        guard radius.x > 0 || radius.y > 0 else { return nil }
+
+        guard var cpu = cpuPass(source: source, destination: provider) else { return nil }
+
+        let morphology = IMPMorphology(element: element)
+
+        let (width, height) = (cpu.width, cpu.height)
+
+        cpu.pixels.withUnsafeMutableBufferPointer { (pixels) -> Void in
+            morphology.apply(self.operation, pixels: pixels.baseAddress, width: width, height: height)
+        }
+
+        cpu.destination.update(pixels: cpu.pixels)
+
+        return cpu.destination
+    }
+}
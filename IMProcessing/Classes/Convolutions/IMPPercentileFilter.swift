@@ -0,0 +1,51 @@
+//
+//  IMPPercentileFilter.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+/// Local percentile filter: every pixel is replaced by the percentile of its window.
+/// Cost per pixel does not depend on radius.
+public class IMPPercentileFilter: IMPFilter {
+    
+    /// Window radius, window size is 2*radius+1
+    public var radius:Int = 0 {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    /// Percentile in [0,1]
+    public var percentile:Float = 0.5 {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+        
+        guard radius > 0 else { return nil }
+        
+        guard let cpu = cpuPass(source: source, destination: provider) else { return nil }
+        
+        cpu.destination.update(pixels: IMPSlidingHistogram.percentile(cpu.pixels,
+            width: cpu.width, height: cpu.height,
+            radius: radius, percentile: percentile))
+        
+        return cpu.destination
+    }
+}
+
+/// Local median filter
+public class IMPMedianFilter: IMPPercentileFilter {
+    
+    public required init(context: IMPContext) {
+        super.init(context: context)
+        percentile = 0.5
+    }
+}
@@ -0,0 +1,170 @@
+//
+//  IMPSeparableGaussianBlur.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import simd
+
+///
+/// CPU separable gaussian blur of RGBA float pixels with the same kernel as IMPGaussianBlurFilter.
+/// The kernel is symmetric, so every pass sums mirrored pixels pairs and multiplies them once.
+///
+/// Horizontal pass reads every row through a short edge-clamped line, vertical pass runs over
+/// tiles of rows in column bands, so the window rows of a band stay in cache while
+/// output rows of the tile are accumulated. Blending of the result over the source is fused
+/// into the vertical pass. Best suited to medium radii, where the recursive blur costs more.
+///
+public struct IMPSeparableGaussianBlur {
+
+    /// Output rows of the vertical pass tile
+    public static let rowsPerTile    = 32
+
+    /// Columns of the vertical pass tile
+    public static let columnsPerBand = 64
+
+    /// Kernel size in pixels, the same as IMPGaussianBlurFilter.radius
+    public var radius:Int {
+        didSet{
+            update()
+        }
+    }
+
+    /// Half of the normalized kernel: center weight first
+    public private(set) var weights = [Float]()
+
+    public init(radius:Int) {
+        self.radius = radius
+        update()
+    }
+
+    ///  Blur pixels
+    ///
+    ///  - parameter source:      pixels in rgba order, as MTLTexture.pixels(_:) reads them, luminosity and color
+    ///                           blend modes mix channels, so bgra pixels would not match the kernels
+    ///  - parameter destination: blurred pixels, must not be the source
+    ///  - parameter width:       image width
+    ///  - parameter height:      image height
+    ///  - parameter blending:    blending of the blurred color over the source, alpha of the source is kept when nil
+    public func apply(source:UnsafePointer<float4>, destination:UnsafeMutablePointer<float4>,
+                      width:Int, height:Int, blending:IMPBlending? = nil) {
+
+        guard width > 0 && height > 0 else { return }
+
+        let weights = self.weights
+        let r       = weights.count - 1
+        let queue   = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)
+
+        guard r > 0 else {
+            destination.assignFrom(UnsafeMutablePointer<float4>(source), count: width * height)
+            return
+        }
+
+        let rows = UnsafeMutablePointer<float4>.alloc(width * height)
+        defer { rows.dealloc(width * height) }
+
+        weights.withUnsafeBufferPointer { (weights) -> Void in
+
+            let w = weights.baseAddress
+
+            //
+            // horizontal stage
+            //
+            let strips  = min(NSProcessInfo.processInfo().activeProcessorCount, height)
+            let perStrip = (height + strips - 1) / strips
+            let length  = width + 2 * r
+
+            dispatch_apply(strips, queue) { (strip) in
+
+                let y0 = strip * perStrip
+                let y1 = min(y0 + perStrip, height)
+
+                guard y0 < y1 else { return }
+
+                let line = UnsafeMutablePointer<float4>.alloc(length)
+                defer { line.dealloc(length) }
+
+                for y in y0 ..< y1 {
+
+                    let src = source + y * width
+                    let dst = rows + y * width
+
+                    for i in 0 ..< r {
+                        line[i] = src[0]
+                        line[r + width + i] = src[width - 1]
+                    }
+                    (line + r).assignFrom(UnsafeMutablePointer<float4>(src), count: width)
+
+                    for x in 0 ..< width {
+                        let c   = line + x + r
+                        var sum = w[0] * c[0]
+                        for k in 1 ... r {
+                            sum += w[k] * (c[-k] + c[k])
+                        }
+                        dst[x] = sum
+                    }
+                }
+            }
+
+            //
+            // vertical stage with blending
+            //
+            let rowsPerTile    = IMPSeparableGaussianBlur.rowsPerTile
+            let columnsPerBand = IMPSeparableGaussianBlur.columnsPerBand
+            let tiles          = (height + rowsPerTile - 1) / rowsPerTile
+            let bands          = (width + columnsPerBand - 1) / columnsPerBand
+
+            dispatch_apply(tiles * bands, queue) { (index) in
+
+                let y0 = (index / bands) * rowsPerTile
+                let y1 = min(y0 + rowsPerTile, height)
+                let x0 = (index % bands) * columnsPerBand
+                let n  = min(columnsPerBand, width - x0)
+
+                let sum = UnsafeMutablePointer<float4>.alloc(n)
+                defer { sum.dealloc(n) }
+
+                for y in y0 ..< y1 {
+
+                    let center = rows + y * width + x0
+                    let w0     = w[0]
+
+                    for x in 0 ..< n {
+                        sum[x] = w0 * center[x]
+                    }
+
+                    for k in 1 ... r {
+                        let top    = rows + max(y - k, 0) * width + x0
+                        let bottom = rows + min(y + k, height - 1) * width + x0
+                        let wk     = w[k]
+                        for x in 0 ..< n {
+                            sum[x] += wk * (top[x] + bottom[x])
+                        }
+                    }
+
+                    let src = source + y * width + x0
+                    let dst = destination + y * width + x0
+
+                    if let blending = blending {
+                        for x in 0 ..< n {
+                            dst[x] = blending.blend(base: src[x], overlay: float4(rgb: sum[x].xyz, a: 1))
+                        }
+                    }
+                    else {
+                        for x in 0 ..< n {
+                            dst[x] = float4(rgb: sum[x].xyz, a: src[x].w)
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    private mutating func update() {
+        let kernel = radius > 1 ? radius.gaussianKernel : [Float(1)]
+        weights = Array(kernel[kernel.count / 2 ..< kernel.count])
+    }
+}
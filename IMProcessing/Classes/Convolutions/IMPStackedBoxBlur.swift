@@ -0,0 +1,354 @@
+//
+//  IMPStackedBoxBlur.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import simd
+
+///
+/// Gaussian blur approximation by 3-5 successive box filters (central limit theorem).
+/// Box widths are chosen so the variance of the stack equals sigma^2. Every box is a running
+/// sum, so cost per pixel does not depend on sigma. 8 and 16 bits pixels are filtered
+/// with integer sums of fixed point intermediates, float pixels with vector sums.
+///
+/// Horizontal passes run rows concurrently, vertical passes run across contiguous rows
+/// in column bands, so the image is never transposed. Edges are clamped.
+///
+public struct IMPStackedBoxBlur {
+
+    /// Columns processed together by the vertical pass
+    public static let columnsPerBand = 64
+
+    /// Gaussian sigma
+    public var sigma:Float {
+        didSet{
+            update()
+        }
+    }
+
+    /// Box filters count: 3...5
+    public var passes:Int {
+        didSet{
+            update()
+        }
+    }
+
+    /// Box radii of passes
+    public private(set) var radii = [Int]()
+
+    public init(sigma:Float, passes:Int = 3) {
+        self.sigma = sigma
+        self.passes = passes
+        update()
+    }
+
+    ///  Box radii which stack variance is the closest to sigma^2
+    ///
+    ///  - parameter sigma:  gaussian sigma
+    ///  - parameter passes: box filters count
+    ///
+    ///  - returns: radii of passes, window size is 2*radius+1
+    public static func radii(sigma sigma:Float, passes:Int) -> [Int] {
+
+        let n      = Float(passes)
+        let ideal  = sqrt(12 * sigma * sigma / n + 1)
+        var lower  = Int(floor(ideal))
+        if lower % 2 == 0 { lower -= 1 }
+        lower      = max(lower, 1)
+        let upper  = lower + 2
+        let wl     = Float(lower)
+
+        //
+        // m passes of the lower width and n-m of the upper one
+        //
+        let m = Int(round((12 * sigma * sigma - n * wl * wl - 4 * n * wl - 3 * n) / (-4 * wl - 4)))
+
+        return (0 ..< passes).map { (i) -> Int in
+            return ((i < m ? lower : upper) - 1) / 2
+        }
+    }
+
+    ///  Blur float pixels in place
+    ///
+    ///  - parameter pixels: rgba pixels
+    ///  - parameter width:  image width
+    ///  - parameter height: image height
+    ///  - parameter stride: pixels per row, width by default
+    public func apply(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+
+        guard width > 1 && height > 1 && radii.contains({ $0 > 0 }) else { return }
+
+        let stride = stride > 0 ? stride : width
+        let radii  = self.radii
+        let queue  = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)
+
+        //
+        // horizontal stage
+        //
+        dispatch_apply(height, queue) { (y) in
+
+            let row  = pixels + y * stride
+            let line = UnsafeMutablePointer<float4>.alloc(width)
+            defer { line.dealloc(width) }
+
+            for r in radii where r > 0 {
+
+                line.assignFrom(row, count: width)
+
+                let scale = 1 / Float(2 * r + 1)
+                let last  = width - 1
+
+                var sum = Float(r + 1) * line[0]
+                for i in 1 ... r {
+                    sum += line[min(i, last)]
+                }
+
+                for x in 0 ..< width {
+                    row[x] = sum * scale
+                    sum += line[min(x + r + 1, last)] - line[max(x - r, 0)]
+                }
+            }
+        }
+
+        //
+        // vertical stage
+        //
+        let columnsPerBand = IMPStackedBoxBlur.columnsPerBand
+        let bands = (width + columnsPerBand - 1) / columnsPerBand
+
+        dispatch_apply(bands, queue) { (band) in
+
+            let x0 = band * columnsPerBand
+            let n  = min(columnsPerBand, width - x0)
+
+            let maximum = radii.maxElement()!
+            let sums    = UnsafeMutablePointer<float4>.alloc(n)
+            let first   = UnsafeMutablePointer<float4>.alloc(n)
+            let ring    = UnsafeMutablePointer<float4>.alloc((maximum + 1) * n)
+
+            defer {
+                sums.dealloc(n)
+                first.dealloc(n)
+                ring.dealloc((maximum + 1) * n)
+            }
+
+            for r in radii where r > 0 {
+
+                let scale = 1 / Float(2 * r + 1)
+                let last  = height - 1
+                let top   = pixels + x0
+
+                first.assignFrom(top, count: n)
+
+                for x in 0 ..< n { sums[x] = Float(r + 1) * first[x] }
+                for i in 1 ... r {
+                    let p = top + min(i, last) * stride
+                    for x in 0 ..< n { sums[x] += p[x] }
+                }
+
+                //
+                // rows leaving the window are already written, their source values are kept in the ring
+                //
+                for y in 0 ..< height {
+
+                    let p    = top + y * stride
+                    let keep = ring + (y % (r + 1)) * n
+
+                    keep.assignFrom(p, count: n)
+
+                    for x in 0 ..< n {
+                        p[x] = sums[x] * scale
+                    }
+
+                    let entering = top + min(y + r + 1, last) * stride
+                    let leaving  = y - r > 0 ? ring + ((y - r) % (r + 1)) * n : first
+
+                    for x in 0 ..< n {
+                        sums[x] += entering[x] - leaving[x]
+                    }
+                }
+            }
+        }
+    }
+
+    ///  Blur 8 bits per channel rgba pixels in place
+    ///
+    ///  - parameter bytes:       pixels
+    ///  - parameter width:       image width
+    ///  - parameter height:      image height
+    ///  - parameter bytesPerRow: bytes per row, width*4 by default
+    public func apply(bytes bytes:UnsafeMutablePointer<UInt8>, width:Int, height:Int, bytesPerRow:Int = 0) {
+        IMPStackedBoxBlur.apply(bytes, width: width, height: height,
+            stride: bytesPerRow > 0 ? bytesPerRow : width * 4, radii: radii)
+    }
+
+    ///  Blur 16 bits per channel rgba pixels in place
+    ///
+    ///  - parameter words:       pixels
+    ///  - parameter width:       image width
+    ///  - parameter height:      image height
+    ///  - parameter bytesPerRow: bytes per row, width*8 by default
+    public func apply(words words:UnsafeMutablePointer<UInt16>, width:Int, height:Int, bytesPerRow:Int = 0) {
+        IMPStackedBoxBlur.apply(words, width: width, height: height,
+            stride: bytesPerRow > 0 ? bytesPerRow / sizeof(UInt16) : width * 4, radii: radii)
+    }
+
+    static let channels = 4
+
+    /// Fraction bits of integer intermediates
+    static let fractionBits = 8
+
+    ///  Integer running sums, stride is in channel values.
+    ///  Passes keep fixed point Int32 values with fractionBits extra bits,
+    ///  so pixels are narrowed to T only once after the last pass.
+    static func apply<T:UnsignedIntegerType>(data:UnsafeMutablePointer<T>, width:Int, height:Int, stride:Int, radii:[Int]) {
+
+        guard width > 1 && height > 1 && radii.contains({ $0 > 0 }) else { return }
+
+        let channels  = IMPStackedBoxBlur.channels
+        let fraction  = IMPStackedBoxBlur.fractionBits
+        let rowLength = width * channels
+        let queue     = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)
+
+        let values = UnsafeMutablePointer<Int32>.alloc(rowLength * height)
+        defer { values.dealloc(rowLength * height) }
+
+        //
+        // horizontal stage
+        //
+        dispatch_apply(height, queue) { (y) in
+
+            let row  = data + y * stride
+            let out  = values + y * rowLength
+            let line = UnsafeMutablePointer<Int>.alloc(rowLength)
+            defer { line.dealloc(rowLength) }
+
+            for i in 0 ..< rowLength {
+                line[i] = Int(row[i].toUIntMax()) << fraction
+                out[i]  = Int32(line[i])
+            }
+
+            var first = true
+
+            for r in radii where r > 0 {
+
+                if !first {
+                    for i in 0 ..< rowLength {
+                        line[i] = Int(out[i])
+                    }
+                }
+                first = false
+
+                let divider = IMPStackedBoxBlur.Divider(window: 2 * r + 1)
+                let last    = width - 1
+
+                for c in 0 ..< channels {
+
+                    var sum = (r + 1) * line[c]
+                    for i in 1 ... r {
+                        sum += line[min(i, last) * channels + c]
+                    }
+
+                    for x in 0 ..< width {
+                        out[x * channels + c] = Int32(divider.divide(sum))
+                        sum += line[min(x + r + 1, last) * channels + c] - line[max(x - r, 0) * channels + c]
+                    }
+                }
+            }
+        }
+
+        //
+        // vertical stage
+        //
+        let columnsPerBand = IMPStackedBoxBlur.columnsPerBand
+        let bands = (width + columnsPerBand - 1) / columnsPerBand
+        let round = 1 << (fraction - 1)
+        let upper = Int((~T.allZeros).toUIntMax())
+
+        dispatch_apply(bands, queue) { (band) in
+
+            let x0 = band * columnsPerBand
+            let n  = min(columnsPerBand, width - x0) * channels
+
+            let maximum = radii.maxElement()!
+            let sums    = UnsafeMutablePointer<Int>.alloc(n)
+            let first   = UnsafeMutablePointer<Int>.alloc(n)
+            let ring    = UnsafeMutablePointer<Int>.alloc((maximum + 1) * n)
+
+            defer {
+                sums.dealloc(n)
+                first.dealloc(n)
+                ring.dealloc((maximum + 1) * n)
+            }
+
+            let top = values + x0 * channels
+
+            for r in radii where r > 0 {
+
+                let divider = IMPStackedBoxBlur.Divider(window: 2 * r + 1)
+                let last    = height - 1
+
+                for x in 0 ..< n {
+                    first[x] = Int(top[x])
+                    sums[x]  = (r + 1) * first[x]
+                }
+                for i in 1 ... r {
+                    let p = top + min(i, last) * rowLength
+                    for x in 0 ..< n { sums[x] += Int(p[x]) }
+                }
+
+                for y in 0 ..< height {
+
+                    let p    = top + y * rowLength
+                    let keep = ring + (y % (r + 1)) * n
+
+                    for x in 0 ..< n {
+                        keep[x] = Int(p[x])
+                        p[x]    = Int32(divider.divide(sums[x]))
+                    }
+
+                    let entering = top + min(y + r + 1, last) * rowLength
+                    let leaving  = y - r > 0 ? ring + ((y - r) % (r + 1)) * n : first
+
+                    for x in 0 ..< n {
+                        sums[x] += Int(entering[x]) - leaving[x]
+                    }
+                }
+            }
+
+            //
+            // narrow once
+            //
+            for y in 0 ..< height {
+                let p = top + y * rowLength
+                let d = data + y * stride + x0 * channels
+                for x in 0 ..< n {
+                    d[x] = T(UIntMax(min(max((Int(p[x]) + round) >> fraction, 0), upper)))
+                }
+            }
+        }
+    }
+
+    ///  Rounded division by the window size
+    struct Divider {
+        let window:Int
+        let half:Int
+
+        init(window:Int) {
+            self.window = window
+            self.half   = window / 2
+        }
+
+        @inline(__always) func divide(sum:Int) -> Int {
+            return (sum + half) / window
+        }
+    }
+
+    private mutating func update() {
+        radii = sigma > 0 ? IMPStackedBoxBlur.radii(sigma: sigma, passes: min(max(passes, 3), 5)) : []
+    }
+}
@@ -11,6 +11,38 @@ import Metal
 
 public class IMPDitheringFilter:IMPFilter,IMPAdjustmentProtocol{
     
+    /// Dithering method
+    ///
+    ///  - Ordered:           threshold matrix defined by ditheringLut
+    ///  - FloydSteinberg:    Floyd–Steinberg error diffusion
+    ///  - JarvisJudiceNinke: Jarvis, Judice and Ninke error diffusion
+    ///  - Sierra:            three rows Sierra error diffusion
+    public enum Method{
+        case Ordered
+        case FloydSteinberg
+        case JarvisJudiceNinke
+        case Sierra
+    }
+    
+    /// Current dithering method. Error diffusion runs on CPU, textures without pixels access
+    /// are dithered by the ordered matrix kernel instead.
+    public var method:Method = .Ordered {
+        didSet{
+            updateDiffusion()
+            updateFunctions()
+            dirty = true
+        }
+    }
+    
+    /// Quantization levels per channel are used by error diffusion methods,
+    /// 2 gives the same bi-level look as the ordered matrices, 256 quantizes to 8 bit.
+    public var levels:Int = 2 {
+        didSet{
+            updateDiffusion()
+            dirty = true
+        }
+    }
+    
     public var ditheringLut:[[UInt8]] {
         get {
             fatalError("IMPDitheringFilter: ditheringLut must be implemented...")
@@ -35,6 +67,9 @@ public class IMPDitheringFilter:IMPFilter,IMPAdjustmentProtocol{
         super.init(context: context)
         kernel = IMPFunction(context: self.context, name: "kernel_dithering")
         self.addFunction(kernel)
+        addSourceObserver { (source) -> Void in
+            self.updateFunctions()
+        }
         timerBuffer = context.device.newBufferWithLength(sizeof(Float), options: .CPUCacheModeDefaultCache)
         defer{
             self.adjustment = IMPDitheringFilter.defaultAdjustment
@@ -51,6 +86,47 @@ public class IMPDitheringFilter:IMPFilter,IMPAdjustmentProtocol{
     }
     
     
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+        
+        guard diffusionApplicable else { return nil }
+        
+        guard var cpu = cpuPass(source: source, destination: provider) else { return nil }
+        
+        let (width, height) = (cpu.width, cpu.height)
+        
+        cpu.pixels.withUnsafeMutableBufferPointer { (p) -> Void in
+            self.diffusion.apply(p.baseAddress, width: width, height: height, blending: self.adjustment.blending)
+        }
+        
+        cpu.destination.update(pixels: cpu.pixels)
+        
+        return cpu.destination
+    }
+    
+    var diffusion = IMPErrorDiffusionDither(method: .FloydSteinberg, levels: 2)
+    
+    func updateDiffusion() {
+        if method != .Ordered {
+            diffusion = IMPErrorDiffusionDither(method: method, levels: levels)
+        }
+    }
+    
+    //
+    // CPU error diffusion can not read every pixel format: such sources are dithered by the kernel
+    //
+    var diffusionApplicable:Bool {
+        return method != .Ordered && source?.texture?.hasPixelsAccess ?? true
+    }
+    
+    func updateFunctions() {
+        if diffusionApplicable {
+            removeFunction(kernel)
+        }
+        else {
+            addFunction(kernel)
+        }
+    }
+    
     var ditherLut:MTLTexture?
     func updateDitheringLut(inout lut:MTLTexture?){
         
@@ -67,6 +143,195 @@ public class IMPDitheringFilter:IMPFilter,IMPAdjustmentProtocol{
     }
 }
 
+public extension IMPDitheringFilter.Method {
+    
+    ///
+    /// Diffusion matrix 3x5: a row per kernel line, columns are -2...2 offsets from the current pixel.
+    /// http://www.tannerhelland.com/4660/dithering-eleven-algorithms-source-code/
+    ///
+    public var diffusionWeights:[Float] {
+        get {
+            var weights:[Float]
+            switch self {
+            case .FloydSteinberg:
+                weights = [
+                    0, 0, 0, 7, 0,
+                    0, 3, 5, 1, 0,
+                    0, 0, 0, 0, 0
+                    ]
+                weights = weights / 16
+            case .JarvisJudiceNinke:
+                weights = [
+                    0, 0, 0, 7, 5,
+                    3, 5, 7, 5, 3,
+                    1, 3, 5, 3, 1
+                    ]
+                weights = weights / 48
+            case .Sierra:
+                weights = [
+                    0, 0, 0, 5, 3,
+                    2, 4, 5, 4, 2,
+                    0, 2, 3, 2, 0
+                    ]
+                weights = weights / 32
+            case .Ordered:
+                weights = [Float](count: 15, repeatedValue: 0)
+            }
+            return weights
+        }
+    }
+}
+
+///
+/// Error diffusion on CPU processed as a wavefront. Worker threads take rows in order, every row
+/// lags the row above by the kernel reach plus one pixel, so all errors a pixel pulls from its quantized neighbours
+/// are ready. A row can finish only after the row above, so the rows in flight are the last
+/// workers count rows and errors are kept in a ring of workers+2 rows: memory does not depend on
+/// the image height. Errors are summed in the order the serial scan spreads them, so the result
+/// is the same as the serial one.
+///
+public struct IMPErrorDiffusionDither {
+    
+    /// Pixels processed between two progress updates of a row
+    public static let chunk = 64
+    
+    public let method:IMPDitheringFilter.Method
+    public let levels:Int
+    
+    let weights:[Float]
+    let rows:Int
+    let lag:Int
+    let quantization:Float
+    
+    public init(method:IMPDitheringFilter.Method, levels:Int) {
+        self.method       = method
+        self.levels       = levels
+        self.weights      = method.diffusionWeights
+        self.rows         = method == .FloydSteinberg ? 2 : 3
+        self.lag          = method == .FloydSteinberg ? 2 : 3
+        self.quantization = Float(max(levels, 2))
+    }
+    
+    ///  Dither rgba pixels in place
+    ///
+    ///  - parameter pixels:   width*height pixels
+    ///  - parameter width:    image width
+    ///  - parameter height:   image height
+    ///  - parameter blending: blending of the quantized color over the source, alpha of the source is kept when nil
+    public func apply(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, blending:IMPBlending? = nil) {
+        
+        guard width > 0 && height > 0 else { return }
+        
+        let workers  = min(NSProcessInfo.processInfo().activeProcessorCount, height)
+        let ring     = workers + 2
+        let stride   = width + 4
+        let rows     = self.rows
+        let lag      = self.lag
+        let reach    = lag - 1
+        let chunk    = IMPErrorDiffusionDither.chunk
+        let weights  = self.weights
+        let levels   = self.quantization
+        
+        let errors   = UnsafeMutablePointer<float4>.alloc(ring * stride)
+        let progress = UnsafeMutablePointer<Int32>.alloc(height)
+        let next     = UnsafeMutablePointer<Int32>.alloc(1)
+        
+        errors.initializeFrom([float4](count: ring * stride, repeatedValue: float4(0)))
+        progress.initializeFrom([Int32](count: height, repeatedValue: 0))
+        next.initialize(0)
+        
+        defer {
+            errors.dealloc(ring * stride)
+            progress.dealloc(height)
+            next.dealloc(1)
+        }
+        
+        dispatch_apply(workers, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (_) in
+            
+            //
+            // rows are claimed in order, so the row above is always taken by a running worker
+            //
+            var y = Int(OSAtomicIncrement32Barrier(next)) - 1
+            
+            while y < height {
+                
+                let row = pixels + y * width
+                
+                for x0 in 0.stride(to: width, by: chunk) {
+                    
+                    let x1 = min(x0 + chunk, width)
+                    
+                    if y > 0 {
+                        let ready = Int32(min(x1 - 1 + lag, width))
+                        while OSAtomicAdd32Barrier(0, progress + y - 1) < ready {
+                            sched_yield()
+                        }
+                    }
+                    
+                    for x in x0 ..< x1 {
+                        let incoming = IMPErrorDiffusionDither.pull(errors, x: x, y: y, ring: ring, stride: stride, rows: rows, reach: reach, weights: weights)
+                        let source   = row[x]
+                        let value    = source.xyz + incoming
+                        let rgb      = IMPErrorDiffusionDither.quantize(value, levels: levels)
+                        
+                        errors[(y % ring) * stride + 2 + x] = float4(rgb: value - rgb, a: 0)
+                        
+                        row[x] = blending?.blend(base: source, overlay: float4(rgb: rgb, a: 1)) ?? float4(rgb: rgb, a: source.w)
+                    }
+                    
+                    OSAtomicAdd32Barrier(Int32(x1 - x0), progress + y)
+                }
+                
+                y = Int(OSAtomicIncrement32Barrier(next)) - 1
+            }
+        }
+    }
+    
+    ///  Serial scan pushing errors to the neighbours, the reference of the wavefront
+    public func serial(pixels:UnsafeMutablePointer<float4>, width:Int, height:Int, blending:IMPBlending? = nil) {
+        
+        let rows   = self.rows
+        let reach  = lag - 1
+        var errors = [float3](count: width * height, repeatedValue: float3(0))
+        
+        for y in 0 ..< height {
+            for x in 0 ..< width {
+                
+                let source = pixels[y * width + x]
+                let value  = source.xyz + errors[y * width + x]
+                let rgb    = IMPErrorDiffusionDither.quantize(value, levels: quantization)
+                let error  = value - rgb
+                
+                for r in 0 ..< rows where y + r < height {
+                    for dx in (r == 0 ? 1 : -reach) ... reach where x + dx >= 0 && x + dx < width {
+                        errors[(y + r) * width + x + dx] += weights[r * 5 + dx + 2] * error
+                    }
+                }
+                
+                pixels[y * width + x] = blending?.blend(base: source, overlay: float4(rgb: rgb, a: 1)) ?? float4(rgb: rgb, a: source.w)
+            }
+        }
+    }
+    
+    ///  Errors of the quantized neighbours in the order the serial scan spreads them:
+    ///  upper rows first, left to right
+    @inline(__always) static func pull(errors:UnsafeMutablePointer<float4>, x:Int, y:Int, ring:Int, stride:Int, rows:Int, reach:Int, weights:[Float]) -> float3 {
+        var incoming = float3(0)
+        for r in (0 ..< min(rows, y + 1)).reverse() {
+            let previous = errors + ((y - r) % ring) * stride + 2
+            for dx in reach.stride(through: r == 0 ? 1 : -reach, by: -1) {
+                incoming += weights[r * 5 + dx + 2] * previous[x - dx].xyz
+            }
+        }
+        return incoming
+    }
+    
+    @inline(__always) static func quantize(value:float3, levels:Float) -> float3 {
+        let steps = max(levels - 1, 1)
+        return clamp(floor(value * steps + 0.5) / steps, min: 0, max: 1)
+    }
+}
+
 public class IMPBayerDitheringFilter:IMPDitheringFilter{
     override public var ditheringLut:[[UInt8]] {
         get {
@@ -89,17 +89,33 @@ public class IMPVignetteFilter: IMPFilter,IMPAdjustmentProtocol {
     public var adjustmentBuffer:MTLBuffer?
     public var kernel:IMPFunction!
     
+    /// Vignette mask resolution. The mask is built in normalized coordinates
+    /// and bilinearly upsampled to the image, radial gradients stay smooth at 256.
+    public var maskSize:Int = 256 {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    /// Cached vignette mask: R channel contains vignetting percent.
+    /// It is rebuilt only when the mask size, start/end, center or region change, and
+    /// can be bound to any point operation kernel with IMProcessing::vignetteMaskPercent.
+    public private(set) var mask:MTLTexture?
+    
     var type:Type!
+    var maskKernel:IMPFunction!
+    var maskKey = [Float]()
     
     public required init(context: IMPContext, type:Type = .Center) {
         super.init(context: context)
         self.type = type
         if type == .Center {
-            kernel = IMPFunction(context: self.context, name: "kernel_vignetteCenter")
+            maskKernel = IMPFunction(context: self.context, name: "kernel_vignetteCenterMask")
         }
         else {
-            kernel = IMPFunction(context: self.context, name: "kernel_vignetteFrame")
+            maskKernel = IMPFunction(context: self.context, name: "kernel_vignetteFrameMask")
         }
+        kernel = IMPFunction(context: self.context, name: "kernel_vignetteMask")
         self.addFunction(kernel)
         defer{
             self.adjustment = IMPVignetteFilter.defaultAdjustment
@@ -112,16 +128,63 @@ public class IMPVignetteFilter: IMPFilter,IMPAdjustmentProtocol {
  
     public override func configure(function: IMPFunction, command: MTLComputeCommandEncoder) {
         if kernel == function {
+            command.setTexture(mask, atIndex: 2)
             command.setBuffer(adjustmentBuffer, offset: 0, atIndex: 0)
-            command.setBuffer(colorStartUniformBuffer, offset: 0, atIndex: 1)
-            command.setBuffer(colorEndUniformBuffer, offset: 0, atIndex: 2)
-            command.setBuffer(colorUniformBuffer, offset: 0, atIndex: 3)
-            if type == .Center {
-                command.setBuffer(centerUniformBuffer, offset: 0, atIndex: 4)
+            command.setBuffer(colorUniformBuffer, offset: 0, atIndex: 1)
+        }
+    }
+    
+    public override func apply() -> IMPImageProvider {
+        updateMask()
+        return super.apply()
+    }
+    
+    ///  Rebuild the mask if its key has been changed
+    public func updateMask() {
+        
+        let c = center
+        let key:[Float] = [
+            Float(maskSize),
+            adjustment.start, adjustment.end,
+            c.x, c.y,
+            region.left, region.right, region.top, region.bottom]
+        
+        if key == maskKey && mask != nil {
+            return
+        }
+        
+        maskKey = key
+        
+        if mask?.width != maskSize {
+            let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+                .R16Float,
+                width: maskSize, height: maskSize, mipmapped: false)
+            mask = context.device.newTextureWithDescriptor(descriptor)
+        }
+        
+        context.execute { (commandBuffer) -> Void in
+            
+            let threadgroupCounts = MTLSizeMake(self.maskKernel.groupSize.width, self.maskKernel.groupSize.height, 1)
+            let threadgroups = MTLSizeMake(
+                (self.maskSize + threadgroupCounts.width  - 1) / threadgroupCounts.width,
+                (self.maskSize + threadgroupCounts.height - 1) / threadgroupCounts.height,
+                1)
+            
+            let commandEncoder = commandBuffer.computeCommandEncoder()
+            
+            commandEncoder.setComputePipelineState(self.maskKernel.pipeline!)
+            commandEncoder.setTexture(self.mask, atIndex: 0)
+            commandEncoder.setBuffer(self.colorStartUniformBuffer, offset: 0, atIndex: 0)
+            commandEncoder.setBuffer(self.colorEndUniformBuffer, offset: 0, atIndex: 1)
+            if self.type == .Center {
+                commandEncoder.setBuffer(self.centerUniformBuffer, offset: 0, atIndex: 2)
             }
             else {
-                command.setBuffer(regionUniformBuffer, offset: 0, atIndex: 4)
+                commandEncoder.setBuffer(self.regionUniformBuffer, offset: 0, atIndex: 2)
             }
+            
+            commandEncoder.dispatchThreadgroups(threadgroups, threadsPerThreadgroup: threadgroupCounts)
+            commandEncoder.endEncoding()
         }
     }
     
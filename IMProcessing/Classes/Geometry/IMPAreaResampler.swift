@@ -0,0 +1,66 @@
+//
+//  IMPAreaResampler.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+///
+/// Exact area average downsampler. Every source pixel contributes to the result
+/// with the weight of its covered area, so no source pixel is skipped at any scale.
+///
+public class IMPAreaResampler: IMPContextProvider {
+
+    public var context:IMPContext!
+
+    public init(context:IMPContext){
+        self.context = context
+    }
+
+    ///  Downscale texture to the new size
+    ///
+    ///  - parameter source:      source texture
+    ///  - parameter width:       destination width
+    ///  - parameter height:      destination height
+    ///  - parameter destination: destination texture, new one is created when size or format does not match
+    ///
+    ///  - returns: downscaled texture
+    public func resample(source:MTLTexture, width:Int, height:Int, destination:MTLTexture? = nil) -> MTLTexture {
+
+        var output = destination
+
+        if output?.width != width || output?.height != height || output?.pixelFormat != source.pixelFormat {
+            let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+                source.pixelFormat,
+                width: width, height: height, mipmapped: false)
+            output = context.device.newTextureWithDescriptor(descriptor)
+        }
+
+        let function = kernel_resampleArea
+
+        let threadgroupCounts = MTLSizeMake(function.groupSize.width, function.groupSize.height, 1)
+        let threadgroups = MTLSizeMake(
+            (width  + threadgroupCounts.width ) / threadgroupCounts.width ,
+            (height + threadgroupCounts.height) / threadgroupCounts.height,
+            1)
+
+        context.execute { (commandBuffer) in
+            let commandEncoder = commandBuffer.computeCommandEncoder()
+            commandEncoder.setComputePipelineState(function.pipeline!)
+            commandEncoder.setTexture(source,  atIndex: 0)
+            commandEncoder.setTexture(output!, atIndex: 1)
+            commandEncoder.dispatchThreadgroups(threadgroups, threadsPerThreadgroup:threadgroupCounts)
+            commandEncoder.endEncoding()
+        }
+
+        return output!
+    }
+
+    lazy var kernel_resampleArea:IMPFunction = {
+        return IMPFunction(context: self.context, name: "kernel_resampleArea")
+    }()
+}
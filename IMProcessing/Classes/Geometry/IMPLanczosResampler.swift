@@ -0,0 +1,201 @@
+//
+//  IMPLanczosResampler.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+
+///
+/// Separable Lanczos resampler. Every pass reads a precomputed per output column (row)
+/// coefficients table, tables are rebuilt only when source or destination size changes.
+/// Passes run on GPU in float precision with float weights, the intermediate image is half float:
+/// results are not bit exact with fixed-point integer resamplers, rounding of integer outputs can differ.
+///
+public class IMPLanczosResampler: IMPContextProvider {
+
+    /// Lanczos window size
+    public enum Lobes:Int {
+        case Two   = 2
+        case Three = 3
+    }
+
+    public var context:IMPContext!
+
+    public var lobes:Lobes = .Three {
+        didSet{
+            if oldValue != lobes {
+                horizontal = nil
+                vertical   = nil
+            }
+        }
+    }
+
+    public init(context:IMPContext, lobes:Lobes = .Three){
+        self.context = context
+        self.lobes = lobes
+    }
+
+    ///  Resample texture to the new size
+    ///
+    ///  - parameter source:      source texture
+    ///  - parameter width:       destination width
+    ///  - parameter height:      destination height
+    ///  - parameter destination: destination texture, new one is created when size or format does not match
+    ///
+    ///  - returns: resampled texture
+    public func resample(source:MTLTexture, width:Int, height:Int, destination:MTLTexture? = nil) -> MTLTexture {
+
+        var output = destination
+
+        if output?.width != width || output?.height != height || output?.pixelFormat != source.pixelFormat {
+            let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+                source.pixelFormat,
+                width: width, height: height, mipmapped: false)
+            output = context.device.newTextureWithDescriptor(descriptor)
+        }
+
+        //
+        // horizontal pass keeps negative lobes in half float
+        //
+        if intermediate?.width != width || intermediate?.height != source.height {
+            let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+                .RGBA16Float,
+                width: width, height: source.height, mipmapped: false)
+            intermediate = context.device.newTextureWithDescriptor(descriptor)
+        }
+
+        horizontal = table(horizontal, source: source.width,  destination: width)
+        vertical   = table(vertical,   source: source.height, destination: height)
+
+        context.execute { (commandBuffer) in
+            self.encode(self.kernel_resampleHorizontal, table: self.horizontal!,
+                input: source, output: self.intermediate!, commandBuffer: commandBuffer)
+            self.encode(self.kernel_resampleVertical, table: self.vertical!,
+                input: self.intermediate!, output: output!, commandBuffer: commandBuffer)
+        }
+
+        return output!
+    }
+
+    ///  Resample texture with the scale factor
+    public func resample(source:MTLTexture, scale:Float, destination:MTLTexture? = nil) -> MTLTexture {
+        let width  = max(Int(floor(Float(source.width)  * scale)), 1)
+        let height = max(Int(floor(Float(source.height) * scale)), 1)
+        return resample(source, width: width, height: height, destination: destination)
+    }
+
+    ///  Lanczos coefficients table
+    ///
+    ///  - parameter source:      source size
+    ///  - parameter destination: destination size
+    ///  - parameter lobes:       window size
+    ///
+    ///  - returns: first source index and normalized weights of taps size for every destination pixel
+    public static func coefficients(source source:Int, destination:Int, lobes:Int) -> (first:[Int32], weights:[Float], taps:Int) {
+
+        let scale   = Float(destination)/Float(source)
+        let stretch = min(scale, 1)
+        let support = Float(lobes)/stretch
+        let taps    = Int(ceil(support * 2)) + 1
+
+        var first   = [Int32](count: destination, repeatedValue: 0)
+        var weights = [Float](count: destination * taps, repeatedValue: 0)
+
+        for i in 0 ..< destination {
+
+            let center = (Float(i) + 0.5) / scale - 0.5
+            let x0     = Int(floor(center - support)) + 1
+            var sum    = Float(0)
+
+            for k in 0 ..< taps {
+                let w = lanczos((Float(x0 + k) - center) * stretch, a: Float(lobes))
+                weights[i * taps + k] = w
+                sum += w
+            }
+
+            if sum != 0 {
+                for k in 0 ..< taps {
+                    weights[i * taps + k] /= sum
+                }
+            }
+
+            first[i] = Int32(x0)
+        }
+
+        return (first, weights, taps)
+    }
+
+    static func sinc(x:Float) -> Float {
+        let px = x * Float(M_PI)
+        return sin(px)/px
+    }
+
+    static func lanczos(x:Float, a:Float) -> Float {
+        if x == 0 { return 1 }
+        if abs(x) < a { return sinc(x) * sinc(x/a) }
+        return 0
+    }
+
+    struct Table {
+        let source:Int
+        let destination:Int
+        let first:MTLBuffer
+        let weights:MTLBuffer
+        let taps:MTLBuffer
+    }
+
+    func table(current:Table?, source:Int, destination:Int) -> Table {
+
+        if let t = current where t.source == source && t.destination == destination {
+            return t
+        }
+
+        var (first, weights, taps) = IMPLanczosResampler.coefficients(source: source, destination: destination, lobes: lobes.rawValue)
+        var count = UInt32(taps)
+
+        return Table(
+            source: source,
+            destination: destination,
+            first: context.device.newBufferWithBytes(&first, length: first.count * sizeof(Int32), options: .CPUCacheModeDefaultCache),
+            weights: context.device.newBufferWithBytes(&weights, length: weights.count * sizeof(Float), options: .CPUCacheModeDefaultCache),
+            taps: context.device.newBufferWithBytes(&count, length: sizeof(UInt32), options: .CPUCacheModeDefaultCache)
+        )
+    }
+
+    func encode(function:IMPFunction, table:Table, input:MTLTexture, output:MTLTexture, commandBuffer:MTLCommandBuffer) {
+
+        let threadgroupCounts = MTLSizeMake(function.groupSize.width, function.groupSize.height, 1)
+        let threadgroups = MTLSizeMake(
+            (output.width  + threadgroupCounts.width ) / threadgroupCounts.width ,
+            (output.height + threadgroupCounts.height) / threadgroupCounts.height,
+            1)
+
+        let commandEncoder = commandBuffer.computeCommandEncoder()
+
+        commandEncoder.setComputePipelineState(function.pipeline!)
+        commandEncoder.setTexture(input,  atIndex: 0)
+        commandEncoder.setTexture(output, atIndex: 1)
+        commandEncoder.setBuffer(table.first,   offset: 0, atIndex: 0)
+        commandEncoder.setBuffer(table.weights, offset: 0, atIndex: 1)
+        commandEncoder.setBuffer(table.taps,    offset: 0, atIndex: 2)
+
+        commandEncoder.dispatchThreadgroups(threadgroups, threadsPerThreadgroup:threadgroupCounts)
+        commandEncoder.endEncoding()
+    }
+
+    lazy var kernel_resampleHorizontal:IMPFunction = {
+        return IMPFunction(context: self.context, name: "kernel_resampleHorizontal")
+    }()
+
+    lazy var kernel_resampleVertical:IMPFunction = {
+        return IMPFunction(context: self.context, name: "kernel_resampleVertical")
+    }()
+
+    private var horizontal:Table?
+    private var vertical:Table?
+    private var intermediate:MTLTexture?
+}
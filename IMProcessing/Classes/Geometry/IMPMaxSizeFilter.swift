@@ -7,22 +7,52 @@
 //
 
 import Foundation
+import Metal
 
 public class IMPMaxSizeFilter: IMPFilter {
     
-    public var size:Float?
+    public var size:Float? {
+        didSet{
+            if let source = source {
+                updateDestinationSize(source)
+            }
+            dirty = true
+        }
+    }
+    
+    /// Downscaling resampler, GPU float precision Lanczos, see IMPLanczosResampler
+    public lazy var resampler:IMPLanczosResampler = {
+        return IMPLanczosResampler(context: self.context)
+    }()
     
     public required init(context: IMPContext) {
         super.init(context: context)
         addSourceObserver { (source) -> Void in
-            if self.size != nil {
-                if let sz = source.texture?.size {
-                    let scale = self.size!/max(sz.width,sz.height).float
-                    if scale<1 {
-                        self.destinationSize = MTLSize(cgsize: CGSize(width: sz.width*scale, height: sz.height*scale))
-                    }
-                }
+            self.updateDestinationSize(source)
+        }
+    }
+    
+    func updateDestinationSize(source:IMPImageProvider) {
+        var target:MTLSize? = nil
+        if let size = self.size, let sz = source.texture?.size {
+            let scale = size/max(sz.width,sz.height).float
+            if scale<1 {
+                target = MTLSize(cgsize: CGSize(width: sz.width*scale, height: sz.height*scale))
             }
         }
+        destinationSize = target
+    }
+    
+    public override func main(source source: IMPImageProvider, destination provider: IMPImageProvider) -> IMPImageProvider? {
+        
+        guard let input = source.texture, let size = destinationSize else { return nil }
+        
+        if input.width <= size.width && input.height <= size.height {
+            return nil
+        }
+        
+        provider.texture = resampler.resample(input, width: size.width, height: size.height,
+                                              destination: provider === source ? nil : provider.texture)
+        return provider
     }
-}
\ No newline at end of file
+}
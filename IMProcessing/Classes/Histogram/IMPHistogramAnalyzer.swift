@@ -27,6 +27,16 @@ public enum IMPHistogramAnalyzerHardware {
     case DSP
 }
 
+///
+/// Source image downscaling method used when downScaleFactor < 1.
+///
+public enum IMPHistogramSampling {
+    /// Exact area average: every source pixel is counted, histograms are stable frame to frame
+    case Area
+    /// Lanczos-3 resampling
+    case Lanczos
+}
+
 ///
 /// Common protocol defines histogram class API.
 ///
@@ -104,15 +114,38 @@ public class IMPHistogramAnalyzer: IMPFilter,IMPHistogramAnalyzerProtocol {
     ///
     /// На сколько уменьшаем картинку перед вычисления гистограммы.
     ///
+    /// Картинка уменьшается методом sampling, ядра читают уже уменьшенную текстуру 1:1.
+    ///
     public var downScaleFactor:Float!{
         didSet{
             scaleUniformBuffer = scaleUniformBuffer ?? self.context.device.newBufferWithLength(sizeof(Float), options: .CPUCacheModeDefaultCache)
-            memcpy(scaleUniformBuffer.contents(), &downScaleFactor, sizeof(Float))
+            var scale:Float = 1
+            memcpy(scaleUniformBuffer.contents(), &scale, sizeof(Float))
             dirty = true
         }
     }
     private var scaleUniformBuffer:MTLBuffer!
     
+    /// Downscaling method
+    public var sampling:IMPHistogramSampling = .Area {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    /// Lanczos downscaling resampler
+    public var resampler:IMPLanczosResampler {
+        return downscaler.resampler
+    }
+    
+    lazy var downscaler:IMPAnalysisDownscaler = {
+        return IMPAnalysisDownscaler(context: self.context)
+    }()
+    
+    func analysisTexture(texture:MTLTexture) -> MTLTexture {
+        return downscaler.texture(texture, pyramid: source?.pyramid, scale: downScaleFactor, sampling: sampling)
+    }
+    
     private var channelsToCompute:UInt?{
         didSet{
             channelsToComputeBuffer = channelsToComputeBuffer ?? self.context.device.newBufferWithLength(sizeof(UInt), options: .CPUCacheModeDefaultCache)
@@ -141,6 +174,36 @@ public class IMPHistogramAnalyzer: IMPFilter,IMPHistogramAnalyzerProtocol {
     }
     internal var regionUniformBuffer:MTLBuffer!
     
+    ///
+    /// Build the summed area table of the analyzed (downscaled) image on every update.
+    /// Then mean and variance of any region cost O(1) without running the kernels again,
+    /// solvers use the exact region mean instead of the binned histogram one.
+    ///
+    public var summedAreaTableEnabled:Bool = false {
+        didSet{
+            if !summedAreaTableEnabled {
+                summedAreaTable = nil
+            }
+            dirty = true
+        }
+    }
+    
+    ///
+    /// Summed area table of the last analyzed image, nil until summedAreaTableEnabled is set
+    /// or if the texture format can not be read on CPU.
+    ///
+    public private(set) var summedAreaTable:IMPSummedAreaTable?
+    
+    ///  Mean color of the region, the analyzer region by default
+    public func mean(region region:IMPRegion? = nil) -> float4? {
+        return summedAreaTable?.mean(region ?? self.region)
+    }
+    
+    ///  Color variance of the region, the analyzer region by default
+    public func variance(region region:IMPRegion? = nil) -> float4? {
+        return summedAreaTable?.variance(region ?? self.region)
+    }
+    
     ///
     /// Кernel-функция счета
     ///
@@ -312,8 +375,8 @@ public class IMPHistogramAnalyzer: IMPFilter,IMPHistogramAnalyzerProtocol {
         
         context.execute(complete: true) { (commandBuffer) in
             
-            let width  = Int(floor(Float(texture.width) * self.downScaleFactor))
-            let height = Int(floor(Float(texture.height) * self.downScaleFactor))
+            let width  = texture.width
+            let height = texture.height
             
             if self.analizeTexture?.width != width || self.analizeTexture?.height != height {
                 let textureDescription = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
@@ -413,8 +476,8 @@ public class IMPHistogramAnalyzer: IMPFilter,IMPHistogramAnalyzerProtocol {
     }
     
     func computeOptions(texture:MTLTexture) -> (MTLSize,MTLSize) {
-        let width  = Int(floor(Float(texture.width) * self.downScaleFactor))
-        let height = Int(floor(Float(texture.height) * self.downScaleFactor))
+        let width  = texture.width
+        let height = texture.height
         
         let threadgroupCounts = MTLSizeMake(Int(self.kernel.groupSize.width), Int(self.kernel.groupSize.height), 1)
         
@@ -428,7 +491,9 @@ public class IMPHistogramAnalyzer: IMPFilter,IMPHistogramAnalyzerProtocol {
     
     public override func apply() -> IMPImageProvider {
         
-        if let texture = source?.texture{
+        if let original = source?.texture{
+            
+            let texture = analysisTexture(original)
             
             if hardware == .GPU {
                 
@@ -456,7 +521,11 @@ public class IMPHistogramAnalyzer: IMPFilter,IMPHistogramAnalyzerProtocol {
                                   buffer: histogramUniformBuffer)
             }
             
-            executeSolverObservers(texture)
+            if summedAreaTableEnabled {
+                summedAreaTable = IMPSummedAreaTable(texture: texture, context: context)
+            }
+            
+            executeSolverObservers(original)
         }
         
         return source!
@@ -33,15 +33,37 @@ public class IMPHistogramCubeAnalyzer: IMPFilter {
     /// Cube histogram
     public var histogram = IMPHistogramCube()
     
-    /// To manage computation complexity you may downscale source image presentation inside the filter kernel function
+    /// To manage computation complexity you may downscale source image presentation.
+    /// The image is downscaled according to sampling, so the kernel function reads it 1:1.
     public var downScaleFactor:Float!{
         didSet{
             scaleUniformBuffer = scaleUniformBuffer ?? self.context.device.newBufferWithLength(sizeof(Float), options: .CPUCacheModeDefaultCache)
-            memcpy(scaleUniformBuffer.contents(), &downScaleFactor, scaleUniformBuffer.length)
+            var scale:Float = 1
+            memcpy(scaleUniformBuffer.contents(), &scale, scaleUniformBuffer.length)
             dirty = true
         }
     }
     
+    /// Downscaling method
+    public var sampling:IMPHistogramSampling = .Area {
+        didSet{
+            dirty = true
+        }
+    }
+    
+    /// Lanczos downscaling resampler
+    public var resampler:IMPLanczosResampler {
+        return downscaler.resampler
+    }
+    
+    lazy var downscaler:IMPAnalysisDownscaler = {
+        return IMPAnalysisDownscaler(context: self.context)
+    }()
+    
+    func analysisTexture(texture:MTLTexture) -> MTLTexture {
+        return downscaler.texture(texture, pyramid: source?.pyramid, scale: downScaleFactor, sampling: sampling)
+    }
+    
     /// Default colors clipping
     public static var defaultClipping = IMPHistogramCubeClipping(shadows: float3(0.2,0.2,0.2), highlights: float3(0.2,0.2,0.2))
     
@@ -183,7 +205,7 @@ public class IMPHistogramCubeAnalyzer: IMPFilter {
         
         if let texture = source?.texture{
             
-            apply( texture, buffer: histogramUniformBuffer)
+            apply( analysisTexture(texture), buffer: histogramUniformBuffer)
             
             histogram.update(data: histogramUniformBuffer.contents(), dataCount: threadgroups.width)
             
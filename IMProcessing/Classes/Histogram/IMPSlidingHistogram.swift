@@ -0,0 +1,247 @@
+//
+//  IMPSlidingHistogram.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Accelerate
+import simd
+
+///
+/// Local order statistics over a sliding square window with constant cost per pixel
+/// (Perreault–Hébert): every column keeps a histogram of its 2*radius+1 pixels, the window
+/// histogram is updated by adding the entering and subtracting the leaving column histogram.
+///
+/// Histograms have the IMPHistogramBuffer layout: channels x kIMP_HistogramSize bins,
+/// plus a coarse level of 16 bins per channel. The coarse level is updated on every step,
+/// a fine 16 bins segment is brought up to date only when the search enters it.
+///
+public struct IMPSlidingHistogram {
+
+    /// Filtered channels: rgb, alpha is passed through
+    public static let channels = 3
+
+    static let bins        = Int(kIMP_HistogramSize)
+    static let coarseBins  = 16
+    static let segmentBins = IMPSlidingHistogram.bins / IMPSlidingHistogram.coarseBins
+
+    ///  Percentile filter
+    ///
+    ///  - parameter pixels:     rgba pixels
+    ///  - parameter width:      image width
+    ///  - parameter height:     image height
+    ///  - parameter radius:     window radius, window size is 2*radius+1
+    ///  - parameter percentile: percentile in [0,1], 0.5 is median
+    ///
+    ///  - returns: filtered pixels quantized to kIMP_HistogramSize levels
+    public static func percentile(pixels:[float4], width:Int, height:Int, radius:Int, percentile:Float) -> [float4] {
+
+        var result = pixels
+
+        guard radius > 0 && width > 0 && height > 0 else { return result }
+
+        let levels = quantize(pixels)
+        let strips = min(NSProcessInfo.processInfo().activeProcessorCount, height)
+        let rows   = (height + strips - 1) / strips
+        let window = 2 * radius + 1
+        let rank   = Float(Int(round(min(max(percentile, 0), 1) * Float(window * window - 1))))
+
+        result.withUnsafeMutableBufferPointer { (result) -> Void in
+
+            let output = result.baseAddress
+
+            levels.withUnsafeBufferPointer { (levels) -> Void in
+
+                let input = levels.baseAddress
+
+                dispatch_apply(strips, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (strip) in
+                    let y0 = strip * rows
+                    let y1 = min(y0 + rows, height)
+                    if y0 < y1 {
+                        filter(input, output: output, width: width, height: height,
+                            rows: y0 ..< y1, radius: radius, rank: rank)
+                    }
+                }
+            }
+        }
+
+        return result
+    }
+
+    static func quantize(pixels:[float4]) -> [UInt8] {
+        let count = pixels.count * 4
+        var data  = [Float](count: count, repeatedValue: 0)
+        var bytes = [UInt8](count: count, repeatedValue: 0)
+        var scale = Float(bins - 1)
+        var low   = Float(0)
+        var high  = Float(bins - 1)
+        vDSP_vsmul(UnsafePointer<Float>(pixels), 1, &scale, &data, 1, vDSP_Length(count))
+        vDSP_vclip(data, 1, &low, &high, &data, 1, vDSP_Length(count))
+        vDSP_vfixru8(data, 1, &bytes, 1, vDSP_Length(count))
+        return bytes
+    }
+
+    static func filter(input:UnsafePointer<UInt8>, output:UnsafeMutablePointer<float4>,
+                       width:Int, height:Int, rows:Range<Int>, radius:Int, rank:Float) {
+
+        let channels    = IMPSlidingHistogram.channels
+        let bins        = IMPSlidingHistogram.bins
+        let coarseBins  = IMPSlidingHistogram.coarseBins
+        let segmentBins = IMPSlidingHistogram.segmentBins
+
+        let fineSize    = channels * bins
+        let coarseSize  = channels * coarseBins
+
+        //
+        // column histograms
+        //
+        let columnFine   = UnsafeMutablePointer<Float>.alloc(width * fineSize)
+        let columnCoarse = UnsafeMutablePointer<Float>.alloc(width * coarseSize)
+
+        //
+        // window histogram
+        //
+        let fine         = UnsafeMutablePointer<Float>.alloc(fineSize)
+        let coarse       = UnsafeMutablePointer<Float>.alloc(coarseSize)
+        var updated      = [Int](count: coarseSize, repeatedValue: 0)
+
+        defer {
+            columnFine.dealloc(width * fineSize)
+            columnCoarse.dealloc(width * coarseSize)
+            fine.dealloc(fineSize)
+            coarse.dealloc(coarseSize)
+        }
+
+        memset(columnFine,   0, width * fineSize   * sizeof(Float))
+        memset(columnCoarse, 0, width * coarseSize * sizeof(Float))
+
+        func clampRow(y:Int) -> Int { return min(max(y, 0), height - 1) }
+        func clampColumn(x:Int) -> Int { return min(max(x, 0), width - 1) }
+
+        func updateColumns(y:Int, delta:Float) {
+            let row = input + clampRow(y) * width * 4
+            for x in 0 ..< width {
+                let f = columnFine   + x * fineSize
+                let c = columnCoarse + x * coarseSize
+                for ch in 0 ..< channels {
+                    let v = Int(row[x * 4 + ch])
+                    f[ch * bins + v] += delta
+                    c[ch * coarseBins + v / segmentBins] += delta
+                }
+            }
+        }
+
+        for y in rows.startIndex - radius ... rows.startIndex + radius {
+            updateColumns(y, delta: 1)
+        }
+
+        for y in rows {
+
+            if y > rows.startIndex {
+                updateColumns(y - radius - 1, delta: -1)
+                updateColumns(y + radius, delta: 1)
+            }
+
+            //
+            // window of the first pixel in the row
+            //
+            for i in 0 ..< coarseSize { coarse[i] = 0 }
+            for x in -radius ... radius {
+                IMPSlidingHistogram.add(coarse, columnCoarse + clampColumn(x) * coarseSize, count: coarseSize)
+            }
+
+            //
+            // fine segments are rebuilt on the first use in the row
+            //
+            for i in 0 ..< coarseSize { updated[i] = Int.min }
+
+            let dst = output + y * width
+
+            for x in 0 ..< width {
+
+                //
+                // alpha keeps the source value
+                //
+                var color = dst[x]
+
+                for ch in 0 ..< channels {
+
+                    //
+                    // coarse search
+                    //
+                    let c   = coarse + ch * coarseBins
+                    var sum = Float(0)
+                    var b   = 0
+                    while b < coarseBins - 1 && sum + c[b] <= rank {
+                        sum += c[b]
+                        b   += 1
+                    }
+
+                    //
+                    // bring the fine segment up to date
+                    //
+                    let index   = ch * coarseBins + b
+                    let offset  = ch * bins + b * segmentBins
+                    let segment = fine + offset
+                    let last    = updated[index]
+
+                    if last == Int.min || x - last > radius {
+                        for i in 0 ..< segmentBins { segment[i] = 0 }
+                        for j in x - radius ... x + radius {
+                            IMPSlidingHistogram.add(segment, columnFine + clampColumn(j) * fineSize + offset, count: segmentBins)
+                        }
+                    }
+                    else {
+                        for j in last + 1 ..< x + 1 {
+                            IMPSlidingHistogram.add(segment, columnFine + clampColumn(j + radius) * fineSize + offset, count: segmentBins)
+                            IMPSlidingHistogram.subtract(segment, columnFine + clampColumn(j - radius - 1) * fineSize + offset, count: segmentBins)
+                        }
+                    }
+                    updated[index] = x
+
+                    //
+                    // fine search
+                    //
+                    var i = 0
+                    while i < segmentBins - 1 && sum + segment[i] <= rank {
+                        sum += segment[i]
+                        i   += 1
+                    }
+
+                    color[ch] = Float(b * segmentBins + i) / Float(bins - 1)
+                }
+
+                dst[x] = color
+
+                //
+                // slide the coarse window
+                //
+                if x + 1 < width {
+                    IMPSlidingHistogram.add(coarse, columnCoarse + clampColumn(x + radius + 1) * coarseSize, count: coarseSize)
+                    IMPSlidingHistogram.subtract(coarse, columnCoarse + clampColumn(x - radius) * coarseSize, count: coarseSize)
+                }
+            }
+        }
+    }
+
+    ///  Vector add of histogram bins, count is multiple of 4
+    @inline(__always) static func add(destination:UnsafeMutablePointer<Float>, _ source:UnsafePointer<Float>, count:Int) {
+        let d = UnsafeMutablePointer<float4>(destination)
+        let s = UnsafePointer<float4>(source)
+        for i in 0 ..< count / 4 {
+            d[i] += s[i]
+        }
+    }
+
+    ///  Vector subtract of histogram bins, count is multiple of 4
+    @inline(__always) static func subtract(destination:UnsafeMutablePointer<Float>, _ source:UnsafePointer<Float>, count:Int) {
+        let d = UnsafeMutablePointer<float4>(destination)
+        let s = UnsafePointer<float4>(source)
+        for i in 0 ..< count / 4 {
+            d[i] -= s[i]
+        }
+    }
+}
@@ -26,6 +26,14 @@ public class IMPHistogramDominantColorSolver: NSObject, IMPHistogramSolver {
     public var color=float4()
     
     public func analizerDidUpdate(analizer: IMPHistogramAnalyzerProtocol, histogram: IMPHistogram, imageSize: CGSize) {
+        //
+        // with the summed area table of the analyzer the region mean is exact and does not depend on bins,
+        // the 4th channel is luma like in the histogram kernels
+        //
+        if let mean = (analizer as? IMPHistogramAnalyzer)?.mean() {
+            color = float4(rgb: mean.xyz, a: dot(mean.xyz, kIMP_Y_YCbCr_factor))
+            return
+        }
         for i in 0..<histogram.channels.count{
             let index = IMPHistogram.ChannelNo(rawValue: i)!
             color[i] = histogram.mean(channel: index)
@@ -0,0 +1,227 @@
+//
+//  IMPBlending.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import simd
+
+//
+// CPU side of the IMPBlending_metal.h modes: the same formulas on simd vectors,
+// so host code and compositing templates produce the same result as kernels.
+//
+
+//
+// One type per separable mode: generic loops are specialized by the compiler per type,
+// so a batch inlines the formula instead of calling a closure per pixel.
+//
+
+protocol IMPSeparableBlend {
+    static func color(base:float3, _ overlay:float3) -> float3
+}
+
+struct IMPBlendMultiply: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return base * overlay
+    }
+}
+
+struct IMPBlendScreen: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return float3(1) - (float3(1) - base) * (float3(1) - overlay)
+    }
+}
+
+struct IMPBlendOverlay: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        let one = float3(1)
+        return mix(2 * base * overlay, one - 2 * (one - base) * (one - overlay), t: step(base, edge: float3(0.5)))
+    }
+}
+
+struct IMPBlendLinearLight: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return clamp(base + 2 * overlay - float3(1), min: 0, max: 1)
+    }
+}
+
+struct IMPBlendLighten: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return max(base, overlay)
+    }
+}
+
+struct IMPBlendDarken: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return min(base, overlay)
+    }
+}
+
+struct IMPBlendColorDodge: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        let one = float3(1)
+        return mix(min(base / max(one - overlay, float3(1e-6)), one), one, t: step(overlay, edge: one))
+    }
+}
+
+struct IMPBlendLinearDodge: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return min(base + overlay, float3(1))
+    }
+}
+
+struct IMPBlendColorBurn: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        let one  = float3(1)
+        let zero = float3(0)
+        return mix(one - min((one - base) / max(overlay, float3(1e-6)), one), zero, t: step(-overlay, edge: zero))
+    }
+}
+
+struct IMPBlendLinearBurn: IMPSeparableBlend {
+    @inline(__always) static func color(base:float3, _ overlay:float3) -> float3 {
+        return max(base + overlay - float3(1), float3(0))
+    }
+}
+
+public extension IMPBlendingMode {
+
+    public typealias SeparableFunction = ((base:float3, overlay:float3) -> float3)
+
+    ///
+    /// Separable blending function applied to the whole rgb vector.
+    /// Luminosity and normal modes are not separable, so they return nil.
+    ///
+    public var separableFunction:SeparableFunction? {
+        switch self {
+        case IMPBlendingMode.MULTIPLY:     return IMPBlendMultiply.color
+        case IMPBlendingMode.SCREEN:       return IMPBlendScreen.color
+        case IMPBlendingMode.OVERLAY:      return IMPBlendOverlay.color
+        case IMPBlendingMode.LINEAR_LIGHT: return IMPBlendLinearLight.color
+        case IMPBlendingMode.LIGHTEN:      return IMPBlendLighten.color
+        case IMPBlendingMode.DARKEN:       return IMPBlendDarken.color
+        case IMPBlendingMode.COLOR_DODGE:  return IMPBlendColorDodge.color
+        case IMPBlendingMode.LINEAR_DODGE: return IMPBlendLinearDodge.color
+        case IMPBlendingMode.COLOR_BURN:   return IMPBlendColorBurn.color
+        case IMPBlendingMode.LINEAR_BURN:  return IMPBlendLinearBurn.color
+        default:
+            return nil
+        }
+    }
+
+    ///  Blend overlay color with the base one, overlay alpha is the blending opacity
+    ///
+    ///  - parameter base:    base color
+    ///  - parameter overlay: overlay color
+    ///
+    ///  - returns: blended color
+    public func blend(base base:float4, overlay:float4) -> float4 {
+        if let function = separableFunction {
+            let rgb = clamp(function(base: base.xyz, overlay: overlay.xyz), min: 0, max: 1)
+            return float4(rgb: mix(base.xyz, rgb, t: overlay.w), a: base.w)
+        }
+        else if self == IMPBlendingMode.LUMNINOSITY {
+            return IMPBlendingMode.blendLuminosity(base, overlay)
+        }
+        return IMPBlendingMode.blendNormal(base, overlay)
+    }
+
+    static func blendNormal(base:float4, _ overlay:float4) -> float4 {
+        let a       = overlay.w + base.w * (1 - overlay.w)
+        let divisor = a + (a <= 0 ? 1 : 0)
+        let rgb     = (overlay.xyz * overlay.w + base.xyz * (base.w * (1 - overlay.w))) * (1 / divisor)
+        return clamp(float4(rgb: rgb, a: a), min: 0, max: 1)
+    }
+
+    static func blendLuminosity(base:float4, _ overlay:float4) -> float4 {
+        let rgb = base.xyz * (1 - overlay.w) + setlum(base.xyz, lum(overlay.xyz)) * overlay.w
+        return float4(rgb: rgb, a: base.w)
+    }
+
+    static func lum(c:float3) -> Float {
+        return dot(c, kIMP_Y_YCbCr_factor)
+    }
+
+    static func setlum(c:float3, _ l:Float) -> float3 {
+        let ll = lum(c)
+        var c  = c + float3(l - ll)
+        let l3 = float3(ll)
+
+        let n = min(c.x, min(c.y, c.z))
+        let x = max(c.x, max(c.y, c.z))
+
+        if n < 0 {
+            c = l3 + (c - l3) * (ll / (ll - n))
+        }
+        if x > 1 {
+            c = l3 + (c - l3) * ((1 - ll) / (x - ll))
+        }
+        return c
+    }
+}
+
+public extension IMPBlending {
+
+    ///  Blend overlay color with the base one using current mode and opacity
+    public func blend(base base:float4, overlay:float4) -> float4 {
+        return mode.blend(base: base, overlay: float4(rgb: overlay.xyz, a: overlay.w * opacity))
+    }
+
+    ///  Blend overlay pixels with the base ones on CPU.
+    ///  The mode is resolved once per call to a loop specialized for it,
+    ///  buffers are split to strips processed concurrently.
+    ///
+    ///  - parameter base:        base pixels
+    ///  - parameter overlay:     overlay pixels
+    ///  - parameter destination: result pixels, can be the same as base
+    ///  - parameter count:       pixels count
+    public func blend(base base:UnsafePointer<float4>, overlay:UnsafePointer<float4>, destination:UnsafeMutablePointer<float4>, count:Int) {
+        switch mode {
+        case IMPBlendingMode.MULTIPLY:     blendStrips(IMPBlendMultiply.self,    base, overlay, destination, count)
+        case IMPBlendingMode.SCREEN:       blendStrips(IMPBlendScreen.self,      base, overlay, destination, count)
+        case IMPBlendingMode.OVERLAY:      blendStrips(IMPBlendOverlay.self,     base, overlay, destination, count)
+        case IMPBlendingMode.LINEAR_LIGHT: blendStrips(IMPBlendLinearLight.self, base, overlay, destination, count)
+        case IMPBlendingMode.LIGHTEN:      blendStrips(IMPBlendLighten.self,     base, overlay, destination, count)
+        case IMPBlendingMode.DARKEN:       blendStrips(IMPBlendDarken.self,      base, overlay, destination, count)
+        case IMPBlendingMode.COLOR_DODGE:  blendStrips(IMPBlendColorDodge.self,  base, overlay, destination, count)
+        case IMPBlendingMode.LINEAR_DODGE: blendStrips(IMPBlendLinearDodge.self, base, overlay, destination, count)
+        case IMPBlendingMode.COLOR_BURN:   blendStrips(IMPBlendColorBurn.self,   base, overlay, destination, count)
+        case IMPBlendingMode.LINEAR_BURN:  blendStrips(IMPBlendLinearBurn.self,  base, overlay, destination, count)
+        default:
+            let mode    = self.mode
+            let opacity = self.opacity
+            forEachStrip(count) { (start, end) in
+                for j in start ..< end {
+                    let o = overlay[j]
+                    destination[j] = mode.blend(base: base[j], overlay: float4(rgb: o.xyz, a: o.w * opacity))
+                }
+            }
+        }
+    }
+
+    private func blendStrips<M:IMPSeparableBlend>(_:M.Type,
+                             _ base:UnsafePointer<float4>, _ overlay:UnsafePointer<float4>,
+                             _ destination:UnsafeMutablePointer<float4>, _ count:Int) {
+        let opacity = self.opacity
+        forEachStrip(count) { (start, end) in
+            for j in start ..< end {
+                let b   = base[j]
+                let o   = overlay[j]
+                let rgb = clamp(M.color(b.xyz, o.xyz), min: 0, max: 1)
+                destination[j] = float4(rgb: mix(b.xyz, rgb, t: o.w * opacity), a: b.w)
+            }
+        }
+    }
+
+    private func forEachStrip(count:Int, body:(start:Int, end:Int) -> Void) {
+        let strip  = 4096
+        let strips = (count + strip - 1) / strip
+        dispatch_apply(strips, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (i) in
+            let start = i * strip
+            body(start: start, end: start + strip < count ? start + strip : count)
+        }
+    }
+}
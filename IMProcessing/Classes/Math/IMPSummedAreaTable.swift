@@ -0,0 +1,238 @@
+//
+//  IMPSummedAreaTable.swift
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+import Foundation
+import Metal
+import simd
+
+///
+/// Summed area tables of rgba pixels and their squares. Sums are accumulated in doubles,
+/// so tables of large images keep precision. Sum, mean and variance of any rectangle cost O(1).
+/// The squares table is built on the first variance request, box and mean users do not pay for it.
+///
+public class IMPSummedAreaTable {
+
+    /// Source image width
+    public let width:Int
+
+    /// Source image height
+    public let height:Int
+
+    ///  Build tables of rgba float pixels
+    ///
+    ///  - parameter pixels: rgba pixels
+    ///  - parameter width:  image width
+    ///  - parameter height: image height
+    ///  - parameter stride: pixels per row, width by default
+    public init(pixels:UnsafePointer<float4>, width:Int, height:Int, stride:Int = 0) {
+
+        self.width  = width
+        self.height = height
+
+        let stride  = stride > 0 ? stride : width
+        let columns = width + 1
+
+        let length = columns * (height + 1)
+
+        sums = UnsafeMutablePointer<double4>.alloc(length)
+
+        //
+        // the first row and column stay zero
+        //
+        sums.initializeFrom([double4](count: columns, repeatedValue: double4(0)))
+
+        let s = sums
+
+        //
+        // rows prefix sums
+        //
+        dispatch_apply(height, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (y) in
+            let row = pixels + y * stride
+            let sr  = s + (y + 1) * columns
+            var sum = double4(0)
+            sr[0] = sum
+            for x in 0 ..< width {
+                let p = row[x]
+                sum += double4(Double(p.x), Double(p.y), Double(p.z), Double(p.w))
+                sr[x + 1] = sum
+            }
+        }
+
+        IMPSummedAreaTable.accumulateColumns(s, columns: columns, height: height)
+    }
+
+    deinit {
+        let length = (width + 1) * (height + 1)
+        sums.dealloc(length)
+        if squares != nil {
+            squares.dealloc(length)
+        }
+    }
+
+    ///  Build tables of texture pixels
+    ///
+    ///  - parameter texture: texture readable by MTLTexture.pixels(_:), BGRA8Unorm pixels are summed in rgba order
+    ///  - parameter context: device context
+    public convenience init?(texture:MTLTexture, context:IMPContext) {
+        guard let pixels = texture.pixels(context) else { return nil }
+        self.init(pixels: pixels, width: texture.width, height: texture.height)
+    }
+
+    ///  Sum of pixels inside rectangle, the rectangle is clipped by image bounds
+    public func sum(x x:Int, y:Int, width:Int, height:Int) -> double4 {
+        return rectangle(sums, x: x, y: y, width: width, height: height).value
+    }
+
+    ///  Mean of pixels inside rectangle
+    public func mean(x x:Int, y:Int, width:Int, height:Int) -> float4 {
+        let (value, count) = rectangle(sums, x: x, y: y, width: width, height: height)
+        guard count > 0 else { return float4(0) }
+        return IMPSummedAreaTable.float(value * (1 / Double(count)))
+    }
+
+    ///  Variance of pixels inside rectangle
+    public func variance(x x:Int, y:Int, width:Int, height:Int) -> float4 {
+        let (sum, count) = rectangle(sums,    x: x, y: y, width: width, height: height)
+        let (sq, _)      = rectangle(squaresTable, x: x, y: y, width: width, height: height)
+        guard count > 0 else { return float4(0) }
+        let n    = 1 / Double(count)
+        let mean = sum * n
+        return IMPSummedAreaTable.float(max(sq * n - mean * mean, double4(0)))
+    }
+
+    ///  Mean of pixels inside region
+    public func mean(region:IMPRegion) -> float4 {
+        let (x, y, w, h) = rectangle(region)
+        return mean(x: x, y: y, width: w, height: h)
+    }
+
+    ///  Variance of pixels inside region
+    public func variance(region:IMPRegion) -> float4 {
+        let (x, y, w, h) = rectangle(region)
+        return variance(x: x, y: y, width: w, height: h)
+    }
+
+    ///  Box filter: every pixel is the mean of (2*radius+1)^2 window clipped by image bounds
+    ///
+    ///  - parameter radius: window radius
+    ///
+    ///  - returns: width*height filtered pixels
+    public func box(radius radius:Int) -> [float4] {
+        var result = [float4](count: width * height, repeatedValue: float4(0))
+        let size   = 2 * radius + 1
+        result.withUnsafeMutableBufferPointer { (result) -> Void in
+            let r = result.baseAddress
+            dispatch_apply(self.height, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (y) in
+                let row = r + y * self.width
+                for x in 0 ..< self.width {
+                    let (value, count) = self.rectangle(self.sums, x: x - radius, y: y - radius, width: size, height: size)
+                    row[x] = IMPSummedAreaTable.float(value * (1 / Double(count)))
+                }
+            }
+        }
+        return result
+    }
+
+    static let columnsPerBand = 64
+
+    //
+    // (width+1)*(height+1) tables, probes read them directly without array bounds checks or retains
+    //
+    private let sums:UnsafeMutablePointer<double4>
+    private var squares:UnsafeMutablePointer<double4> = nil
+    private var squaresOnce:dispatch_once_t = 0
+
+    private var squaresTable:UnsafeMutablePointer<double4> {
+        dispatch_once(&squaresOnce) {
+            self.squares = self.buildSquares()
+        }
+        return squares
+    }
+
+    //
+    // pixels are restored from the sums table, doubles keep them to float precision
+    //
+    private func buildSquares() -> UnsafeMutablePointer<double4> {
+
+        let columns = width + 1
+        let width   = self.width
+        let s       = sums
+        let q       = UnsafeMutablePointer<double4>.alloc(columns * (height + 1))
+
+        q.initializeFrom([double4](count: columns, repeatedValue: double4(0)))
+
+        dispatch_apply(height, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (y) in
+            let sp = s + y * columns
+            let sr = sp + columns
+            let qr = q + (y + 1) * columns
+            var sq = double4(0)
+            qr[0] = sq
+            for x in 0 ..< width {
+                let v = sr[x + 1] - sp[x + 1] - sr[x] + sp[x]
+                sq += v * v
+                qr[x + 1] = sq
+            }
+        }
+
+        IMPSummedAreaTable.accumulateColumns(q, columns: columns, height: height)
+
+        return q
+    }
+
+    //
+    // columns prefix sums run across contiguous rows in bands
+    //
+    private static func accumulateColumns(table:UnsafeMutablePointer<double4>, columns:Int, height:Int) {
+
+        let band  = columnsPerBand
+        let bands = (columns + band - 1) / band
+
+        dispatch_apply(bands, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0)) { (i) in
+            let x0 = i * band
+            let x1 = min(x0 + band, columns)
+            for y in 2 ..< max(height + 1, 2) {
+                let r = table + y * columns
+                let p = r - columns
+                for x in x0 ..< x1 {
+                    r[x] += p[x]
+                }
+            }
+        }
+    }
+
+    private func rectangle(table:UnsafePointer<double4>, x:Int, y:Int, width:Int, height:Int) -> (value:double4, count:Int) {
+
+        let x0 = max(x, 0)
+        let y0 = max(y, 0)
+        let x1 = min(x + width,  self.width)
+        let y1 = min(y + height, self.height)
+
+        guard x1 > x0 && y1 > y0 else { return (double4(0), 0) }
+
+        let columns = self.width + 1
+
+        let value = table[y1 * columns + x1] - table[y0 * columns + x1] - table[y1 * columns + x0] + table[y0 * columns + x0]
+
+        return (value, (x1 - x0) * (y1 - y0))
+    }
+
+    private func rectangle(region:IMPRegion) -> (Int,Int,Int,Int) {
+        //
+        // the same box histogram kernels test: [left,1-right) x [bottom,1-top) in texture coordinates
+        //
+        let x0 = Int(round(region.left   * Float(width)))
+        let x1 = Int(round((1 - region.right) * Float(width)))
+        let y0 = Int(round(region.bottom * Float(height)))
+        let y1 = Int(round((1 - region.top)   * Float(height)))
+        return (x0, y0, x1 - x0, y1 - y0)
+    }
+
+    private static func float(v:double4) -> float4 {
+        return float4(Float(v.x), Float(v.y), Float(v.z), Float(v.w))
+    }
+}
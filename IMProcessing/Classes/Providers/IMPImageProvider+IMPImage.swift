@@ -58,8 +58,17 @@ public extension IMPImageProvider{
         completeUpdate()
     }
     
-    public func writeToJpeg(path:String, compression compressionQ:Float) throws {
+    ///  Write texture to jpeg file
+    ///
+    ///  - parameter path:         file path
+    ///  - parameter compressionQ: quality 0-1
+    ///  - parameter concurrency:  encoding threads, 0 uses all active processors, 1 encodes serially
+    public func writeToJpeg(path:String, compression compressionQ:Float, concurrency:Int = 1) throws {
         if let t = texture {
+            if concurrency != 1 {
+                try IMPJpegturbo.writeMTLTexture(t, toJpegFile: path, compression: compressionQ.cgfloat, concurrency: UInt(concurrency))
+                return
+            }
             var error:NSError?
             IMPJpegturbo.writeMTLTexture(t, toJpegFile: path, compression: compressionQ.cgfloat, error: &error)
             if error != nil {
@@ -7,9 +7,14 @@
 //
 
 import Foundation
+import Metal
+import Accelerate
 
 public class IMPJpegProvider:IMPImageProvider{
 
+    /// R8Unorm YCbCr planes of the last planar decoding at the native subsampling: luma first
+    public private(set) var planes = [MTLTexture]()
+
     public convenience init(context: IMPContext, file: String, maxSize: Float = 0, orientation:IMPExifOrientation = IMPExifOrientationUp) throws {
         self.init(context: context)
         try self.updateFromJpeg(file: file, maxSize: maxSize, orientation: orientation)
@@ -24,6 +29,123 @@ public class IMPJpegProvider:IMPImageProvider{
                                                     maxSize: maxSize.cgfloat
         )
         
+        texture = transform(source, orientation: orientation)
+        planes = []
+        
+        self.orientation = .Up
+        
+        completeUpdate()
+    }
+    
+    ///  Decode jpeg bytes in memory, e.g. a buffer received from network or a capture session, without copying
+    ///
+    ///  - parameter source:      jpeg bytes
+    ///  - parameter maxSize:     maximum size of the smaller image side
+    ///  - parameter orientation: image orientation
+    public func updateFromJpeg(source source:IMPJpegSource, maxSize: Float = 0, orientation:IMPExifOrientation = IMPExifOrientationUp) throws {
+        let image = try IMPJpegturbo.updateMTLTexture(texture,
+                                                   withPixelFormat: IMProcessing.colors.pixelFormat,
+                                                   withDevice: context.device,
+                                                   fromSource: source,
+                                                   maxSize: maxSize.cgfloat
+        )
+        
+        texture = transform(image, orientation: orientation)
+        planes = []
+        
+        self.orientation = .Up
+        
+        completeUpdate()
+    }
+    
+    ///  Decode a region of jpeg: only MCUs covering the region are transformed
+    ///
+    ///  - parameter file:        jpeg file
+    ///  - parameter region:      region of the stored image before orientation, the same as IMPCropFilter.region
+    ///  - parameter maxSize:     maximum size of the region
+    ///  - parameter orientation: image orientation
+    public func updateFromJpeg(file file:String, region:IMPRegion, maxSize: Float = 0, orientation:IMPExifOrientation = IMPExifOrientationUp) throws {
+        let rect = CGRect(x: region.left.cgfloat, y: region.top.cgfloat, width: region.width.cgfloat, height: region.height.cgfloat)
+        
+        let source = try IMPJpegturbo.updateMTLTexture(texture,
+                                                    withPixelFormat: IMProcessing.colors.pixelFormat,
+                                                    withDevice: context.device,
+                                                    fromFile: file,
+                                                    region: rect,
+                                                    maxSize: maxSize.cgfloat
+        )
+        
+        texture = transform(source, orientation: orientation)
+        planes = []
+        
+        self.orientation = .Up
+        
+        completeUpdate()
+    }
+    
+    ///  Decode a preview for analyzers: histogram, cube or white balance analysis does not need full resolution.
+    ///  DC coefficients only are used at 1/8 scale, the exif thumbnail is used when it is big enough.
+    ///
+    ///  - parameter file:        jpeg file
+    ///  - parameter minSize:     minimum size of the smaller preview side
+    ///  - parameter orientation: image orientation
+    public func updateFromJpegPreview(file file:String, minSize: Float = 256, orientation:IMPExifOrientation = IMPExifOrientationUp) throws {
+        let source = try IMPJpegturbo.updateMTLTexture(texture,
+                                                    withPixelFormat: IMProcessing.colors.pixelFormat,
+                                                    withDevice: context.device,
+                                                    previewOfFile: file,
+                                                    minSize: minSize.cgfloat
+        )
+        
+        texture = transform(source, orientation: orientation)
+        planes = []
+        
+        self.orientation = .Up
+        
+        completeUpdate()
+    }
+    
+    ///  Decode jpeg to YCbCr planes and compose rgba on GPU: CPU does not convert colors and upsample chroma
+    ///
+    ///  - parameter file:        jpeg file
+    ///  - parameter maxSize:     maximum size of the smaller image side
+    ///  - parameter orientation: image orientation
+    public func updateFromPlanarJpeg(file file:String, maxSize: Float = 0, orientation:IMPExifOrientation = IMPExifOrientationUp) throws {
+        
+        let planar = try IMPJpegturbo.decodePlanarFile(file, maxSize: maxSize.cgfloat, lumaOnly: false)
+        
+        planes = (0 ..< Int(planar.planesCount)).map { (plane) -> MTLTexture in
+            return self.planeTexture(planar, plane: plane)
+        }
+        
+        let luma   = planes[0]
+        let chroma = planes.count == 3 ? (planes[1], planes[2]) : (neutralChroma, neutralChroma)
+        
+        let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+            IMProcessing.colors.pixelFormat,
+            width: luma.width, height: luma.height, mipmapped: false)
+        
+        let source = context.device.newTextureWithDescriptor(descriptor)
+        
+        context.execute(complete: true) { (commandBuffer) in
+            
+            let function = self.kernel_YCbCrPlanesToRGBA
+            let threadgroupCounts = MTLSizeMake(function.groupSize.width, function.groupSize.height, 1)
+            let threadgroups = MTLSizeMake(
+                (luma.width  + threadgroupCounts.width ) / threadgroupCounts.width ,
+                (luma.height + threadgroupCounts.height) / threadgroupCounts.height,
+                1)
+            
+            let commandEncoder = commandBuffer.computeCommandEncoder()
+            commandEncoder.setComputePipelineState(function.pipeline!)
+            commandEncoder.setTexture(luma,     atIndex: 0)
+            commandEncoder.setTexture(source,   atIndex: 1)
+            commandEncoder.setTexture(chroma.0, atIndex: 2)
+            commandEncoder.setTexture(chroma.1, atIndex: 3)
+            commandEncoder.dispatchThreadgroups(threadgroups, threadsPerThreadgroup:threadgroupCounts)
+            commandEncoder.endEncoding()
+        }
+        
         texture = transform(source, orientation: orientation)
         
         self.orientation = .Up
@@ -31,4 +153,57 @@ public class IMPJpegProvider:IMPImageProvider{
         completeUpdate()
     }
     
- }
\ No newline at end of file
+    func planeTexture(planar:IMPJpegPlanarImage, plane:Int) -> MTLTexture {
+        
+        let width  = Int(planar.widthOfPlane(UInt(plane)))
+        let height = Int(planar.heightOfPlane(UInt(plane)))
+        
+        let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(
+            .R8Unorm,
+            width: width, height: height, mipmapped: false)
+        
+        let texture = context.device.newTextureWithDescriptor(descriptor)
+        
+        texture.replaceRegion(MTLRegionMake2D(0, 0, width, height),
+                              mipmapLevel: 0,
+                              withBytes: planar.bytesOfPlane(UInt(plane)),
+                              bytesPerRow: Int(planar.bytesPerRowOfPlane(UInt(plane))))
+        return texture
+    }
+    
+    lazy var neutralChroma:MTLTexture = {
+        let descriptor = MTLTextureDescriptor.texture2DDescriptorWithPixelFormat(.R8Unorm, width: 1, height: 1, mipmapped: false)
+        let texture = self.context.device.newTextureWithDescriptor(descriptor)
+        var value = UInt8(128)
+        texture.replaceRegion(MTLRegionMake2D(0, 0, 1, 1), mipmapLevel: 0, withBytes: &value, bytesPerRow: 1)
+        return texture
+    }()
+    
+    lazy var kernel_YCbCrPlanesToRGBA:IMPFunction = {
+        return IMPFunction(context: self.context, name: "kernel_YCbCrPlanesToRGBA")
+    }()
+ }
+
+public extension IMPJpegPlanarImage {
+    
+    ///  Histogram of a plane straight from the decoded samples, luma by default.
+    ///  Use IMPJpegturbo.decodePlanarFile(lumaOnly:true) for luma analysis: chroma is not transformed at all.
+    ///
+    ///  - parameter plane: plane index
+    ///
+    ///  - returns: planar histogram of kIMP_HistogramSize bins
+    public func histogram(plane plane:Int = 0) -> IMPHistogram {
+        
+        var bins = [vImagePixelCount](count: Int(kIMP_HistogramSize), repeatedValue: 0)
+        
+        var buffer = vImage_Buffer(
+            data:     bytesOfPlane(UInt(plane)),
+            height:   vImagePixelCount(heightOfPlane(UInt(plane))),
+            width:    vImagePixelCount(widthOfPlane(UInt(plane))),
+            rowBytes: Int(bytesPerRowOfPlane(UInt(plane))))
+        
+        vImageHistogramCalculation_Planar8(&buffer, &bins, vImage_Flags(kvImageNoFlags))
+        
+        return IMPHistogram(channels: [bins.map{ Float($0) }])
+    }
+}
@@ -43,12 +43,7 @@ namespace IMProcessing
         float4 result = lut.sample(s, inColor.rgb);
         result.rgba.a = adjustment.blending.opacity;
         
-        if (adjustment.blending.mode == LUMINOSITY) {
-            result = blendLuminosity(inColor, result);
-        }
-        else {// only two modes yet
-            result = blendNormal(inColor, result);
-        }
+        result = IMProcessing::blend(inColor, result, adjustment.blending.mode);
         
         return result;
     }
@@ -66,12 +61,7 @@ namespace IMProcessing
         
         float4 result = float4(red, green, blue, adjustment.blending.opacity);
         
-        if (adjustment.blending.mode == LUMINOSITY) {
-            result = blendLuminosity(inColor, result);
-        }
-        else {// only two modes yet
-            result = blendNormal(inColor, result);
-        }
+        result = IMProcessing::blend(inColor, result, adjustment.blending.mode);
         
         return result;
     }
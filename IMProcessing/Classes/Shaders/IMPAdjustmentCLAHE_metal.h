@@ -0,0 +1,134 @@
+//
+//  IMPAdjustmentCLAHE_metal.h
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+#ifndef IMPAdjustmentCLAHE_metal_h
+#define IMPAdjustmentCLAHE_metal_h
+
+#ifdef __METAL_VERSION__
+
+#include "IMPSwift-Bridging-Metal.h"
+#include "IMPConstants_metal.h"
+#include "IMPFlowControl_metal.h"
+#include "IMPCommon_metal.h"
+#include "IMPColorSpaces_metal.h"
+#include "IMPBlending_metal.h"
+
+using namespace metal;
+
+#ifdef __cplusplus
+
+namespace IMProcessing
+{
+    ///
+    ///  @brief Equalize luma with bilinear interpolation of the four nearest tile LUTs
+    ///
+    ///  @param inColor    input color
+    ///  @param luts       per tile luma LUTs, slice index is y*grid.x+x
+    ///  @param grid       tiles grid size
+    ///  @param coords     normalized pixel coordinates
+    ///  @param adjustment blending
+    ///
+    inline float4 adjustCLAHE(float4 inColor,
+                              texture1d_array<float, access::sample> luts,
+                              float2 grid,
+                              float2 coords,
+                              constant IMPAdjustment &adjustment){
+
+        constexpr sampler s(address::clamp_to_edge, filter::linear, coord::normalized);
+
+        //
+        // tile centers are at (i+0.5)/grid
+        //
+        float2 f    = coords * grid - 0.5;
+        float2 last = grid - 1.0;
+        float2 t0   = clamp(floor(f), float2(0.0), last);
+        float2 t1   = min(t0 + 1.0, last);
+        float2 w    = clamp(f - t0, float2(0.0), float2(1.0));
+
+        float3 ycbcr = rgb_2_YCbCr(inColor.rgb);
+        float  y     = clamp(ycbcr.x, 0.0, 1.0);
+
+        //
+        // linear filter of 256 texels LUT: texel centers are at (i+0.5)/256
+        //
+        float  x     = (y * (kIMP_HistogramSize - 1) + 0.5) / kIMP_HistogramSize;
+
+        float y00 = luts.sample(s, x, uint(t0.y * grid.x + t0.x)).x;
+        float y10 = luts.sample(s, x, uint(t0.y * grid.x + t1.x)).x;
+        float y01 = luts.sample(s, x, uint(t1.y * grid.x + t0.x)).x;
+        float y11 = luts.sample(s, x, uint(t1.y * grid.x + t1.x)).x;
+
+        ycbcr.x = mix(mix(y00, y10, w.x), mix(y01, y11, w.x), w.y);
+
+        float4 result = float4(YCbCr_2_rgb(ycbcr), inColor.a);
+
+        return IMProcessing::blend(inColor, float4(result.rgb, adjustment.blending.opacity), adjustment.blending.mode);
+    }
+
+    ///
+    ///  @brief Luma histogram of one tile per threadgroup. Tile bounds are floor(i*size/grid), so tiles
+    ///  cover every pixel and remainder columns and rows are spread over the grid. The luma is the one
+    ///  adjustCLAHE maps, it is put to the last channel of the histogram buffer.
+    ///
+    kernel void kernel_claheTileHistogram(
+                                          texture2d<float, access::sample>  inTexture  [[texture(0)]],
+                                          device   IMPHistogramBuffer       *outArray  [[buffer(0)]],
+                                          uint  tid      [[thread_index_in_threadgroup]],
+                                          uint  threads  [[threads_per_threadgroup]],
+                                          uint2 groupid  [[threadgroup_position_in_grid]],
+                                          uint2 gridSize [[threadgroups_per_grid]])
+    {
+        threadgroup atomic_int temp[kIMP_HistogramSize];
+        
+        uint2 size   = uint2(inTexture.get_width(), inTexture.get_height());
+        uint2 origin = groupid * size / gridSize;
+        uint2 end    = (groupid + 1) * size / gridSize;
+        uint  w      = end.x - origin.x;
+        uint  count  = w * (end.y - origin.y);
+        
+        for (uint i=tid; i<kIMP_HistogramSize; i+=threads){
+            atomic_store_explicit(&(temp[i]),0,memory_order_relaxed);
+        }
+        
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        
+        for (uint j=tid; j<count; j+=threads){
+            float4 inColor = inTexture.read(origin + uint2(j%w, j/w));
+            float  y       = clamp(rgb_2_YCbCr(inColor.rgb).x, 0.0, 1.0);
+            atomic_fetch_add_explicit(&(temp[uint(y * (kIMP_HistogramSize - 1) + 0.5)]), 1, memory_order_relaxed);
+        }
+        
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        
+        device uint *luma = outArray[groupid.y*gridSize.x+groupid.x].channels[kIMP_HistogramMaxChannels-1];
+        
+        for (uint i=tid; i<kIMP_HistogramSize; i+=threads){
+            luma[i] = atomic_load_explicit(&(temp[i]), memory_order_relaxed);
+        }
+    }
+
+    kernel void kernel_adjustCLAHE(
+                                   texture2d<float, access::sample>       inTexture   [[texture(0)]],
+                                   texture2d<float, access::write>        outTexture  [[texture(1)]],
+                                   texture1d_array<float, access::sample> luts        [[texture(2)]],
+                                   constant IMPAdjustment                 &adjustment [[buffer(0)]],
+                                   constant float2                        &grid       [[buffer(1)]],
+                                   uint2 gid [[thread_position_in_grid]]){
+
+        float4 inColor = sampledColor(inTexture,outTexture,gid);
+        float2 coords  = (float2(gid) + 0.5) / float2(outTexture.get_width(), outTexture.get_height());
+
+        outTexture.write(adjustCLAHE(inColor, luts, grid, coords, adjustment), gid);
+    }
+}
+
+#endif
+
+#endif
+
+#endif /* IMPAdjustmentCLAHE_metal_h */
@@ -32,12 +32,7 @@ namespace IMProcessing
         
         result.rgb  = clamp((result.rgb - alow)/(ahigh-alow), float3(0.0), float3(1.0));
         
-        if (adjustment.blending.mode == LUMINOSITY) {
-            result = blendLuminosity(inColor, float4(result.rgb, adjustment.blending.opacity));
-        }
-        else {// only two modes yet
-            result = blendNormal(inColor, float4(result.rgb, adjustment.blending.opacity));
-        }
+        result = IMProcessing::blend(inColor, float4(result.rgb, adjustment.blending.opacity), adjustment.blending.mode);
         
         return result;
     }
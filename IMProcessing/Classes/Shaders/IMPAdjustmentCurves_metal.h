@@ -43,10 +43,7 @@ namespace IMProcessing
         
         float4 result = float4(red, green, blue, adjustment.blending.opacity);
         
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(inColor, result);
-        else // only two modes yet
-            result = IMProcessing::blendNormal(inColor, result);
+        result = IMProcessing::blend(inColor, result, adjustment.blending.mode);
         
         
         return result;
@@ -88,10 +88,7 @@ namespace IMProcessing
         
         float3 rgb(IMProcessing::HSV_2_rgb(hsv));
         
-        if (adjust.blending.mode == 0)
-            return IMProcessing::blendLuminosity(input_color, float4(rgb, adjust.blending.opacity));
-        else
-            return IMProcessing::blendNormal(input_color, float4(rgb, adjust.blending.opacity));
+        return IMProcessing::blend(input_color, float4(rgb, adjust.blending.opacity), adjust.blending.mode);
     }
 
     ///
@@ -30,10 +30,7 @@ namespace IMProcessing
 
         float4 result = float4(mix(grayScale, inColor.rgb, adjustment.level * 2), adjustment.blending.opacity);
         
-        if (adjustment.blending.mode == LUMINOSITY)
-            return blendLuminosity(inColor, result);
-        else
-            return blendNormal(inColor, result);
+        return IMProcessing::blend(inColor, result, adjustment.blending.mode);
     }
     
     kernel void kernel_adjustSaturation(
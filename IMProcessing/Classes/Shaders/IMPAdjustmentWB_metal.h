@@ -48,10 +48,7 @@ namespace IMProcessing
         
         float4 result = float4(awb.rgb, adjustment.blending.opacity);
         
-        if (adjustment.blending.mode == LUMINOSITY)
-            return blendLuminosity(inColor, result);
-        else
-            return blendNormal(inColor, result);
+        return IMProcessing::blend(inColor, result, adjustment.blending.mode);
     }
     
     kernel void kernel_adjustWB(
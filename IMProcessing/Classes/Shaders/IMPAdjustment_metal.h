@@ -24,6 +24,7 @@
 #include "IMPAdjustment3DLUT_metal.h"
 #include "IMPAdjustmentHSV_metal.h"
 #include "IMPAdjustmentSaturation_metal.h"
+#include "IMPAdjustmentCLAHE_metal.h"
 
 #endif
 
@@ -96,6 +96,118 @@ namespace IMProcessing
     inline float4 blendMultiply(float4 base, float4 blend){
         return base*blend;
     }
+    
+    ///
+    /// @brief Separable blending modes applied to a whole rgb vector.
+    /// Every mode is a specialization, so kernels which know the mode statically have no branches at all.
+    ///
+    template<uint mode> inline float3 blendModeColor(float3 base, float3 overlay);
+    
+    template<> inline float3 blendModeColor<MULTIPLY>(float3 base, float3 overlay){
+        return blendMultiply(float4(base, 1.0), float4(overlay, 1.0)).rgb;
+    }
+    
+    template<> inline float3 blendModeColor<SCREEN>(float3 base, float3 overlay){
+        return BlendScreenf(base, overlay);
+    }
+    
+    template<> inline float3 blendModeColor<OVERLAY>(float3 base, float3 overlay){
+        return blendOverlay(float4(base, 1.0), float4(overlay, 1.0)).rgb;
+    }
+    
+    template<> inline float3 blendModeColor<LINEAR_LIGHT>(float3 base, float3 overlay){
+        return blendLinearLight(float4(base, 1.0), float4(overlay, 1.0)).rgb;
+    }
+    
+    template<> inline float3 blendModeColor<LIGHTEN>(float3 base, float3 overlay){
+        return blendLighten(base, overlay);
+    }
+    
+    template<> inline float3 blendModeColor<DARKEN>(float3 base, float3 overlay){
+        return blendDarken(base, overlay);
+    }
+    
+    template<> inline float3 blendModeColor<COLOR_DODGE>(float3 base, float3 overlay){
+        return Blend(float4(base, 1.0), float4(overlay, 1.0), BlendColorDodgef).rgb;
+    }
+    
+    template<> inline float3 blendModeColor<LINEAR_DODGE>(float3 base, float3 overlay){
+        return Blend(float4(base, 1.0), float4(overlay, 1.0), BlendLinearDodgef).rgb;
+    }
+    
+    template<> inline float3 blendModeColor<COLOR_BURN>(float3 base, float3 overlay){
+        return select(1.0 - min((1.0 - base) / max(overlay, float3(1e-6)), float3(1.0)), float3(0.0), overlay <= 0.0);
+    }
+    
+    template<> inline float3 blendModeColor<LINEAR_BURN>(float3 base, float3 overlay){
+        return Blend(float4(base, 1.0), float4(overlay, 1.0), BlendLinearBurnf).rgb;
+    }
+    
+    ///  @brief Blend overlay color with the base one, overlay alpha is the blending opacity
+    template<uint mode> inline float4 blendMode(float4 base, float4 overlay){
+        return float4(mix(base.rgb, clamp(blendModeColor<mode>(base.rgb, overlay.rgb), 0.0, 1.0), overlay.a), base.a);
+    }
+    
+    template<> inline float4 blendMode<LUMINOSITY>(float4 base, float4 overlay){
+        return blendLuminosity(base, overlay);
+    }
+    
+    template<> inline float4 blendMode<NORMAL>(float4 base, float4 overlay){
+        return blendNormal(base, overlay);
+    }
+    
+    ///  @brief Blend with the mode is passed as kernel argument. The mode lives in constant memory
+    ///  and is the same for the whole grid, so the switch is uniform and does not diverge.
+    ///
+    inline float4 blend(float4 base, float4 overlay, IMPBlendingMode mode){
+        switch (mode) {
+            case LUMINOSITY:   return blendMode<LUMINOSITY>(base, overlay);
+            case MULTIPLY:     return blendMode<MULTIPLY>(base, overlay);
+            case SCREEN:       return blendMode<SCREEN>(base, overlay);
+            case OVERLAY:      return blendMode<OVERLAY>(base, overlay);
+            case LINEAR_LIGHT: return blendMode<LINEAR_LIGHT>(base, overlay);
+            case LIGHTEN:      return blendMode<LIGHTEN>(base, overlay);
+            case DARKEN:       return blendMode<DARKEN>(base, overlay);
+            case COLOR_DODGE:  return blendMode<COLOR_DODGE>(base, overlay);
+            case LINEAR_DODGE: return blendMode<LINEAR_DODGE>(base, overlay);
+            case COLOR_BURN:   return blendMode<COLOR_BURN>(base, overlay);
+            case LINEAR_BURN:  return blendMode<LINEAR_BURN>(base, overlay);
+            case NORMAL:
+            default:           return blendMode<NORMAL>(base, overlay);
+        }
+    }
+    
+    ///
+    /// @brief Layers compositing: overlay texture is blended over the source one.
+    /// A kernel per mode is instantiated, so a kernel does not select mode at all.
+    ///
+#define IMP_BLENDING_KERNEL(name, mode) \
+    kernel void kernel_blend##name( \
+                                   texture2d<float, access::sample> inTexture      [[texture(0)]], \
+                                   texture2d<float, access::write>  outTexture     [[texture(1)]], \
+                                   texture2d<float, access::sample> overlayTexture [[texture(2)]], \
+                                   constant float                   &opacity       [[buffer(0)]], \
+                                   uint2 gid [[thread_position_in_grid]]) \
+    { \
+        constexpr sampler s(address::clamp_to_edge, filter::linear, coord::normalized); \
+        float4 base    = sampledColor(inTexture, outTexture, gid); \
+        float2 coords  = float2(gid) / float2(outTexture.get_width(), outTexture.get_height()); \
+        float4 overlay = overlayTexture.sample(s, coords); \
+        outTexture.write(blendMode<mode>(base, float4(overlay.rgb, overlay.a * opacity)), gid); \
+    }
+    
+    IMP_BLENDING_KERNEL(Luminosity,  LUMINOSITY)
+    IMP_BLENDING_KERNEL(Normal,      NORMAL)
+    IMP_BLENDING_KERNEL(Multiply,    MULTIPLY)
+    IMP_BLENDING_KERNEL(Screen,      SCREEN)
+    IMP_BLENDING_KERNEL(Overlay,     OVERLAY)
+    IMP_BLENDING_KERNEL(LinearLight, LINEAR_LIGHT)
+    IMP_BLENDING_KERNEL(Lighten,     LIGHTEN)
+    IMP_BLENDING_KERNEL(Darken,      DARKEN)
+    IMP_BLENDING_KERNEL(ColorDodge,  COLOR_DODGE)
+    IMP_BLENDING_KERNEL(LinearDodge, LINEAR_DODGE)
+    IMP_BLENDING_KERNEL(ColorBurn,   COLOR_BURN)
+    IMP_BLENDING_KERNEL(LinearBurn,  LINEAR_BURN)
 }
 #endif
 
@@ -158,17 +158,35 @@ namespace IMProcessing
         return c;
     }
 
-    inline float4 sampledColor(
+    ///  @brief Exact texel, input and output textures have the same size
+    inline float4 identityColor(
+                                texture2d<float, access::sample> inTexture,
+                                uint2 gid
+                                ){
+        return inTexture.read(gid);
+    }
+    
+    ///  @brief Filtered sample at the output pixel position, input and output textures have different sizes
+    inline float4 resizedColor(
                                texture2d<float, access::sample> inTexture,
                                texture2d<float, access::write> outTexture,
                                uint2 gid
                                ){
         constexpr sampler s(address::clamp_to_edge, filter::linear, coord::normalized);
-        float w = outTexture.get_width();
-        return mix(inTexture.sample(s, float2(gid) * float2(1.0/w, 1.0/outTexture.get_height())),
-                   inTexture.read(gid),
-                   IMProcessing::when_eq(inTexture.get_width(), w) // whe equal read exact texture color
-                   );
+        return inTexture.sample(s, float2(gid) * float2(1.0/outTexture.get_width(), 1.0/outTexture.get_height()));
+    }
+    
+    ///  @brief Input color of the output pixel. Texture sizes are the same for the whole grid,
+    ///  so the branch does not diverge and every pixel does a single fetch.
+    inline float4 sampledColor(
+                               texture2d<float, access::sample> inTexture,
+                               texture2d<float, access::write> outTexture,
+                               uint2 gid
+                               ){
+        if (inTexture.get_width() == outTexture.get_width() && inTexture.get_height() == outTexture.get_height()) {
+            return identityColor(inTexture, gid);
+        }
+        return resizedColor(inTexture, outTexture, gid);
     }
 }
 
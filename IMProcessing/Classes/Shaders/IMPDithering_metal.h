@@ -58,10 +58,7 @@ namespace IMProcessing
         
         float4 result;
         
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(inColor, float4(rgb,adjustment.blending.opacity));
-        else // only two modes yet
-            result = IMProcessing::blendNormal(inColor, float4(rgb,adjustment.blending.opacity));
+        result = IMProcessing::blend(inColor, float4(rgb,adjustment.blending.opacity), adjustment.blending.mode);
         
         outTexture.write(result,gid);
     }
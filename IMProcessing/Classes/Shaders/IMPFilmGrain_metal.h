@@ -400,10 +400,7 @@ namespace IMProcessing
         
         float4 result;
         
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(inColor, float4(rgb, adjustment.blending.opacity));
-        else
-            result = IMProcessing::blendNormal    (inColor, float4(rgb, adjustment.blending.opacity));
+        result = IMProcessing::blend(inColor, float4(rgb, adjustment.blending.opacity), adjustment.blending.mode);
         
         outTexture.write(result,gid);
     }
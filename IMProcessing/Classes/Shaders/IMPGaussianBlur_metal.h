@@ -73,119 +73,102 @@ namespace IMProcessing
         
         float4 result = IMProcessing::sampledColor(sourceTexture,outTexture,gid);
         
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(result, float4(color, adjustment.blending.opacity));
-        else
-            result = IMProcessing::blendNormal(result, float4(color, adjustment.blending.opacity));
+        result = IMProcessing::blend(result, float4(color, adjustment.blending.opacity), adjustment.blending.mode);
         
         outTexture.write(result,gid);
     }
     
+    ///
+    ///  @brief Young–van Vliet recursion of one line with Triggs–Sdika boundaries.
+    ///  Forward outputs are kept in the line scratch, the recursion state lives in registers.
+    ///  Scratch of lines processed together is interleaved with scratchStep, so neighbour threads
+    ///  access neighbour addresses.
+    ///
+    inline void iirFilterLine(
+                              texture2d<float, access::sample>   inTexture,
+                              texture2d<float, access::write>    outTexture,
+                              device float4                      *scratch,
+                              uint                               scratchStep,
+                              constant IMPIIRFilterCoefficients  &filter,
+                              uint2 origin,
+                              uint2 step,
+                              uint  length){
+        
+        float  b = filter.coefficients.x;
+        float3 a = filter.coefficients.yzw;
+        
+        float4 first = inTexture.read(origin);
+        float4 u     = inTexture.read(origin + (length-1)*step);
+        
+        //
+        // forward: steady state of the first sample
+        //
+        float4 s1 = first, s2 = first, s3 = first;
+        
+        for (uint i=0; i<length; i++){
+            float4 y = b * inTexture.read(origin + i*step) + a.x * s1 + a.y * s2 + a.z * s3;
+            scratch[i*scratchStep] = y;
+            s3 = s2; s2 = s1; s1 = y;
+        }
+        
+        //
+        // backward: initial conditions of the replicated last sample
+        //
+        float4 d1 = s1 - u, d2 = s2 - u, d3 = s3 - u;
+        
+        float3 m0 = filter.boundary[0].xyz;
+        float3 m1 = filter.boundary[1].xyz;
+        float3 m2 = filter.boundary[2].xyz;
+        
+        s1 = u + m0.x * d1 + m0.y * d2 + m0.z * d3;
+        s2 = u + m1.x * d1 + m1.y * d2 + m1.z * d3;
+        s3 = u + m2.x * d1 + m2.y * d2 + m2.z * d3;
+        
+        outTexture.write(float4(s1.rgb,1), origin + (length-1)*step);
+        
+        for (int i=int(length)-2; i>=0; i--){
+            float4 y = b * scratch[uint(i)*scratchStep] + a.x * s1 + a.y * s2 + a.z * s3;
+            outTexture.write(float4(y.rgb,1), origin + uint(i)*step);
+            s3 = s2; s2 = s1; s1 = y;
+        }
+    }
+    
+    ///
+    ///  @brief Rows [lines.x, lines.x+lines.y) are filtered by one dispatch, scratch holds lines.y rows
+    ///
     kernel void  kernel_iirFilterHorizontal(
                                             texture2d<float, access::sample>  inTexture     [[texture(0)]],
                                             texture2d<float, access::write>   outTexture    [[texture(1)]],
-                                            device float3*                    inoutBuffer   [[buffer (0)]],
-                                            device float3*                    inoutBuffer2  [[buffer (1)]],
-                                            constant uint2                    &bufferSize   [[buffer (2)]],
-                                            constant int                      &radius       [[buffer (3)]],
-                                            texture1d<float, access::sample>  b             [[texture(2)]],
-                                            texture1d<float, access::sample>  a             [[texture(3)]],
+                                            device float4                     *scratch      [[buffer (0)]],
+                                            constant IMPIIRFilterCoefficients &filter       [[buffer (1)]],
+                                            constant uint2                    &lines        [[buffer (2)]],
                                             uint2 gid [[thread_position_in_grid]]){
         
+        uint width = inTexture.get_width();
+        uint y     = lines.x + gid.y;
         
-        int y     = gid.y;
-        int size  = inTexture.get_width();
-        int bsize = bufferSize.x;
-        int pada  = a.get_width();
-        int padb  = b.get_width();
-        int pad   = max(pada,padb);
-        
-        device float3 *row = &inoutBuffer[y*bsize];
-        
-        for(int i=0; i<bsize; i++) {
-            
-            for( int j=0; j<padb; j++) {
-                int2   xy  = int2(i-j,y);
-                row[i] +=  b.read(j).xxx*inTexture.read(uint2(xy)).rgb;
-            }
-            
-            for( int j=1; j<pada; j++) {
-                int x = i-j;
-                row[i] += row[x] * a.read(j).xxx ;
-            }
-        }
-        
-        device float3 *row2 = &inoutBuffer2[y*bsize];
-        
-        for(int i=bsize-pad-1; i>=0; i--) {
-            
-            for( int j=0; j<padb; j++) {
-                row2[i] +=  b.read(j).xxx*row[i+j];
-            }
-            
-            for( int j=1; j<pada; j++) {
-                row2[i] += row2[i+j] * a.read(j).xxx ;
-            }
-        }
+        if (gid.y >= lines.y || y >= inTexture.get_height()) return;
         
-        for (int i=0; i<size; i++){
-            float3 rgb = row2[i];
-            outTexture.write(float4(rgb,1),uint2(i,y));
-        }
+        iirFilterLine(inTexture, outTexture, &scratch[gid.y], lines.y, filter, uint2(0,y), uint2(1,0), width);
     }
     
-    
+    ///
+    ///  @brief Columns [lines.x, lines.x+lines.y) are filtered by one dispatch, scratch holds lines.y columns
+    ///
     kernel void  kernel_iirFilterVertical(
                                           texture2d<float, access::sample>  inTexture     [[texture(0)]],
                                           texture2d<float, access::write>   outTexture    [[texture(1)]],
-                                          device float3*                    inoutBuffer   [[buffer (0)]],
-                                          device float3*                    inoutBuffer2  [[buffer (1)]],
-                                          constant uint2                    &bufferSize   [[buffer (2)]],
-                                          constant int                      &radius       [[buffer (3)]],
-                                          texture1d<float, access::sample>  b             [[texture(2)]],
-                                          texture1d<float, access::sample>  a             [[texture(3)]],
+                                          device float4                     *scratch      [[buffer (0)]],
+                                          constant IMPIIRFilterCoefficients &filter       [[buffer (1)]],
+                                          constant uint2                    &lines        [[buffer (2)]],
                                           uint2 gid [[thread_position_in_grid]]){
         
+        uint height = inTexture.get_height();
+        uint x      = lines.x + gid.x;
         
-        int x     = gid.x;
-        int size  = inTexture.get_height();
-        int bsize = bufferSize.y;
-        int pada  = a.get_width();
-        int padb  = b.get_width();
-        int pad   = max(pada,padb);
-        
-        device float3 *row = &inoutBuffer[x*bsize];
-        
-        for(int i=0; i<bsize; i++) {
-            
-            for( int j=0; j<padb; j++) {
-                int2   xy  = int2(x,i-j);
-                row[i] +=  b.read(j).xxx*inTexture.read(uint2(xy)).rgb;
-            }
-            
-            for( int j=1; j<pada; j++) {
-                int y = i-j;
-                row[i] += row[y] * a.read(j).xxx ;
-            }
-        }
-        
-        device float3 *row2 = &inoutBuffer2[x*bsize];
-        
-        for(int i=bsize-pad-1; i>=0; i--) {
-            
-            for( int j=0; j<padb; j++) {
-                row2[i] +=  b.read(j).xxx*row[i+j];
-            }
-            
-            for( int j=1; j<pada; j++) {
-                row2[i] += row2[i+j] * a.read(j).xxx ;
-            }
-        }
+        if (gid.x >= lines.y || x >= inTexture.get_width()) return;
         
-        for (int i=0; i<size; i++){
-            float3 rgb = row2[i];
-            outTexture.write(float4(rgb,1),uint2(x,i));
-        }
+        iirFilterLine(inTexture, outTexture, &scratch[gid.x], lines.y, filter, uint2(x,0), uint2(0,1), height);
     }
 
 }
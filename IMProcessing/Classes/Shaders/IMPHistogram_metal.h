@@ -42,13 +42,17 @@ namespace IMProcessing
                                    ){
             constexpr sampler s(address::clamp_to_edge, filter::linear, coord::normalized);
             
+            //
+            // scale is the same for the whole grid: read exact texture color or sample, never both
+            //
+            if (scale == 1.0) {
+                return inTexture.read(gid);
+            }
+            
             float w = float(inTexture.get_width())  * scale;
             float h = float(inTexture.get_height()) * scale;
             
-            return mix(inTexture.sample(s, float2(gid) * float2(1.0/w, 1.0/h)),
-                       inTexture.read(gid),
-                       IMProcessing::when_eq(inTexture.get_width(), w) // whe equal read exact texture color
-                       );
+            return inTexture.sample(s, float2(gid) * float2(1.0/w, 1.0/h));
         }
         
         
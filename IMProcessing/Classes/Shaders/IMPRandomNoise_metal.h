@@ -133,10 +133,7 @@ namespace IMProcessing
         
         result.a *= adjustment.blending.opacity;
         
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(inColor, result);
-        else // only two modes yet
-            result = IMProcessing::blendNormal(inColor, result);
+        result = IMProcessing::blend(inColor, result, adjustment.blending.mode);
         
         outTexture.write(result,gid);
     }
@@ -0,0 +1,137 @@
+//
+//  IMPResampling_metal.h
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+#ifndef IMPResampling_metal_h
+#define IMPResampling_metal_h
+
+#ifdef __METAL_VERSION__
+
+#include "IMPSwift-Bridging-Metal.h"
+#include "IMPFlowControl_metal.h"
+#include "IMPCommon_metal.h"
+
+using namespace metal;
+
+#ifdef __cplusplus
+
+namespace IMProcessing
+{
+
+    ///  @brief Separable resampling pass: every output pixel is a weighted sum of taps
+    ///  adjacent input pixels along the pass direction. Weights and the first input index of
+    ///  every output column (or row) are precomputed once per size pair.
+    ///
+    ///  @param inTexture  input texture
+    ///  @param first      index of the first input pixel of every output pixel
+    ///  @param weights    taps weights of every output pixel
+    ///  @param taps       taps per output pixel
+    ///  @param index      output pixel index along the pass direction
+    ///  @param direction  (1,0) horizontal pass, (0,1) vertical pass
+    ///  @param gid        output pixel
+    ///
+    inline float4 resampleTaps(texture2d<float, access::sample> inTexture,
+                               constant int    *first,
+                               constant float  *weights,
+                               uint             taps,
+                               uint             index,
+                               uint2            direction,
+                               uint2            gid){
+
+        int  last = int(dot(uint2(inTexture.get_width(), inTexture.get_height()), direction)) - 1;
+        int  x0   = first[index];
+
+        constant float *w = &weights[index * taps];
+
+        float4 color = float4(0);
+
+        for (uint k = 0; k < taps; k++){
+            uint  i  = uint(clamp(x0 + int(k), 0, last));
+            uint2 xy = select(gid, uint2(i), bool2(direction));
+            color += w[k] * inTexture.read(xy);
+        }
+
+        return color;
+    }
+
+    kernel void kernel_resampleHorizontal(texture2d<float, access::sample> inTexture  [[texture(0)]],
+                                          texture2d<float, access::write>  outTexture [[texture(1)]],
+                                          constant int                     *first     [[buffer(0)]],
+                                          constant float                   *weights   [[buffer(1)]],
+                                          constant uint                    &taps      [[buffer(2)]],
+                                          uint2 gid [[thread_position_in_grid]])
+    {
+        if (gid.x >= outTexture.get_width() || gid.y >= outTexture.get_height()) return;
+        outTexture.write(resampleTaps(inTexture, first, weights, taps, gid.x, uint2(1,0), gid), gid);
+    }
+
+    kernel void kernel_resampleVertical(texture2d<float, access::sample> inTexture  [[texture(0)]],
+                                        texture2d<float, access::write>  outTexture [[texture(1)]],
+                                        constant int                     *first     [[buffer(0)]],
+                                        constant float                   *weights   [[buffer(1)]],
+                                        constant uint                    &taps      [[buffer(2)]],
+                                        uint2 gid [[thread_position_in_grid]])
+    {
+        if (gid.x >= outTexture.get_width() || gid.y >= outTexture.get_height()) return;
+        outTexture.write(clamp(resampleTaps(inTexture, first, weights, taps, gid.y, uint2(0,1), gid), 0.0, 1.0), gid);
+    }
+    
+    ///  @brief Half size box downsampling: output pixel is the mean of its 2x2 input block.
+    ///  The last row and column of an odd sized input are repeated.
+    ///
+    kernel void kernel_resampleHalfBox(texture2d<float, access::sample> inTexture  [[texture(0)]],
+                                       texture2d<float, access::write>  outTexture [[texture(1)]],
+                                       uint2 gid [[thread_position_in_grid]])
+    {
+        if (gid.x >= outTexture.get_width() || gid.y >= outTexture.get_height()) return;
+        
+        uint2 last = uint2(inTexture.get_width(), inTexture.get_height()) - 1;
+        uint2 xy   = gid * 2;
+        uint2 xy1  = min(xy + 1, last);
+        
+        float4 color = inTexture.read(xy) + inTexture.read(uint2(xy1.x, xy.y)) + inTexture.read(uint2(xy.x, xy1.y)) + inTexture.read(xy1);
+        
+        outTexture.write(color * 0.25, gid);
+    }
+    
+    ///  @brief Exact area average downsampling: output pixel is the mean of the input area it covers,
+    ///  partially covered input pixels are weighted by the covered fraction. Every input pixel
+    ///  is read by one output pixel, or by two or four on the cover bounds.
+    ///
+    kernel void kernel_resampleArea(texture2d<float, access::sample> inTexture  [[texture(0)]],
+                                    texture2d<float, access::write>  outTexture [[texture(1)]],
+                                    uint2 gid [[thread_position_in_grid]])
+    {
+        if (gid.x >= outTexture.get_width() || gid.y >= outTexture.get_height()) return;
+        
+        float2 size  = float2(inTexture.get_width(), inTexture.get_height());
+        float2 ratio = size / float2(outTexture.get_width(), outTexture.get_height());
+        float2 start = float2(gid) * ratio;
+        float2 end   = min(start + ratio, size);
+        
+        uint2  first = uint2(floor(start));
+        uint2  last  = uint2(ceil(end));
+        
+        float4 color = float4(0);
+        
+        for (uint y = first.y; y < last.y; y++){
+            float wy = min(end.y, float(y + 1)) - max(start.y, float(y));
+            for (uint x = first.x; x < last.x; x++){
+                float wx = min(end.x, float(x + 1)) - max(start.x, float(x));
+                color += wx * wy * inTexture.read(uint2(x,y));
+            }
+        }
+        
+        outTexture.write(color / ((end.x - start.x) * (end.y - start.y)), gid);
+    }
+}
+
+#endif
+
+#endif
+
+#endif /* IMPResampling_metal_h */
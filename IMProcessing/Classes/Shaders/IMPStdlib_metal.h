@@ -30,6 +30,7 @@
 #include "IMPDithering_metal.h"
 #include "IMPGraphics_metal.h"
 #include "IMPVignette_metal.h"
+#include "IMPResampling_metal.h"
 
 #ifdef __cplusplus
 
@@ -51,6 +52,32 @@ namespace IMProcessing
         outTexture.write(inColor, gid);
     }
 
+    ///  @brief Compose rgba from jpeg YCbCr planes (JFIF full range), chroma planes of any subsampling
+    ///  are upsampled by the linear sampler at the same normalized coordinates.
+    ///
+    kernel void kernel_YCbCrPlanesToRGBA(texture2d<float, access::sample> lumaTexture [[texture(0)]],
+                                         texture2d<float, access::write>  outTexture  [[texture(1)]],
+                                         texture2d<float, access::sample> cbTexture   [[texture(2)]],
+                                         texture2d<float, access::sample> crTexture   [[texture(3)]],
+                                         uint2 gid [[thread_position_in_grid]])
+    {
+        if (gid.x >= outTexture.get_width() || gid.y >= outTexture.get_height()) return;
+        
+        constexpr sampler s(address::clamp_to_edge, filter::linear, coord::normalized);
+        
+        float2 uv = (float2(gid) + 0.5) / float2(outTexture.get_width(), outTexture.get_height());
+        
+        float y  = lumaTexture.sample(s, uv).r;
+        float cb = cbTexture.sample(s, uv).r - 128.0/255.0;
+        float cr = crTexture.sample(s, uv).r - 128.0/255.0;
+        
+        float3 rgb = float3(y + 1.402 * cr,
+                            y - 0.344136 * cb - 0.714136 * cr,
+                            y + 1.772 * cb);
+        
+        outTexture.write(float4(clamp(rgb, float3(0), float3(1)), 1), gid);
+    }
+    
     kernel void kernel_desaturate(texture2d<float, access::sample> inTexture [[texture(0)]],
                                   texture2d<float, access::write> outTexture [[texture(1)]],
                                   uint2 gid [[thread_position_in_grid]])
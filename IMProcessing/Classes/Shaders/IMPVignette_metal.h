@@ -24,57 +24,13 @@ using namespace metal;
 namespace IMProcessing
 {
     
-    kernel void kernel_vignetteCenter(
-                                      texture2d<float, access::sample>   inTexture  [[texture(0)]],
-                                      texture2d<float, access::write>   outTexture  [[texture(1)]],
-                                      constant IMPAdjustment           &adjustment  [[buffer(0)]],
-                                      constant float                        &start  [[buffer(1)]],
-                                      constant float                          &end  [[buffer(2)]],
-                                      constant float3                       &color  [[buffer(3)]],
-                                      constant float2                      &center  [[buffer(4)]],
-                                      uint2 gid [[thread_position_in_grid]]
-                                      )
-    {
-        float4 inColor = IMProcessing::sampledColor(inTexture, outTexture, gid);
-        
-        
-        float w = float(inTexture.get_width());
-        float h = float(inTexture.get_height());
-        
-        float2 coords  = float2(gid) * float2(1.0/w,1.0/h);
-        
-        float d = distance(coords,center);
-        
-        float  percent = smoothstep(start, end, d);
-        float3 rgb     = mix(inColor.rgb, color, percent);
-        float4 result  = float4(rgb,inColor.a);
-        
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(inColor, float4(rgb,adjustment.blending.opacity));
-        else // only two modes yet
-            result = IMProcessing::blendNormal(inColor, float4(rgb,adjustment.blending.opacity));
-        
-        outTexture.write(result,gid);
+    ///  @brief Distance from the vignette center in normalized coordinates
+    inline float vignetteCenterDistance(float2 coords, float2 center){
+        return distance(coords,center);
     }
     
-    kernel void kernel_vignetteFrame(
-                                     texture2d<float, access::sample>   inTexture  [[texture(0)]],
-                                     texture2d<float, access::write>   outTexture  [[texture(1)]],
-                                     constant IMPAdjustment           &adjustment  [[buffer(0)]],
-                                     constant float                        &start  [[buffer(1)]],
-                                     constant float                          &end  [[buffer(2)]],
-                                     constant float3                       &color  [[buffer(3)]],
-                                     constant IMPRegion                 &regionIn  [[buffer(4)]],
-                                     uint2 gid [[thread_position_in_grid]]
-                                     )
-    {
-        float4 inColor = IMProcessing::sampledColor(inTexture, outTexture, gid);
-        
-        
-        float w = float(inTexture.get_width());
-        float h = float(inTexture.get_height());
-        
-        float2 coords  = float2(gid) * float2(1.0/w,1.0/h);
+    ///  @brief Distance outside of the region frame in normalized coordinates
+    inline float vignetteFrameDistance(float2 coords, IMPRegion regionIn){
         
         float d = 0;
         
@@ -113,16 +69,76 @@ namespace IMProcessing
             d = (regionIn.bottom-(1-coords.y));
         }
         
-        float  percent = smoothstep(start, end, d);
+        return d;
+    }
+    
+    inline float4 vignetteBlend(float4 inColor, float3 color, float percent, constant IMPAdjustment &adjustment){
+        
         float3 rgb     = mix(inColor.rgb, color, percent);
-        float4 result  = float4(rgb,1);
+        float4 result;
+        
+        result = IMProcessing::blend(inColor, float4(rgb,adjustment.blending.opacity), adjustment.blending.mode);
+        
+        return result;
+    }
+    
+    ///
+    /// @brief Vignette masks. Mask is computed in normalized coordinates, so it does not depend on
+    /// the image size and can be kept in a low resolution texture until start/end/center/region change.
+    ///
+    kernel void kernel_vignetteCenterMask(
+                                          texture2d<float, access::write>        mask  [[texture(0)]],
+                                          constant float                       &start  [[buffer(0)]],
+                                          constant float                         &end  [[buffer(1)]],
+                                          constant float2                     &center  [[buffer(2)]],
+                                          uint2 gid [[thread_position_in_grid]]
+                                          )
+    {
+        float2 size   = float2(mask.get_width(), mask.get_height());
+        float2 coords = float2(gid) / (size - 1.0);
+        mask.write(float4(smoothstep(start, end, vignetteCenterDistance(coords,center))),gid);
+    }
+    
+    kernel void kernel_vignetteFrameMask(
+                                         texture2d<float, access::write>        mask  [[texture(0)]],
+                                         constant float                       &start  [[buffer(0)]],
+                                         constant float                         &end  [[buffer(1)]],
+                                         constant IMPRegion                &regionIn  [[buffer(2)]],
+                                         uint2 gid [[thread_position_in_grid]]
+                                         )
+    {
+        float2 size   = float2(mask.get_width(), mask.get_height());
+        float2 coords = float2(gid) / (size - 1.0);
+        mask.write(float4(smoothstep(start, end, vignetteFrameDistance(coords,regionIn))),gid);
+    }
+    
+    ///  @brief Bilinear upsampled vignette mask value, can be used by any point operation kernel
+    ///
+    ///  @param mask   vignette mask
+    ///  @param coords normalized pixel coordinates
+    ///
+    ///  @return vignetting percent
+    ///
+    inline float vignetteMaskPercent(texture2d<float, access::sample> mask, float2 coords){
+        constexpr sampler s(address::clamp_to_edge, filter::linear, coord::normalized);
+        float2 size = float2(mask.get_width(), mask.get_height());
+        return mask.sample(s, (coords * (size - 1.0) + 0.5) / size).x;
+    }
+    
+    kernel void kernel_vignetteMask(
+                                    texture2d<float, access::sample>   inTexture  [[texture(0)]],
+                                    texture2d<float, access::write>   outTexture  [[texture(1)]],
+                                    texture2d<float, access::sample>        mask  [[texture(2)]],
+                                    constant IMPAdjustment           &adjustment  [[buffer(0)]],
+                                    constant float3                       &color  [[buffer(1)]],
+                                    uint2 gid [[thread_position_in_grid]]
+                                    )
+    {
+        float4 inColor = IMProcessing::sampledColor(inTexture, outTexture, gid);
         
-        if (adjustment.blending.mode == 0)
-            result = IMProcessing::blendLuminosity(inColor, float4(rgb,adjustment.blending.opacity));
-        else // only two modes yet
-            result = IMProcessing::blendNormal(inColor, float4(rgb,adjustment.blending.opacity));
+        float2 coords  = float2(gid) / float2(outTexture.get_width(), outTexture.get_height());
         
-        outTexture.write(result,gid);
+        outTexture.write(vignetteBlend(inColor, color, vignetteMaskPercent(mask, coords), adjustment),gid);
     }
     
 }
@@ -88,12 +88,7 @@ public extension IMPImage{
             
             if IMProcessing.colors.pixelFormat == .RGBA16Unorm {
                 var u16:[UInt16] = [UInt16](count: componentsPerRow*resultHeight, repeatedValue: 0)
-                for i in 0 ..< componentsPerRow*resultHeight {
-                    var pixel = UInt16()
-                    let address = UnsafePointer<UInt8>(rawData)+i
-                    memcpy(&pixel, address, sizeof(UInt8))
-                    u16[i] = pixel<<8
-                }
+                IMPConvertRGBA8ToRGBA16(rawData, componentsPerRow, &u16, componentsPerRow*sizeof(UInt16), resultWidth, resultHeight)
                 t.replaceRegion(region, mipmapLevel:0, withBytes:u16, bytesPerRow:componentsPerRow*sizeof(UInt16)/sizeof(UInt8))
             }
             else {
@@ -154,12 +149,7 @@ public extension IMPImage{
             
             var rawData   = [UInt8](count: width*height*components, repeatedValue: 0)
             if texture.pixelFormat == .RGBA16Unorm {
-                for i in 0 ..< rawData.count {
-                    var pixel = UInt16()
-                    let address =  UnsafePointer<UInt16>(imageBuffer.contents())+i
-                    memcpy(&pixel, address, sizeof(UInt16))
-                    rawData[i] = UInt8(pixel>>8)
-                }
+                IMPConvertRGBA16ToRGBA8(imageBuffer.contents(), bytesPerRow, &rawData, width*components, width, height)
             }
             else{
                 memcpy(&rawData, imageBuffer.contents(), imageBuffer.length)
@@ -22,8 +22,208 @@ typedef enum {
 typedef BOOL (^writeInitBlock)( void * _Null_unspecified cinfo,  void *_Null_unspecified*_Null_unspecified userData);
 typedef void (^writeFinishBlock)(void  *_Null_unspecified cinfo, void   *_Null_unspecified userData);
 
+/**
+ *  Destination of decoded RGBA8 pixels
+ *
+ *  @param width       decoded image width
+ *  @param height      decoded image height
+ *  @param bytesPerRow row stride, width*4 by default, can be changed to any value not less than width*4.
+ *                     Only width*4 bytes of every row are written, the padding is left untouched
+ *
+ *  @return first row address of at least bytesPerRow*height bytes, or NULL to cancel decoding
+ */
+typedef void * _Nullable (^IMPJpegDestinationBlock)(NSUInteger width, NSUInteger height, size_t * _Nonnull bytesPerRow);
+
+typedef enum {
+    IMPJpegSubsampling444,
+    IMPJpegSubsampling422,
+    IMPJpegSubsampling420,
+    IMPJpegSubsamplingGray,
+    IMPJpegSubsamplingOther
+}IMPJpegSubsampling;
+
+/**
+ *  YCbCr planes of jpeg image at the native chroma subsampling: plane 0 is Y, 1 is Cb, 2 is Cr,
+ *  grayscale images have Y plane only. Planes are 8 bits, their rows and heights are padded
+ *  to whole MCU rows, as jpeg raw data requires, width/height of a plane are the valid part.
+ */
+@interface IMPJpegPlanarImage : NSObject
+@property (nonatomic,readonly) NSUInteger width;
+@property (nonatomic,readonly) NSUInteger height;
+@property (nonatomic,readonly) NSUInteger planesCount;
+@property (nonatomic,readonly) IMPJpegSubsampling subsampling;
+
+/**
+ *  Empty planes to be filled and encoded
+ */
+- (nullable instancetype) initWithWidth:(NSUInteger)width height:(NSUInteger)height subsampling:(IMPJpegSubsampling)subsampling;
+
+- (NSUInteger) widthOfPlane:(NSUInteger)plane;
+- (NSUInteger) heightOfPlane:(NSUInteger)plane;
+- (size_t) bytesPerRowOfPlane:(NSUInteger)plane;
+- (nonnull void*) bytesOfPlane:(NSUInteger)plane;
+@end
+
+/**
+ *  Compressed jpeg bytes to decode. Regular files of local volumes are memory mapped with sequential
+ *  and willneed hints, so the decoder reads page cache without read syscalls and copies. Pipes, network
+ *  mounts and files which can't be mapped are read to memory. Caller memory spans are decoded in place.
+ */
+@interface IMPJpegSource : NSObject
+@property (nonatomic,readonly) const void * _Nonnull bytes;
+@property (nonatomic,readonly) size_t length;
+@property (nonatomic,readonly) BOOL   mapped;
+
+/**
+ *  Map or read jpeg file
+ */
++ (nullable instancetype) sourceWithFile:(nonnull NSString*)filePath
+                                   error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
+/**
+ *  Caller memory span, bytes are not copied and must be valid until the deallocator is called
+ *
+ *  @param bytes       jpeg bytes
+ *  @param length      jpeg size
+ *  @param deallocator called when the source is released, can be nil
+ */
+- (nonnull instancetype) initWithBytes:(nonnull const void*)bytes
+                                length:(size_t)length
+                           deallocator:(nullable void (^)(void))deallocator;
+@end
+
 @interface IMPJpegturbo : NSObject
 
+/**
+ *  Decode jpeg file straight into the caller memory: the decoder writes rows of the destination buffer,
+ *  so every pixel is written once without intermediate row copies.
+ *
+ *  @param filePath    jpeg file path
+ *  @param maxSize     maximum size of the smaller image side, the DCT scaling is used, 0 keeps the original size
+ *  @param destination block returning the destination of the known image size
+ *  @param error       error
+ *
+ *  @return YES when the image is decoded
+ */
++ (BOOL) decodeFile:(nonnull NSString*)filePath
+            maxSize:(CGFloat)maxSize
+        destination:(nonnull IMPJpegDestinationBlock)destination
+              error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
+/**
+ *  Decode jpeg from memory straight into the caller memory
+ *
+ *  @param source      jpeg bytes
+ *  @param maxSize     maximum size of the smaller image side, the DCT scaling is used, 0 keeps the original size
+ *  @param destination block returning the destination of the known image size
+ *  @param error       error
+ *
+ *  @return YES when the image is decoded
+ */
++ (BOOL) decodeSource:(nonnull IMPJpegSource*)source
+              maxSize:(CGFloat)maxSize
+          destination:(nonnull IMPJpegDestinationBlock)destination
+                error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
+/**
+ *  Decode jpeg file to YCbCr planes without color conversion and chroma upsampling.
+ *  Only YCbCr and grayscale jpegs can be decoded to planes.
+ *
+ *  @param filePath jpeg file path
+ *  @param maxSize  maximum size of the smaller image side, the DCT scaling is used, 0 keeps the original size
+ *  @param lumaOnly decode Y plane only, chroma blocks are entropy decoded but not transformed
+ *  @param error    error
+ *
+ *  @return planar image
+ */
++ (nullable IMPJpegPlanarImage*) decodePlanarFile:(nonnull NSString*)filePath
+                                          maxSize:(CGFloat)maxSize
+                                         lumaOnly:(BOOL)lumaOnly
+                                            error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
+/**
+ *  Encode YCbCr planes without color conversion and chroma downsampling
+ *
+ *  @param image   planar image
+ *  @param quality compression quality 0-1
+ *
+ *  @return jpeg data or nil on error
+ */
++ (nullable NSData*) dataFromPlanarImage:(nonnull IMPJpegPlanarImage*)image
+                             compression:(CGFloat)quality;
+
+/**
+ *  Decode a region of jpeg file. MCUs covering the region are cropped losslessly before decoding,
+ *  so the IDCT and color conversion cost is proportional to the region size. The lossless crop of
+ *  libjpeg-turbo 1.4 reads coefficients of the whole image though: memory and entropy decoding
+ *  cost are proportional to the full image size, decode the whole image when most of it is needed.
+ *  Rows of the region are decoded through a scratch row, only the region pixels are written to the destination.
+ *
+ *  @param filePath    jpeg file path
+ *  @param region      region in unit coordinates of the stored image, origin is the top left corner,
+ *                     CGRectNull decodes the whole image
+ *  @param maxSize     maximum size of the region, the DCT scaling is used, 0 keeps the original size
+ *  @param destination block returning the destination of the region size
+ *  @param error       error
+ *
+ *  @return YES when the region is decoded
+ */
++ (BOOL) decodeFile:(nonnull NSString*)filePath
+             region:(CGRect)region
+            maxSize:(CGFloat)maxSize
+        destination:(nonnull IMPJpegDestinationBlock)destination
+              error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
++ (BOOL) decodeSource:(nonnull IMPJpegSource*)source
+               region:(CGRect)region
+              maxSize:(CGFloat)maxSize
+          destination:(nonnull IMPJpegDestinationBlock)destination
+                error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
+/**
+ *  Decode a small preview for analysis. The largest DCT scaling keeping the smaller side not less than minSize
+ *  is used, at 1/8 blocks are filled by DC coefficients only and the IDCT is skipped. The embedded exif thumbnail
+ *  is decoded instead of the image when its smaller side is not less than minSize and the aspect is the same.
+ *
+ *  @param filePath    jpeg file path
+ *  @param minSize     minimum size of the smaller preview side, 0 decodes at 1/8
+ *  @param destination block returning the destination of the preview size
+ *  @param error       error
+ *
+ *  @return YES when the preview is decoded
+ */
++ (BOOL) decodePreviewOfFile:(nonnull NSString*)filePath
+                     minSize:(CGFloat)minSize
+                 destination:(nonnull IMPJpegDestinationBlock)destination
+                       error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
++ (BOOL) decodePreviewOfSource:(nonnull IMPJpegSource*)source
+                       minSize:(CGFloat)minSize
+                   destination:(nonnull IMPJpegDestinationBlock)destination
+                         error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable  id<MTLTexture>)texture
+                              withPixelFormat:(MTLPixelFormat)pixelFormat
+                                   withDevice:(nonnull id<MTLDevice>)device
+                                   fromSource:(nonnull IMPJpegSource*)source
+                                      maxSize:(CGFloat)maxSize
+                                        error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable  id<MTLTexture>)texture
+                              withPixelFormat:(MTLPixelFormat)pixelFormat
+                                   withDevice:(nonnull id<MTLDevice>)device
+                                previewOfFile:(nonnull NSString*)filePath
+                                      minSize:(CGFloat)minSize
+                                        error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable  id<MTLTexture>)texture
+                              withPixelFormat:(MTLPixelFormat)pixelFormat
+                                   withDevice:(nonnull id<MTLDevice>)device
+                                     fromFile:(nonnull NSString*)filePath
+                                       region:(CGRect)region
+                                      maxSize:(CGFloat)maxSize
+                                        error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
 + (id<MTLTexture> _Nullable) updateMTLTexture:(nullable  id<MTLTexture>)texture
                     withPixelFormat:(MTLPixelFormat)pixelFormat
                          withDevice:(nonnull id<MTLDevice>)device
@@ -39,6 +239,27 @@ typedef void (^writeFinishBlock)(void  *_Null_unspecified cinfo, void   *_Null_u
              compression:(CGFloat)quality
                    error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
 
+/**
+ *  Encode texture by horizontal strips in parallel. Strips are aligned to MCU rows, every strip is
+ *  encoded with a restart marker after each MCU row, then entropy coded segments are stitched
+ *  into one baseline jpeg, which is decoded by any jpeg decoder.
+ *
+ *  @param texture     RGBA8, BGRA8 or RGBA16 texture
+ *  @param quality     compression quality 0-1
+ *  @param concurrency encoding threads, 0 uses all active processors, 1 encodes serially without restart markers
+ *
+ *  @return jpeg data or nil when memory can't be allocated
+ */
++ (nullable NSData*) dataFromMTLTexture:(nonnull id<MTLTexture>)texture
+                            compression:(CGFloat)quality
+                            concurrency:(NSUInteger)concurrency;
+
++ (BOOL) writeMTLTexture:(nonnull id<MTLTexture>)texture
+              toJpegFile:(nonnull NSString *)filePath
+             compression:(CGFloat)quality
+             concurrency:(NSUInteger)concurrency
+                   error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
 + (BOOL) writePixelBuffer:(nonnull CVPixelBufferRef)pixelBuffer
                toJpegFile:(nonnull NSString *)path
               compression:(CGFloat)compressionQ
@@ -46,4 +267,148 @@ typedef void (^writeFinishBlock)(void  *_Null_unspecified cinfo, void   *_Null_u
                     error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
 @end
 
-#endif
\ No newline at end of file
+/**
+ *  Decoded RGBA8 image of the batch decoder. Pixels memory is owned by the buffer pool:
+ *  -recycle returns it to the pool to be reused by the next image of the same size class,
+ *  images which are not recycled free their memory on dealloc.
+ */
+@interface IMPJpegImage : NSObject
+@property (nonatomic,readonly,nonnull) NSString *filePath;
+@property (nonatomic,readonly) NSUInteger width;
+@property (nonatomic,readonly) NSUInteger height;
+@property (nonatomic,readonly) size_t     bytesPerRow;
+@property (nonatomic,readonly,nonnull) void *bytes;
+/**
+ *  Allocated memory size, not less than bytesPerRow*height
+ */
+@property (nonatomic,readonly) size_t     length;
+- (void) recycle;
+@end
+
+/**
+ *  Pool of images memory. Buffers are grouped by size classes of 4 steps per power of two,
+ *  so an image can reuse a buffer of a slightly different size, the waste is less than 25%.
+ */
+@interface IMPJpegBufferPool : NSObject
+/**
+ *  Maximum bytes kept by the pool, recycled buffers over the capacity are freed
+ */
+@property (nonatomic) size_t capacity;
+@property (nonatomic,readonly) size_t retainedBytes;
+- (nonnull instancetype) initWithCapacity:(size_t)capacity;
+/**
+ *  Image with memory of at least length bytes, nil when memory can't be allocated
+ */
+- (nullable IMPJpegImage*) imageWithLength:(size_t)length;
+/**
+ *  Free all retained buffers
+ */
+- (void) drain;
+@end
+
+typedef void (^IMPJpegBatchCompletionBlock)(NSString * _Nonnull filePath, IMPJpegImage * _Nullable image, NSError * _Nullable error);
+
+/**
+ *  Batch jpeg decoder. Every worker keeps its decompressor, source manager and rows array between files,
+ *  images come from the buffer pool, so decoding does not allocate pixels memory in the steady state
+ *  when images are recycled. Small per file objects are still allocated: the file source and its mapping,
+ *  the queued job block and the error of a failed file.
+ *
+ *  Files are decoded by at most concurrency workers at once, decodeFile: blocks the caller while
+ *  maxPending files are waiting or decoding. Completions run on worker threads, so a completion must not
+ *  queue follow-up files with decodeFile: - when maxPending is reached it would wait for the worker it runs on.
+ *  Use tryDecodeFile: there.
+ *
+ *  Decoding errors are caught on the worker thread and passed to the completion of the failed file only.
+ */
+@interface IMPJpegBatchDecoder : NSObject
+@property (nonatomic,readonly) NSUInteger concurrency;
+@property (nonatomic,readonly) NSUInteger maxPending;
+/**
+ *  Maximum size of the smaller image side, the DCT scaling is used, 0 keeps the original size
+ */
+@property (atomic) CGFloat maxSize;
+@property (nonatomic,readonly,nonnull) IMPJpegBufferPool *pool;
+
+/**
+ *  Decoder with a worker per active processor
+ */
+- (nonnull instancetype) init;
+- (nonnull instancetype) initWithConcurrency:(NSUInteger)concurrency
+                                  maxPending:(NSUInteger)maxPending
+                                        pool:(nullable IMPJpegBufferPool*)pool;
+/**
+ *  Queue a file, completion is called on the worker thread. Blocks while maxPending files are not completed,
+ *  must not be called from completions
+ */
+- (void) decodeFile:(nonnull NSString*)filePath completion:(nonnull IMPJpegBatchCompletionBlock)completion;
+/**
+ *  Queue a file if less than maxPending files are not completed, never blocks.
+ *  Returns NO and does not call the completion when the file is not queued, can be called from completions
+ */
+- (BOOL) tryDecodeFile:(nonnull NSString*)filePath completion:(nonnull IMPJpegBatchCompletionBlock)completion;
+- (void) decodeFiles:(nonnull NSArray<NSString*>*)files completion:(nonnull IMPJpegBatchCompletionBlock)completion;
+/**
+ *  Wait for all queued files
+ */
+- (void) waitUntilFinished;
+@end
+
+/**
+ *  Encoded jpeg bytes owned by the encoder
+ */
+typedef struct {
+    const void * _Nullable bytes;
+    size_t                 length;
+} IMPJpegSpan;
+
+/**
+ *  Reusable jpeg encoder. The compressor, rows array, texture readback buffers and the output arena are kept
+ *  between images and only grow. The arena is sized by the tjBufSize worst case of the image, so the output
+ *  never overflows and encoding images of the same or smaller size does not allocate memory in the steady state.
+ *  Rows are compressed straight from the caller memory. An encoder is not thread safe, use an encoder per thread.
+ */
+@interface IMPJpegEncoder : NSObject
+/**
+ *  Output arena size
+ */
+@property (nonatomic,readonly) size_t capacity;
+
+- (nonnull instancetype) init;
+/**
+ *  Encoder with the arena preallocated for images up to width x height
+ */
+- (nonnull instancetype) initWithWidth:(NSUInteger)width height:(NSUInteger)height;
+
+/**
+ *  Encode 4 channels 8 bits pixels
+ *
+ *  @param bytes       first row address
+ *  @param bytesPerRow row stride, not less than width*4
+ *  @param width       image width
+ *  @param height      image height
+ *  @param colorSpace  channels order
+ *  @param quality     compression quality 0-1
+ *  @param error       error
+ *
+ *  @return jpeg bytes valid until the next encoding, bytes are NULL on error
+ */
+- (IMPJpegSpan) encodeBytes:(nonnull const void*)bytes
+                bytesPerRow:(size_t)bytesPerRow
+                      width:(NSUInteger)width
+                     height:(NSUInteger)height
+                 colorSpace:(IMPJpegColorSpace)colorSpace
+                compression:(CGFloat)quality
+                      error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+
+/**
+ *  Encode RGBA8, BGRA8 or RGBA16Unorm texture, the texture is read back once per image.
+ *  Other pixel formats are rejected with EINVAL. Managed textures are synchronized in a command queue
+ *  the encoder keeps for the texture device.
+ */
+- (IMPJpegSpan) encodeMTLTexture:(nonnull id<MTLTexture>)texture
+                     compression:(CGFloat)quality
+                           error:(NSError *_Null_unspecified __autoreleasing *_Null_unspecified)error;
+@end
+
+#endif
@@ -7,17 +7,26 @@
 //
 
 #import "IMPJpegturbo.h"
+#import "IMPPixelConversion.h"
 
 #import <ImageIO/ImageIO.h>
 #import <stdio.h>
 #import <jpeglib.h>
+#import <jerror.h>
+#import <turbojpeg.h>
 #import <setjmp.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/mman.h>
+#import <sys/mount.h>
+#import <sys/stat.h>
 
 @import Security;
 
 struct DPJpegErrorMgr {
     struct jpeg_error_mgr pub;    /* "public" fields */
     jmp_buf setjmp_buffer;        /* for return to caller */
+    char    message[JMSG_LENGTH_MAX]; /* formatted message of the last error */
 };
 
 typedef struct DPJpegErrorMgr         *DPJpegErrorRef;
@@ -36,6 +45,9 @@ static void my_error_exit (j_common_ptr cinfo)
     /* We could postpone this until after returning, if we chose. */
     (*cinfo->err->output_message) (cinfo);
     
+    /* Keep the message for the caller error */
+    (*cinfo->err->format_message) (cinfo, myerr->message);
+    
     /* Return control to the setjmp point */
     longjmp(myerr->setjmp_buffer, 1);
 }
@@ -101,452 +113,2292 @@ static GLOBAL(void) jpeg_mem_dest_dp(j_compress_ptr cinfo, NSData* data)
     dest->pub.term_destination    = term_destination;
 }
 
-//
-// IMP jpegturbo interface
-//
-@implementation IMPJpegturbo
-
-+ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable id<MTLTexture>)textureIn withPixelFormat:(MTLPixelFormat)pixelFormat withDevice:(id<MTLDevice>)device fromFile:(NSString*)filePath  maxSize:(CGFloat)maxSize  error:(NSError *__autoreleasing *)error{
-    
+/**
+ * Reduce output size by the DCT scaling to fit maxSize
+ */
+static void imp_jpeg_set_max_size(DPJpegDecompressInfo *cinfo, CGFloat maxSize){
     
+    float scale = 1.0;
     
-    const char *filename = [filePath cStringUsingEncoding:NSUTF8StringEncoding];
+    if (maxSize>0.0 && maxSize<fmin(cinfo->image_width,cinfo->image_height) ) {
+        scale = fmin(maxSize/cinfo->image_width,maxSize/cinfo->image_height) ;
+    }
     
-    DPJpegDecompressInfo cinfo;
-    struct DPJpegErrorMgr jerr;
-    FILE         *infile;           /* source file */
-    JSAMPARRAY    buffer;           /* Output row buffer */
-    int           row_stride;       /* physical row width in output buffer */
+    cinfo->scale_num   = scale<1.0f?1:scale;
+    cinfo->scale_denom = scale<1.0f?(unsigned int)floor(1.0f/scale):1;
+}
+
+/**
+ * The smallest DCT scaling keeping the smaller side not less than minSize. At 1/8 every block is
+ * reconstructed from its DC coefficient only, so the IDCT is skipped completely
+ */
+static void imp_jpeg_set_preview_scale(DPJpegDecompressInfo *cinfo, CGFloat minSize){
     
+    unsigned int side  = MIN(cinfo->image_width, cinfo->image_height);
+    unsigned int denom = 8;
     
-    if ((infile = fopen(filename, "rb")) == NULL) {
-        if (error) {
-            *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.read"
-                                                 code: ENOENT
-                                             userInfo: @{
-                                                         NSLocalizedDescriptionKey:  [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be open", ""),filePath],
-                                                         NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"File not found", ""),
-                                                         }];
-        }
-        return textureIn;
+    while (denom > 1 && side / denom < minSize) {
+        denom /= 2;
     }
     
-    /* Step 1: allocate and initialize JPEG decompression object */
+    cinfo->scale_num           = 1;
+    cinfo->scale_denom         = denom;
+    cinfo->dct_method          = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing  = FALSE;
+}
+
+static inline uint16_t imp_jpeg_exif_read16(const uint8_t *p, BOOL little){
+    return little ? (uint16_t)(p[0] | p[1] << 8) : (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t imp_jpeg_exif_read32(const uint8_t *p, BOOL little){
+    return little
+    ? (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24
+    : (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/**
+ * Find the jpeg thumbnail of the exif IFD1 in the APP1 segment, offset is counted from the file start
+ */
+static BOOL imp_jpeg_exif_thumbnail(const uint8_t *bytes, size_t length, size_t *offset, size_t *size){
     
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = my_error_exit;
-    if (setjmp(jerr.setjmp_buffer)) {
-        jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
+    if (length < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) return NO;
+    
+    size_t pos = 2;
+    
+    while (pos + 4 <= length && bytes[pos] == 0xFF) {
         
-        if (error) {
-            *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.read"
-                                                 code: ENOENT
-                                             userInfo: @{
-                                                         NSLocalizedDescriptionKey: NSLocalizedString(@"Not enough memory to write jpeg file", ""),
-                                                         NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"Not enough memory", ""),
-                                                         }];
+        uint8_t marker  = bytes[pos+1];
+        size_t  segment = imp_jpeg_exif_read16(bytes + pos + 2, NO);
+        
+        if (marker == 0xDA || marker == 0xD9 || segment < 2 || pos + 2 + segment > length) return NO;
+        
+        if (marker == 0xE1 && segment >= 16 && memcmp(bytes + pos + 4, "Exif\0\0", 6) == 0) {
+            
+            const uint8_t *tiff   = bytes + pos + 10;
+            size_t         extent = segment - 8;
+            
+            BOOL little;
+            if      (tiff[0] == 'I' && tiff[1] == 'I') little = YES;
+            else if (tiff[0] == 'M' && tiff[1] == 'M') little = NO;
+            else return NO;
+            
+            //
+            // IFD0 -> IFD1 which describes the thumbnail
+            //
+            size_t ifd = imp_jpeg_exif_read32(tiff + 4, little);
+            if (ifd + 2 > extent) return NO;
+            
+            size_t entries = imp_jpeg_exif_read16(tiff + ifd, little);
+            if (ifd + 2 + entries * 12 + 4 > extent) return NO;
+            
+            ifd = imp_jpeg_exif_read32(tiff + ifd + 2 + entries * 12, little);
+            if (ifd == 0 || ifd + 2 > extent) return NO;
+            
+            entries = imp_jpeg_exif_read16(tiff + ifd, little);
+            if (ifd + 2 + entries * 12 > extent) return NO;
+            
+            size_t thumbOffset = 0, thumbSize = 0;
+            
+            for (size_t i = 0; i < entries; i++) {
+                const uint8_t *entry = tiff + ifd + 2 + i * 12;
+                uint16_t tag   = imp_jpeg_exif_read16(entry, little);
+                uint32_t value = imp_jpeg_exif_read32(entry + 8, little);
+                if      (tag == 0x0201) thumbOffset = value;
+                else if (tag == 0x0202) thumbSize   = value;
+            }
+            
+            if (thumbOffset == 0 || thumbSize < 4 || thumbOffset + thumbSize > extent) return NO;
+            
+            const uint8_t *thumb = tiff + thumbOffset;
+            if (thumb[0] != 0xFF || thumb[1] != 0xD8) return NO;
+            
+            *offset = thumb - bytes;
+            *size   = thumbSize;
+            
+            return YES;
         }
         
-        return textureIn;
+        pos += 2 + segment;
     }
-    jpeg_create_decompress(&cinfo);
     
+    return NO;
+}
+
+static NSError *imp_jpeg_read_error(NSInteger code, NSString *description, NSString *reason){
+    return [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.read"
+                                       code: code
+                                   userInfo: @{
+                                               NSLocalizedDescriptionKey:  description,
+                                               NSLocalizedFailureReasonErrorKey: reason,
+                                               }];
+}
+
+static int imp_jpeg_quality(CGFloat qualityIn){
+    int quality = round(qualityIn*100.0f);
+    return quality<=0?10:quality>100?100:quality;
+}
+
+/**
+ * Input color space of texture pixels, 16 bits textures are narrowed to RGBA8
+ */
+static J_COLOR_SPACE imp_jpeg_texture_color_space(id<MTLTexture> texture){
+    if (
+        [texture pixelFormat] == MTLPixelFormatBGRA8Unorm
+        ||
+        [texture pixelFormat] == MTLPixelFormatBGRA8Unorm_sRGB
+        ) {
+        return JCS_EXT_BGRA;
+    }
+    return JCS_EXT_RGBA;
+}
+
+/**
+ * Input color space of caller pixels
+ */
+static J_COLOR_SPACE imp_jpeg_color_space(IMPJpegColorSpace colorSpace){
+    switch (colorSpace) {
+        case JPEG_TURBO_ABGR:
+            return JCS_EXT_ABGR;
+        case JPEG_TURBO_ARGB:
+            return JCS_EXT_ARGB;
+        case JPEG_TURBO_BGRA:
+            return JCS_EXT_BGRA;
+        case JPEG_TURBO_RGBA:
+        default:
+            return JCS_EXT_RGBA;
+    }
+}
+
+/**
+ * Synchronize texture with host memory in the queue, a new queue is created when it is nil.
+ * Shared textures have no managed copy to synchronize.
+ */
+static void imp_jpeg_synchronize_texture_in_queue(id<MTLTexture> texture, id<MTLCommandQueue> queue){
+#if TARGET_OS_IPHONE
+#elif TARGET_OS_MAC
+    if (texture.storageMode == MTLStorageModeShared) return;
+    
+    if (queue == nil) queue = [texture.device newCommandQueue];
     
-    /* Step 2: specify data source (eg, a file) */
+    id<MTLCommandBuffer> commandBuffer    = [queue commandBuffer];
+    id<MTLBlitCommandEncoder> blitEncoder = [commandBuffer blitCommandEncoder];
     
-    jpeg_stdio_src(&cinfo, infile);
+    [blitEncoder synchronizeTexture:texture slice:0 level:0];
+    [blitEncoder endEncoding];
     
+    [commandBuffer commit];
+    [commandBuffer waitUntilCompleted];
+#endif
+}
+
+/**
+ * Synchronize texture with host memory
+ */
+static void imp_jpeg_synchronize_texture(id<MTLTexture> texture){
+    imp_jpeg_synchronize_texture_in_queue(texture, nil);
+}
+
+/**
+ * Strips of the parallel encoder must start at MCU rows which are multiple of 8,
+ * so restart markers numbers RST0..RST7 continue across strips without renumbering
+ */
+#define IMP_JPEG_RESTART_MARKERS 8
+
+static NSUInteger imp_jpeg_mcu_height(J_COLOR_SPACE colorSpace, int quality){
     
-    /* Step 3: read file parameters with jpeg_read_header() */
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
     
-    (void) jpeg_read_header(&cinfo, TRUE);
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
     
+    cinfo.input_components = 4;
+    cinfo.in_color_space   = colorSpace;
     
-    /* Step 4: set parameters for decompression */
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
     
-    cinfo.out_color_space = JCS_EXT_RGBA;
+    int factor = 1;
+    for (int i = 0; i < cinfo.num_components; i++) {
+        factor = MAX(factor, cinfo.comp_info[i].v_samp_factor);
+    }
     
-    /* In this example, we don't need to change any of the defaults set by
-     * jpeg_read_header(), so we do nothing here.
-     */
+    jpeg_destroy_compress(&cinfo);
     
-    float scale = 1.0;
+    return factor * DCTSIZE;
+}
+
+/**
+ * Encode rows [y0, y0+rows) of the texture as a separate image with a restart marker after every MCU row.
+ * Every strip uses the same default huffman tables, so their entropy coded segments are interchangeable.
+ */
+static NSMutableData *imp_jpeg_encode_strip(id<MTLTexture> texture, J_COLOR_SPACE colorSpace, int quality, NSUInteger y0, NSUInteger rows){
+    
+    NSUInteger  width        = [texture width];
+    BOOL        isWord       = texture.pixelFormat == MTLPixelFormatRGBA16Unorm;
+    size_t      bytesPerRow  = width * 4;
+    size_t      readPerRow   = bytesPerRow * (isWord ? sizeof(uint16_t) : sizeof(uint8_t));
+    
+    NSMutableData *data   = [NSMutableData dataWithLength:MAX(bytesPerRow * rows / 4, BLOCK_SIZE)];
+    uint8_t       *pixels = malloc(readPerRow * rows);
+    uint8_t       *narrow = isWord ? malloc(bytesPerRow * rows) : pixels;
+    JSAMPARRAY     lines  = malloc(rows * sizeof(JSAMPROW));
+    
+    if (!pixels || !narrow || !lines) {
+        if (narrow && narrow != pixels) free(narrow);
+        if (pixels) free(pixels);
+        if (lines)  free(lines);
+        return nil;
+    }
+    
+    struct jpeg_compress_struct cinfo;
+    struct DPJpegErrorMgr       jerr;
+    
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = my_error_exit;
     
-    if (maxSize>0.0 && maxSize<fmin(cinfo.image_width,cinfo.image_height) ) {
-        scale = fmin(maxSize/cinfo.image_width,maxSize/cinfo.image_height) ;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&cinfo);
+        if (narrow && narrow != pixels) free(narrow);
+        if (pixels) free(pixels);
+        if (lines)  free(lines);
+        return nil;
     }
     
-    cinfo.scale_num   = scale<1.0f?1:scale;
-    cinfo.scale_denom = scale<1.0f?(unsigned int)floor(1.0f/scale):1;
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest_dp(&cinfo, data);
     
-    /* Step 5: Start decompressor */
+    cinfo.image_width      = (JDIMENSION)width;
+    cinfo.image_height     = (JDIMENSION)rows;
+    cinfo.input_components = 4;
+    cinfo.in_color_space   = colorSpace;
     
-    (void) jpeg_start_decompress(&cinfo);
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
     
-    row_stride = cinfo.output_width * cinfo.output_components;
-    buffer = (*cinfo.mem->alloc_sarray)
-    ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+    cinfo.restart_in_rows = 1;
     
+    jpeg_start_compress(&cinfo, TRUE);
     
-    /* Step 6: while (scan lines remain to be read) */
+    [texture getBytes:pixels
+          bytesPerRow:readPerRow
+           fromRegion:MTLRegionMake2D(0, y0, width, rows)
+          mipmapLevel:0];
     
-    NSUInteger width  = cinfo.output_width;
-    NSUInteger height = cinfo.output_height;
+    if (isWord) {
+        IMPConvertRGBA16ToRGBA8(pixels, readPerRow, narrow, bytesPerRow, width, rows);
+    }
     
-    @autoreleasepool {
-        
+    for (NSUInteger y = 0; y < rows; y++) {
+        lines[y] = narrow + y * bytesPerRow;
+    }
+    
+    while (cinfo.next_scanline < cinfo.image_height) {
+        (void) jpeg_write_scanlines(&cinfo, &lines[cinfo.next_scanline], cinfo.image_height - cinfo.next_scanline);
+    }
+    
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    
+    if (narrow != pixels) free(narrow);
+    free(pixels);
+    free(lines);
+    
+    return data;
+}
+
+/**
+ * Find the entropy coded segment of the strip: the first byte after the SOS header,
+ * and the SOF0 image height field offset
+ */
+static BOOL imp_jpeg_strip_layout(NSData *strip, size_t *scanStart, size_t *heightOffset){
+    
+    const uint8_t *bytes  = strip.bytes;
+    size_t         length = strip.length;
+    size_t         p      = 2; /* SOI */
+    
+    *heightOffset = 0;
+    
+    while (p + 4 <= length && bytes[p] == 0xFF) {
         
-        id<MTLTexture> texture = textureIn;
+        uint8_t marker  = bytes[p+1];
+        size_t  segment = (bytes[p+2]<<8) | bytes[p+3];
         
-        if (texture == nil
-            ||
-            [texture width]!=width
-            ||
-            [texture height]!=height
-            ){
-            MTLTextureDescriptor *textureDescriptor = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:pixelFormat
-                                                                                                         width:width
-                                                                                                        height:height
-                                                                                                     mipmapped:NO];
-            texture = [device newTextureWithDescriptor:textureDescriptor];
+        if (marker == 0xC0) {
+            *heightOffset = p + 5;
         }
-        
-        while (cinfo.output_scanline < cinfo.output_height) {
-            
-            (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-            
-            if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
-                int componentsPerPixel = 4;
-                int componentsPerRow   = componentsPerPixel * cinfo.output_width;
-                uint16_t u16[sizeof(uint16_t)*componentsPerRow];
-                
-                for (int i=0; i < componentsPerRow; i++) {
-                    uint16_t  pixel = 0;
-                    uint8_t  *address = buffer[0]+i;
-                    memcpy(&pixel, address, sizeof(uint8_t));
-                    u16[i] = (uint16_t)(pixel<<8);
-                }
-                [texture replaceRegion:MTLRegionMake2D(0, cinfo.output_scanline-1, cinfo.output_width, 1)
-                           mipmapLevel:0
-                             withBytes:u16
-                           bytesPerRow:row_stride*sizeof(uint16_t)/sizeof(uint8_t)];
-            }
-            else{
-                [texture replaceRegion:MTLRegionMake2D(0, cinfo.output_scanline-1, cinfo.output_width, 1)
-                           mipmapLevel:0
-                             withBytes:buffer[0]
-                           bytesPerRow:row_stride];
-            }
+        else if (marker == 0xDA) {
+            *scanStart = p + 2 + segment;
+            return *heightOffset > 0 && *scanStart + 2 <= length;
         }
         
-        /* Step 7: Finish decompression */
-        
-        (void) jpeg_finish_decompress(&cinfo);
-        
-        /* Step 8: Release JPEG decompression object */
-        
-        jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
-        
-        return texture;
+        p += 2 + segment;
     }
+    
+    return NO;
 }
 
+#pragma mark - Source
 
-+ (void) updateJpegWithMTLTexture:(nonnull id<MTLTexture>)texture
-                   writeInitBlock:(writeInitBlock)writeInitBlock
-                 writeFinishBlock:(writeFinishBlock)writeFinishBlock
-                          quality:(CGFloat)qualityIn error:(NSError *__autoreleasing *)error{
+#define IMP_JPEG_READ_CHUNK (1<<16)
+
+/**
+ * Read the descriptor to the end, size is a hint of regular files, pipes grow the buffer
+ */
+static uint8_t *imp_jpeg_read_fd(int fd, size_t size, size_t *length){
     
-    @autoreleasepool {
-        int quality = round(qualityIn*100.0f); quality=quality<=0?10:quality>100?100:quality;
-        
-        struct jpeg_compress_struct cinfo;
-        struct jpeg_error_mgr jerr;
-        
-        JSAMPROW row_pointer[1];      /* pointer to JSAMPLE row[s] */
-        int row_stride;               /* physical row width in image buffer */
-        
-        /* Step 1: allocate and initialize JPEG compression object */
-        
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
-        
+    size_t   capacity = size > 0 ? size : IMP_JPEG_READ_CHUNK;
+    size_t   count    = 0;
+    uint8_t *buffer   = malloc(capacity);
+    
+    while (buffer) {
         
-        void *userData;
-        if (!writeInitBlock(&cinfo,&userData)) {
-            return;
+        if (count == capacity) {
+            uint8_t *grown = realloc(buffer, capacity * 2);
+            if (grown == NULL) break;
+            buffer    = grown;
+            capacity *= 2;
         }
         
-        /* Step 3: set parameters for compression */
+        ssize_t n = read(fd, buffer + count, capacity - count);
         
-        cinfo.image_width  = (int)[texture width];      /* image width and height, in pixels */
-        cinfo.image_height = (int)[texture height];
-        cinfo.input_components = 4;           /* # of color components per pixel */
-        if (
-            [texture pixelFormat] == MTLPixelFormatBGRA8Unorm
-            ||
-            [texture pixelFormat] == MTLPixelFormatBGRA8Unorm_sRGB
-            ) {
-            cinfo.in_color_space = JCS_EXT_BGRA;  /* colorspace of input image */
+        if (n > 0) {
+            count += n;
         }
-        else if (
-                 [texture pixelFormat] == MTLPixelFormatRGBA8Unorm
-                 ||
-                 [texture pixelFormat] == MTLPixelFormatRGBA8Unorm_sRGB
-                 ) {
-            cinfo.in_color_space = JCS_EXT_RGBA;  /* colorspace of input image */
+        else if (n == 0) {
+            *length = count;
+            return buffer;
         }
-        else if (
-                 [texture pixelFormat] == MTLPixelFormatRGBA16Unorm
-                 ) {
-            cinfo.in_color_space = JCS_EXT_RGBA;
+        else if (errno != EINTR) {
+            break;
         }
-        
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
-        
-        
-        /* Step 4: Start compressor */
-        
-        jpeg_start_compress(&cinfo, TRUE);
-        
-        /* Step 5: while (scan lines remain to be written) */
-        /*           jpeg_write_scanlines(...); */
-        
-        row_stride = (int)cinfo.image_width  * cinfo.input_components; /* JSAMPLEs per row in image_buffer */
-        
-        uint    counts        = cinfo.image_width * 4;
-        uint    componentSize = sizeof(uint8_t);
-        uint8_t *tmp = NULL;
-        if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
-            tmp  = malloc(row_stride);
-            row_stride *= 2;
-            componentSize = sizeof(uint16_t);
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+@interface IMPJpegSource()
+- (instancetype) initWithMapping:(void*)mapping length:(size_t)length mapped:(BOOL)mapped;
+@end
+
+@implementation IMPJpegSource
+{
+    void   *mapping;
+    void  (^deallocator)(void);
+}
+
++ (instancetype) sourceWithFile:(NSString *)filePath error:(NSError *__autoreleasing *)error{
+    
+    int fd = open([filePath fileSystemRepresentation], O_RDONLY);
+    
+    if (fd < 0) {
+        if (error) {
+            *error = imp_jpeg_read_error(ENOENT,
+                                         [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be open", ""),filePath],
+                                         NSLocalizedString(@"File not found", ""));
         }
+        return nil;
+    }
+    
+    struct stat   st;
+    struct statfs fs;
+    
+    BOOL regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    
+    //
+    // pages of network volumes can disappear under the mapping, so they are read as pipes are
+    //
+    if (regular && st.st_size > 0 && fstatfs(fd, &fs) == 0 && (fs.f_flags & MNT_LOCAL)) {
         
-#if TARGET_OS_IPHONE
-#elif TARGET_OS_MAC
-        //
-        // Synchronize texture with host memory
-        //
-        id<MTLCommandQueue> queue             = [texture.device newCommandQueue];
-        id<MTLCommandBuffer> commandBuffer    = [queue commandBuffer];
-        id<MTLBlitCommandEncoder> blitEncoder = [commandBuffer blitCommandEncoder];
-        
-        [blitEncoder synchronizeTexture:texture slice:0 level:0];
-        [blitEncoder endEncoding];
-        
-        [commandBuffer commit];
-        [commandBuffer waitUntilCompleted];
-        
-#endif
-        void       *image_buffer  = malloc(row_stride);
+        void *bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
         
-        int j=0;
-        while (cinfo.next_scanline < cinfo.image_height) {
-            
-            MTLRegion region = MTLRegionMake2D(0, cinfo.next_scanline, cinfo.image_width, 1);
-            
-            [texture getBytes:image_buffer
-                  bytesPerRow:cinfo.image_width * 4 * componentSize
-                   fromRegion:region
-                  mipmapLevel:0];
-            
-            if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
-                uint16_t *s = image_buffer;
-                for (int i=0; i<counts; i++) {
-                    tmp[i] = (s[i]>>8) & 0xff;
-                    j++;
-                }
-                row_pointer[0] = tmp;
-            }
-            else{
-                row_pointer[0] = image_buffer;
-            }
-            (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        if (bytes != MAP_FAILED) {
+            madvise(bytes, st.st_size, MADV_SEQUENTIAL);
+            madvise(bytes, st.st_size, MADV_WILLNEED);
+            close(fd);
+            return [[IMPJpegSource alloc] initWithMapping:bytes length:st.st_size mapped:YES];
         }
-        
+    }
+    
+    size_t   length = 0;
+    uint8_t *bytes  = imp_jpeg_read_fd(fd, regular ? st.st_size : 0, &length);
+    
+    close(fd);
+    
+    if (bytes == NULL || length == 0) {
+        free(bytes);
+        if (error) {
+            *error = imp_jpeg_read_error(EIO,
+                                         [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be read", ""),filePath],
+                                         NSLocalizedString(@"File read error", ""));
+        }
+        return nil;
+    }
+    
+    return [[IMPJpegSource alloc] initWithMapping:bytes length:length mapped:NO];
+}
+
+- (instancetype) initWithMapping:(void *)bytes length:(size_t)length mapped:(BOOL)mapped{
+    self = [super init];
+    if (self) {
+        mapping = bytes;
+        _bytes  = bytes;
+        _length = length;
+        _mapped = mapped;
+    }
+    return self;
+}
+
+- (instancetype) initWithBytes:(const void *)bytes length:(size_t)length deallocator:(void (^)(void))aDeallocator{
+    self = [super init];
+    if (self) {
+        _bytes      = bytes;
+        _length     = length;
+        deallocator = [aDeallocator copy];
+    }
+    return self;
+}
+
+- (void) dealloc{
+    if (_mapped) {
+        munmap(mapping, _length);
+    }
+    else {
+        free(mapping);
+    }
+    if (deallocator) deallocator();
+}
+
+@end
+
+#pragma mark - Planar image
+
+#define IMP_JPEG_MAX_PLANES 3
+
+typedef struct {
+    uint8_t    *bytes;
+    NSUInteger  width;        /* valid samples */
+    NSUInteger  height;
+    NSUInteger  rows;         /* rows padded to whole MCU rows */
+    size_t      bytesPerRow;  /* row padded to whole blocks */
+    int         hSamp;
+    int         vSamp;
+} IMPJpegPlane;
+
+static IMPJpegSubsampling imp_jpeg_subsampling(NSUInteger count, IMPJpegPlane *planes){
+    if (count == 1) return IMPJpegSubsamplingGray;
+    if (planes[1].hSamp != 1 || planes[1].vSamp != 1 || planes[2].hSamp != 1 || planes[2].vSamp != 1) return IMPJpegSubsamplingOther;
+    if (planes[0].hSamp == 1 && planes[0].vSamp == 1) return IMPJpegSubsampling444;
+    if (planes[0].hSamp == 2 && planes[0].vSamp == 1) return IMPJpegSubsampling422;
+    if (planes[0].hSamp == 2 && planes[0].vSamp == 2) return IMPJpegSubsampling420;
+    return IMPJpegSubsamplingOther;
+}
+
+/**
+ * Repeat the last valid sample and row into the padding, so edge blocks do not ring
+ */
+static void imp_jpeg_plane_pad(IMPJpegPlane *plane){
+    
+    if (plane->width == 0 || plane->height == 0) return;
+    
+    for (NSUInteger y = 0; y < plane->height; y++) {
+        uint8_t *row = plane->bytes + y * plane->bytesPerRow;
+        memset(row + plane->width, row[plane->width-1], plane->bytesPerRow - plane->width);
+    }
+    
+    const uint8_t *last = plane->bytes + (plane->height - 1) * plane->bytesPerRow;
+    for (NSUInteger y = plane->height; y < plane->rows; y++) {
+        memcpy(plane->bytes + y * plane->bytesPerRow, last, plane->bytesPerRow);
+    }
+}
+
+@interface IMPJpegPlanarImage()
+- (instancetype) initWithPlanes:(IMPJpegPlane*)layout count:(NSUInteger)count width:(NSUInteger)width height:(NSUInteger)height;
+- (IMPJpegPlane*) planes;
+@end
+
+@implementation IMPJpegPlanarImage
+{
+    IMPJpegPlane planes[IMP_JPEG_MAX_PLANES];
+}
+
+- (instancetype) initWithWidth:(NSUInteger)width height:(NSUInteger)height subsampling:(IMPJpegSubsampling)subsampling{
+    
+    if (width == 0 || height == 0 || subsampling == IMPJpegSubsamplingOther) return nil;
+    
+    int h = subsampling == IMPJpegSubsampling422 || subsampling == IMPJpegSubsampling420 ? 2 : 1;
+    int v = subsampling == IMPJpegSubsampling420 ? 2 : 1;
+    
+    NSUInteger mcuWidth  = h * DCTSIZE;
+    NSUInteger mcuHeight = v * DCTSIZE;
+    NSUInteger paddedWidth  = (width  + mcuWidth  - 1) / mcuWidth  * mcuWidth;
+    NSUInteger paddedHeight = (height + mcuHeight - 1) / mcuHeight * mcuHeight;
+    
+    IMPJpegPlane layout[IMP_JPEG_MAX_PLANES];
+    
+    layout[0] = (IMPJpegPlane){NULL, width, height, paddedHeight, paddedWidth, h, v};
+    
+    for (int c = 1; c < IMP_JPEG_MAX_PLANES; c++) {
+        layout[c] = (IMPJpegPlane){NULL, (width + h - 1) / h, (height + v - 1) / v, paddedHeight / v, paddedWidth / h, 1, 1};
+    }
+    
+    NSUInteger count = subsampling == IMPJpegSubsamplingGray ? 1 : 3;
+    
+    for (NSUInteger c = 0; c < count; c++) {
+        layout[c].bytes = calloc(layout[c].rows, layout[c].bytesPerRow);
+        if (layout[c].bytes == NULL) {
+            for (NSUInteger i = 0; i < c; i++) free(layout[i].bytes);
+            return nil;
+        }
+    }
+    
+    return [self initWithPlanes:layout count:count width:width height:height];
+}
+
+/**
+ * Planes memory is owned by the image
+ */
+- (instancetype) initWithPlanes:(IMPJpegPlane*)layout count:(NSUInteger)count width:(NSUInteger)width height:(NSUInteger)height{
+    self = [super init];
+    if (self) {
+        _width       = width;
+        _height      = height;
+        _planesCount = count;
+        memcpy(planes, layout, count * sizeof(IMPJpegPlane));
+        _subsampling = imp_jpeg_subsampling(count, planes);
+    }
+    return self;
+}
+
+- (void) dealloc{
+    for (NSUInteger c = 0; c < _planesCount; c++) {
+        free(planes[c].bytes);
+    }
+}
+
+- (NSUInteger) widthOfPlane:(NSUInteger)plane{
+    return planes[plane].width;
+}
+
+- (NSUInteger) heightOfPlane:(NSUInteger)plane{
+    return planes[plane].height;
+}
+
+- (size_t) bytesPerRowOfPlane:(NSUInteger)plane{
+    return planes[plane].bytesPerRow;
+}
+
+- (void*) bytesOfPlane:(NSUInteger)plane{
+    return planes[plane].bytes;
+}
+
+- (IMPJpegPlane*) planes{
+    return planes;
+}
+
+@end
+
+//
+// IMP jpegturbo interface
+//
+@implementation IMPJpegturbo
+
++ (BOOL) decodeFile:(nonnull NSString*)filePath
+            maxSize:(CGFloat)maxSize
+        destination:(nonnull IMPJpegDestinationBlock)destination
+              error:(NSError *__autoreleasing *)error{
+    
+    IMPJpegSource *source = [IMPJpegSource sourceWithFile:filePath error:error];
+    
+    if (source == nil) return NO;
+    
+    return [IMPJpegturbo decodeSource:source maxSize:maxSize destination:destination error:error];
+}
+
++ (BOOL) decodeSource:(nonnull IMPJpegSource*)source
+              maxSize:(CGFloat)maxSize
+          destination:(nonnull IMPJpegDestinationBlock)destination
+                error:(NSError *__autoreleasing *)error{
+    
+    return [IMPJpegturbo decodeWithSource:^(DPJpegDecompressInfo *cinfo) {
+        jpeg_mem_src(cinfo, (unsigned char*)source.bytes, source.length);
+    } options:^(DPJpegDecompressInfo *cinfo) {
+        imp_jpeg_set_max_size(cinfo, maxSize);
+    } window:nil destination:destination error:error];
+}
+
++ (BOOL) decodeFile:(nonnull NSString*)filePath
+             region:(CGRect)region
+            maxSize:(CGFloat)maxSize
+        destination:(nonnull IMPJpegDestinationBlock)destination
+              error:(NSError *__autoreleasing *)error{
+    
+    IMPJpegSource *source = [IMPJpegSource sourceWithFile:filePath error:error];
+    
+    if (source == nil) return NO;
+    
+    return [IMPJpegturbo decodeSource:source region:region maxSize:maxSize destination:destination error:error];
+}
+
++ (BOOL) decodeSource:(nonnull IMPJpegSource*)source
+               region:(CGRect)region
+              maxSize:(CGFloat)maxSize
+          destination:(nonnull IMPJpegDestinationBlock)destination
+                error:(NSError *__autoreleasing *)error{
+    
+    if (CGRectIsNull(region)) {
+        return [IMPJpegturbo decodeSource:source maxSize:maxSize destination:destination error:error];
+    }
+    
+    tjhandle handle = tjInitTransform();
+    
+    int width, height, subsampling, colorspace;
+    
+    if (handle == NULL
+        ||
+        tjDecompressHeader3(handle, (unsigned char*)source.bytes, source.length, &width, &height, &subsampling, &colorspace) < 0
+        ||
+        subsampling < 0 || subsampling >= TJ_NUMSAMP
+        ) {
+        if (handle) tjDestroy(handle);
+        if (error) {
+            *error = imp_jpeg_read_error(EILSEQ,
+                                         NSLocalizedString(@"Jpeg image can't be decoded", ""),
+                                         [NSString stringWithUTF8String:tjGetErrorStr()]);
+        }
+        return NO;
+    }
+    
+    CGRect bounds = CGRectIntersection(CGRectIntegral(CGRectMake(region.origin.x * width, region.origin.y * height,
+                                                                 region.size.width * width, region.size.height * height)),
+                                       CGRectMake(0, 0, width, height));
+    
+    if (CGRectIsEmpty(bounds)) {
+        tjDestroy(handle);
+        if (error) {
+            *error = imp_jpeg_read_error(EINVAL,
+                                         NSLocalizedString(@"Region is out of the image", ""),
+                                         NSLocalizedString(@"Wrong region", ""));
+        }
+        return NO;
+    }
+    
+    //
+    // lossless crop of the MCUs covering the region: coefficients are copied without IDCT,
+    // so only the cropped jpeg is transformed and color converted
+    //
+    int x = (int)CGRectGetMinX(bounds) / tjMCUWidth[subsampling]  * tjMCUWidth[subsampling];
+    int y = (int)CGRectGetMinY(bounds) / tjMCUHeight[subsampling] * tjMCUHeight[subsampling];
+    
+    tjtransform transform;
+    memset(&transform, 0, sizeof(transform));
+    transform.r       = (tjregion){x, y, (int)CGRectGetMaxX(bounds) - x, (int)CGRectGetMaxY(bounds) - y};
+    transform.op      = TJXOP_NONE;
+    transform.options = TJXOPT_CROP;
+    
+    unsigned char *crop     = NULL;
+    unsigned long  cropSize = 0;
+    
+    if (tjTransform(handle, (unsigned char*)source.bytes, source.length, 1, &crop, &cropSize, &transform, 0) < 0) {
+        tjDestroy(handle);
+        if (crop) tjFree(crop);
+        if (error) {
+            *error = imp_jpeg_read_error(EILSEQ,
+                                         NSLocalizedString(@"Jpeg image can't be cropped", ""),
+                                         [NSString stringWithUTF8String:tjGetErrorStr()]);
+        }
+        return NO;
+    }
+    
+    tjDestroy(handle);
+    
+    //
+    // maxSize limits the region, the cropped jpeg is larger by the MCU alignment
+    //
+    if (maxSize > 0) {
+        maxSize *= fmax(transform.r.w, transform.r.h) / fmax(bounds.size.width, bounds.size.height);
+    }
+    
+    //
+    // the region is cut out of the MCU aligned crop while decoding, rows are decoded right to the destination
+    //
+    BOOL done = [IMPJpegturbo decodeWithSource:^(DPJpegDecompressInfo *cinfo) {
+        jpeg_mem_src(cinfo, crop, cropSize);
+    } options:^(DPJpegDecompressInfo *cinfo) {
+        imp_jpeg_set_max_size(cinfo, maxSize);
+    } window:^CGRect(NSUInteger w, NSUInteger h) {
+        CGFloat scale = (CGFloat)w / transform.r.w;
+        return CGRectMake(round((CGRectGetMinX(bounds) - x) * scale),
+                          round((CGRectGetMinY(bounds) - y) * scale),
+                          MAX(round(bounds.size.width  * scale), 1),
+                          MAX(round(bounds.size.height * scale), 1));
+    } destination:destination error:error];
+    
+    tjFree(crop);
+    
+    return done;
+}
+
++ (BOOL) decodePreviewOfFile:(nonnull NSString*)filePath
+                     minSize:(CGFloat)minSize
+                 destination:(nonnull IMPJpegDestinationBlock)destination
+                       error:(NSError *__autoreleasing *)error{
+    
+    IMPJpegSource *source = [IMPJpegSource sourceWithFile:filePath error:error];
+    
+    if (source == nil) return NO;
+    
+    return [IMPJpegturbo decodePreviewOfSource:source minSize:minSize destination:destination error:error];
+}
+
++ (BOOL) decodePreviewOfSource:(nonnull IMPJpegSource*)source
+                       minSize:(CGFloat)minSize
+                   destination:(nonnull IMPJpegDestinationBlock)destination
+                         error:(NSError *__autoreleasing *)error{
+    
+    const uint8_t *bytes  = source.bytes;
+    size_t         length = source.length;
+    
+    //
+    // embedded thumbnail is used when it is big enough and has the same aspect as the image,
+    // some cameras store letterboxed 160x120 thumbnails of 3:2 frames
+    //
+    size_t thumbOffset, thumbSize;
+    
+    if (minSize > 0 && imp_jpeg_exif_thumbnail(bytes, length, &thumbOffset, &thumbSize)) {
+        
+        tjhandle handle = tjInitDecompress();
+        
+        int width, height, thumbWidth, thumbHeight, subsampling, colorspace;
+        
+        if (handle
+            &&
+            tjDecompressHeader3(handle, (unsigned char*)bytes, length, &width, &height, &subsampling, &colorspace) == 0
+            &&
+            tjDecompressHeader3(handle, (unsigned char*)bytes + thumbOffset, thumbSize, &thumbWidth, &thumbHeight, &subsampling, &colorspace) == 0
+            &&
+            MIN(thumbWidth, thumbHeight) >= minSize
+            &&
+            fabs((CGFloat)thumbWidth / thumbHeight - (CGFloat)width / height) <= 0.02 * (CGFloat)width / height
+            ) {
+            
+            bytes  += thumbOffset;
+            length  = thumbSize;
+        }
+        
+        if (handle) tjDestroy(handle);
+    }
+    
+    return [IMPJpegturbo decodeWithSource:^(DPJpegDecompressInfo *cinfo) {
+        jpeg_mem_src(cinfo, (unsigned char*)bytes, length);
+    } options:^(DPJpegDecompressInfo *cinfo) {
+        imp_jpeg_set_preview_scale(cinfo, minSize);
+    } window:nil destination:destination error:error];
+}
+
+/**
+ * Decode jpeg from the source which the block sets to the decompressor, to the destination rows.
+ * Options block sets decompression parameters after the header is read.
+ * Window block returns the rectangle of the decoded image which is passed to the destination, nil is the whole image.
+ */
++ (BOOL) decodeWithSource:(void (^)(DPJpegDecompressInfo *cinfo))source
+                  options:(void (^)(DPJpegDecompressInfo *cinfo))options
+                   window:(CGRect (^)(NSUInteger width, NSUInteger height))window
+              destination:(nonnull IMPJpegDestinationBlock)destination
+                    error:(NSError *__autoreleasing *)error{
+    
+    DPJpegDecompressInfo   cinfo;
+    struct DPJpegErrorMgr  jerr;
+    JSAMPARRAY volatile    rows = NULL;     /* Output rows of the destination buffer */
+    JSAMPROW   volatile    line = NULL;     /* Scratch row of windows narrower than the image */
+    
+    /* Step 1: allocate and initialize JPEG decompression object */
+    
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = my_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        if (rows) free(rows);
+        if (line) free(line);
+        
+        if (error) {
+            *error = imp_jpeg_read_error(EILSEQ,
+                                         NSLocalizedString(@"Jpeg image can't be decoded", ""),
+                                         [NSString stringWithUTF8String:jerr.message]);
+        }
+        
+        return NO;
+    }
+    jpeg_create_decompress(&cinfo);
+    
+    /* Step 2: specify data source (eg, a file) */
+    
+    source(&cinfo);
+    
+    /* Step 3: read file parameters with jpeg_read_header() */
+    
+    (void) jpeg_read_header(&cinfo, TRUE);
+    
+    /* Step 4: set parameters for decompression */
+    
+    cinfo.out_color_space = JCS_EXT_RGBA;
+    
+    options(&cinfo);
+    
+    /* Step 5: Start decompressor */
+    
+    (void) jpeg_start_decompress(&cinfo);
+    
+    NSUInteger width      = cinfo.output_width;
+    NSUInteger height     = cinfo.output_height;
+    NSUInteger components = cinfo.output_components;
+    
+    CGRect rect = CGRectMake(0, 0, width, height);
+    
+    if (window) {
+        rect = CGRectIntersection(CGRectIntegral(window(width, height)), rect);
+    }
+    
+    if (CGRectIsEmpty(rect)) {
+        jpeg_abort_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        
+        if (error) {
+            *error = imp_jpeg_read_error(EINVAL,
+                                         NSLocalizedString(@"Region is out of the image", ""),
+                                         NSLocalizedString(@"Wrong region", ""));
+        }
+        return NO;
+    }
+    
+    NSUInteger offsetX = CGRectGetMinX(rect);
+    NSUInteger offsetY = CGRectGetMinY(rect);
+    NSUInteger outW    = CGRectGetWidth(rect);
+    NSUInteger outH    = CGRectGetHeight(rect);
+    
+    size_t bytesPerRow = outW * components;
+    
+    uint8_t *buffer = destination(outW, outH, &bytesPerRow);
+    
+    if (buffer == NULL || bytesPerRow < outW * components) {
+        jpeg_abort_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        
+        if (error) {
+            *error = imp_jpeg_read_error(EINVAL,
+                                         NSLocalizedString(@"Destination buffer is not provided or its rows are too short", ""),
+                                         NSLocalizedString(@"Wrong destination", ""));
+        }
+        return NO;
+    }
+    
+    /*
+     * Step 6: read scan lines straight to the destination rows, as many as the decoder can give per call.
+     * Rows of a window narrower than the image are decoded to a scratch row and their window part is copied,
+     * so nothing but the window pixels is written to the destination. Rows above the window are skipped
+     * through the scratch row too.
+     */
+    
+    BOOL inPlace = outW == width;
+    
+    if (inPlace) {
+        rows = malloc(outH * sizeof(JSAMPROW));
+    }
+    
+    if (!inPlace || offsetY > 0) {
+        line = malloc(width * components);
+    }
+    
+    if ((inPlace && rows == NULL) || ((!inPlace || offsetY > 0) && line == NULL)) {
+        jpeg_abort_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        if (rows) free(rows);
+        if (line) free(line);
+        
+        if (error) {
+            *error = imp_jpeg_read_error(ENOMEM,
+                                         NSLocalizedString(@"Not enough memory to decode jpeg file", ""),
+                                         NSLocalizedString(@"Not enough memory", ""));
+        }
+        return NO;
+    }
+    
+    while (cinfo.output_scanline < offsetY) {
+        JSAMPROW row = line;
+        (void) jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    
+    if (inPlace) {
+        for (NSUInteger y = 0; y < outH; y++) {
+            rows[y] = buffer + y * bytesPerRow;
+        }
+        while (cinfo.output_scanline < offsetY + outH) {
+            NSUInteger y = cinfo.output_scanline - offsetY;
+            (void) jpeg_read_scanlines(&cinfo, &rows[y], (JDIMENSION)(outH - y));
+        }
+    }
+    else {
+        while (cinfo.output_scanline < offsetY + outH) {
+            NSUInteger y   = cinfo.output_scanline - offsetY;
+            JSAMPROW   row = line;
+            (void) jpeg_read_scanlines(&cinfo, &row, 1);
+            memcpy(buffer + y * bytesPerRow, line + offsetX * components, outW * components);
+        }
+    }
+    
+    /* Step 7: Finish decompression, rows below the window are not decoded */
+    
+    if (cinfo.output_scanline < cinfo.output_height) {
+        jpeg_abort_decompress(&cinfo);
+    }
+    else {
+        (void) jpeg_finish_decompress(&cinfo);
+    }
+    
+    /* Step 8: Release JPEG decompression object */
+    
+    jpeg_destroy_decompress(&cinfo);
+    if (rows) free(rows);
+    if (line) free(line);
+    
+    return YES;
+}
+
++ (IMPJpegPlanarImage*) decodePlanarFile:(NSString *)filePath maxSize:(CGFloat)maxSize lumaOnly:(BOOL)lumaOnly error:(NSError *__autoreleasing *)error{
+    
+    IMPJpegSource *source __attribute__((objc_precise_lifetime)) = [IMPJpegSource sourceWithFile:filePath error:error];
+    
+    if (source == nil) return nil;
+    
+    DPJpegDecompressInfo   cinfo;
+    struct DPJpegErrorMgr  jerr;
+    IMPJpegPlane          *layout = calloc(IMP_JPEG_MAX_PLANES, sizeof(IMPJpegPlane));
+    
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = my_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        for (int c = 0; c < IMP_JPEG_MAX_PLANES; c++) free(layout[c].bytes);
+        free(layout);
+        
+        if (error) {
+            *error = imp_jpeg_read_error(EILSEQ,
+                                         [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be decoded", ""),filePath],
+                                         [NSString stringWithUTF8String:jerr.message]);
+        }
+        return nil;
+    }
+    jpeg_create_decompress(&cinfo);
+    
+    jpeg_mem_src(&cinfo, (unsigned char*)source.bytes, source.length);
+    
+    (void) jpeg_read_header(&cinfo, TRUE);
+    
+    if (cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+        jpeg_destroy_decompress(&cinfo);
+        free(layout);
+        if (error) {
+            *error = imp_jpeg_read_error(EINVAL,
+                                         [NSString stringWithFormat:NSLocalizedString(@"Image file %@ is not YCbCr or grayscale", ""),filePath],
+                                         NSLocalizedString(@"Unsupported color space", ""));
+        }
+        return nil;
+    }
+    
+    if (lumaOnly) {
+        
+        /* grayscale output of YCbCr jpeg is Y: chroma components are marked as not needed */
+        
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        
+        imp_jpeg_set_max_size(&cinfo, maxSize);
+        
+        (void) jpeg_start_decompress(&cinfo);
+        
+        NSUInteger width  = cinfo.output_width;
+        NSUInteger height = cinfo.output_height;
+        
+        /* padded to whole blocks which the encoder reads */
+        
+        NSUInteger paddedWidth  = (width  + DCTSIZE - 1) / DCTSIZE * DCTSIZE;
+        NSUInteger paddedHeight = (height + DCTSIZE - 1) / DCTSIZE * DCTSIZE;
+        
+        layout[0] = (IMPJpegPlane){malloc(paddedWidth * paddedHeight), width, height, paddedHeight, paddedWidth, 1, 1};
+        
+        if (layout[0].bytes == NULL) {
+            ERREXIT(&cinfo, JERR_OUT_OF_MEMORY);
+        }
+        
+        JSAMPROW rows[MAX_SAMP_FACTOR * DCTSIZE];
+        
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JDIMENSION lines = MIN(cinfo.output_height - cinfo.output_scanline, MAX_SAMP_FACTOR * DCTSIZE);
+            for (JDIMENSION r = 0; r < lines; r++) {
+                rows[r] = layout[0].bytes + (cinfo.output_scanline + r) * paddedWidth;
+            }
+            (void) jpeg_read_scanlines(&cinfo, rows, lines);
+        }
+        
+        (void) jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        
+        IMPJpegPlanarImage *planar = [[IMPJpegPlanarImage alloc] initWithPlanes:layout count:1 width:width height:height];
+        
+        free(layout);
+        
+        return planar;
+    }
+    
+    /* planes are read as they are stored: no color conversion and upsampling */
+    
+    cinfo.out_color_space = cinfo.jpeg_color_space;
+    cinfo.raw_data_out    = TRUE;
+    
+    imp_jpeg_set_max_size(&cinfo, maxSize);
+    
+    (void) jpeg_start_decompress(&cinfo);
+    
+    int count = cinfo.num_components;
+    
+    for (int c = 0; c < count; c++) {
+        
+        jpeg_component_info *component = &cinfo.comp_info[c];
+        
+        /*
+         * the plane covers the blocks the decoder writes and the MCU grid of the output size which the encoder reads:
+         * the scaled decoder keeps blocks of the original image, they may be less than the output MCUs
+         */
+        NSUInteger mcuColumns = (cinfo.output_width  + cinfo.max_h_samp_factor * DCTSIZE - 1) / (cinfo.max_h_samp_factor * DCTSIZE);
+        NSUInteger mcuRows    = (cinfo.output_height + cinfo.max_v_samp_factor * DCTSIZE - 1) / (cinfo.max_v_samp_factor * DCTSIZE);
+        
+        layout[c].width       = component->downsampled_width;
+        layout[c].height      = component->downsampled_height;
+        layout[c].bytesPerRow = MAX(component->width_in_blocks * component->DCT_scaled_size,
+                                    mcuColumns * component->h_samp_factor * DCTSIZE);
+        layout[c].rows        = MAX(cinfo.total_iMCU_rows * component->v_samp_factor * component->DCT_scaled_size,
+                                    mcuRows * component->v_samp_factor * DCTSIZE);
+        layout[c].hSamp       = component->h_samp_factor;
+        layout[c].vSamp       = component->v_samp_factor;
+        layout[c].bytes       = malloc(layout[c].rows * layout[c].bytesPerRow);
+        
+        if (layout[c].bytes == NULL) {
+            ERREXIT(&cinfo, JERR_OUT_OF_MEMORY);
+        }
+    }
+    
+    /* every call reads one iMCU row: v_samp_factor*DCT_scaled_size rows of each component */
+    
+    JSAMPROW   rows[IMP_JPEG_MAX_PLANES][MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPARRAY image[IMP_JPEG_MAX_PLANES];
+    JDIMENSION linesPerCall = cinfo.max_v_samp_factor * cinfo.min_DCT_scaled_size;
+    
+    while (cinfo.output_scanline < cinfo.output_height) {
+        
+        JDIMENSION iMCURow = cinfo.output_scanline / linesPerCall;
+        
+        for (int c = 0; c < count; c++) {
+            NSUInteger compRows = cinfo.comp_info[c].v_samp_factor * cinfo.comp_info[c].DCT_scaled_size;
+            for (NSUInteger r = 0; r < compRows; r++) {
+                rows[c][r] = layout[c].bytes + (iMCURow * compRows + r) * layout[c].bytesPerRow;
+            }
+            image[c] = rows[c];
+        }
+        
+        (void) jpeg_read_raw_data(&cinfo, image, linesPerCall);
+    }
+    
+    NSUInteger width  = cinfo.output_width;
+    NSUInteger height = cinfo.output_height;
+    
+    (void) jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    
+    IMPJpegPlanarImage *planar = [[IMPJpegPlanarImage alloc] initWithPlanes:layout count:count width:width height:height];
+    
+    free(layout);
+    
+    return planar;
+}
+
++ (NSData*) dataFromPlanarImage:(IMPJpegPlanarImage *)planar compression:(CGFloat)qualityIn{
+    
+    int           quality = imp_jpeg_quality(qualityIn);
+    NSUInteger    count   = planar.planesCount;
+    IMPJpegPlane *layout  = [planar planes];
+    
+    for (NSUInteger c = 0; c < count; c++) {
+        imp_jpeg_plane_pad(&layout[c]);
+    }
+    
+    NSMutableData *data = [NSMutableData dataWithLength:MAX(planar.width * planar.height / 4, BLOCK_SIZE)];
+    
+    struct jpeg_compress_struct cinfo;
+    struct DPJpegErrorMgr       jerr;
+    
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = my_error_exit;
+    
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&cinfo);
+        return nil;
+    }
+    
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest_dp(&cinfo, data);
+    
+    cinfo.image_width      = (JDIMENSION)planar.width;
+    cinfo.image_height     = (JDIMENSION)planar.height;
+    cinfo.input_components = (int)count;
+    cinfo.in_color_space   = count == 1 ? JCS_GRAYSCALE : JCS_YCbCr;
+    
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    
+    cinfo.raw_data_in = TRUE;
+    
+    for (NSUInteger c = 0; c < count; c++) {
+        cinfo.comp_info[c].h_samp_factor = layout[c].hSamp;
+        cinfo.comp_info[c].v_samp_factor = layout[c].vSamp;
+    }
+    
+    jpeg_start_compress(&cinfo, TRUE);
+    
+    JSAMPROW   rows[IMP_JPEG_MAX_PLANES][MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPARRAY image[IMP_JPEG_MAX_PLANES];
+    JDIMENSION linesPerCall = cinfo.max_v_samp_factor * DCTSIZE;
+    
+    while (cinfo.next_scanline < cinfo.image_height) {
+        
+        JDIMENSION iMCURow = cinfo.next_scanline / linesPerCall;
+        
+        for (NSUInteger c = 0; c < count; c++) {
+            NSUInteger compRows = layout[c].vSamp * DCTSIZE;
+            for (NSUInteger r = 0; r < compRows; r++) {
+                rows[c][r] = layout[c].bytes + (iMCURow * compRows + r) * layout[c].bytesPerRow;
+            }
+            image[c] = rows[c];
+        }
+        
+        (void) jpeg_write_raw_data(&cinfo, image, linesPerCall);
+    }
+    
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    
+    return data;
+}
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable id<MTLTexture>)textureIn withPixelFormat:(MTLPixelFormat)pixelFormat withDevice:(id<MTLDevice>)device fromFile:(NSString*)filePath  maxSize:(CGFloat)maxSize  error:(NSError *__autoreleasing *)error{
+    return [IMPJpegturbo updateMTLTexture:textureIn withPixelFormat:pixelFormat withDevice:device fromFile:filePath region:CGRectNull maxSize:maxSize error:error];
+}
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable id<MTLTexture>)textureIn withPixelFormat:(MTLPixelFormat)pixelFormat withDevice:(id<MTLDevice>)device fromFile:(NSString*)filePath region:(CGRect)region maxSize:(CGFloat)maxSize  error:(NSError *__autoreleasing *)error{
+    return [IMPJpegturbo updateMTLTexture:textureIn withPixelFormat:pixelFormat withDevice:device decode:^BOOL(IMPJpegDestinationBlock destination) {
+        return [IMPJpegturbo decodeFile:filePath region:region maxSize:maxSize destination:destination error:error];
+    } error:error];
+}
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable id<MTLTexture>)textureIn withPixelFormat:(MTLPixelFormat)pixelFormat withDevice:(id<MTLDevice>)device previewOfFile:(NSString*)filePath minSize:(CGFloat)minSize error:(NSError *__autoreleasing *)error{
+    return [IMPJpegturbo updateMTLTexture:textureIn withPixelFormat:pixelFormat withDevice:device decode:^BOOL(IMPJpegDestinationBlock destination) {
+        return [IMPJpegturbo decodePreviewOfFile:filePath minSize:minSize destination:destination error:error];
+    } error:error];
+}
+
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable id<MTLTexture>)textureIn withPixelFormat:(MTLPixelFormat)pixelFormat withDevice:(id<MTLDevice>)device fromSource:(IMPJpegSource*)source maxSize:(CGFloat)maxSize error:(NSError *__autoreleasing *)error{
+    return [IMPJpegturbo updateMTLTexture:textureIn withPixelFormat:pixelFormat withDevice:device decode:^BOOL(IMPJpegDestinationBlock destination) {
+        return [IMPJpegturbo decodeSource:source maxSize:maxSize destination:destination error:error];
+    } error:error];
+}
+
+/**
+ * Upload pixels of the decode block to the texture, the texture is recreated when its size or format differ
+ */
++ (id<MTLTexture> _Nullable) updateMTLTexture:(nullable id<MTLTexture>)textureIn
+                              withPixelFormat:(MTLPixelFormat)pixelFormat
+                                   withDevice:(id<MTLDevice>)device
+                                       decode:(BOOL (^)(IMPJpegDestinationBlock destination))decode
+                                        error:(NSError *__autoreleasing *)error{
+    
+    @autoreleasepool {
+        
+        __block id<MTLTexture> texture = textureIn;
+        __block void          *pixels  = NULL;
+        __block size_t         stride  = 0;
+        
+        BOOL done = decode(^void *(NSUInteger width, NSUInteger height, size_t *bytesPerRow) {
+            
+            if (texture == nil
+                ||
+                [texture width]!=width
+                ||
+                [texture height]!=height
+                ||
+                [texture pixelFormat]!=pixelFormat
+                ){
+                MTLTextureDescriptor *textureDescriptor = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:pixelFormat
+                                                                                                             width:width
+                                                                                                            height:height
+                                                                                                         mipmapped:NO];
+                texture = [device newTextureWithDescriptor:textureDescriptor];
+            }
+            
+            stride = *bytesPerRow;
+            pixels = malloc(stride * height);
+            
+            return pixels;
+        });
+        
+        if (!done) {
+            if (pixels) {
+                free(pixels);
+            }
+            else if (stride > 0 && error) {
+                *error = imp_jpeg_read_error(ENOMEM,
+                                             NSLocalizedString(@"Not enough memory to decode jpeg file", ""),
+                                             NSLocalizedString(@"Not enough memory", ""));
+            }
+            return textureIn;
+        }
+        
+        NSUInteger width       = [texture width];
+        NSUInteger height      = [texture height];
+        NSUInteger bytesPerRow = width * 4;
+        
+        if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
+            
+            uint16_t  *u16   = malloc(bytesPerRow * height * sizeof(uint16_t));
+            
+            if (u16 == NULL) {
+                free(pixels);
+                if (error) {
+                    *error = imp_jpeg_read_error(ENOMEM,
+                                                 NSLocalizedString(@"Not enough memory to decode jpeg file", ""),
+                                                 NSLocalizedString(@"Not enough memory", ""));
+                }
+                return textureIn;
+            }
+            
+            IMPConvertRGBA8ToRGBA16(pixels, stride, u16, bytesPerRow*sizeof(uint16_t), width, height);
+            
+            [texture replaceRegion:MTLRegionMake2D(0, 0, width, height)
+                       mipmapLevel:0
+                         withBytes:u16
+                       bytesPerRow:bytesPerRow*sizeof(uint16_t)];
+            free(u16);
+        }
+        else{
+            [texture replaceRegion:MTLRegionMake2D(0, 0, width, height)
+                       mipmapLevel:0
+                         withBytes:pixels
+                       bytesPerRow:stride];
+        }
+        
+        free(pixels);
+        
+        return texture;
+    }
+}
+
+
++ (void) updateJpegWithMTLTexture:(nonnull id<MTLTexture>)texture
+                   writeInitBlock:(writeInitBlock)writeInitBlock
+                 writeFinishBlock:(writeFinishBlock)writeFinishBlock
+                          quality:(CGFloat)qualityIn error:(NSError *__autoreleasing *)error{
+    
+    @autoreleasepool {
+        int quality = imp_jpeg_quality(qualityIn);
+        
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+        
+        JSAMPROW row_pointer[1];      /* pointer to JSAMPLE row[s] */
+        int row_stride;               /* physical row width in image buffer */
+        
+        /* Step 1: allocate and initialize JPEG compression object */
+        
+        cinfo.err = jpeg_std_error(&jerr);
+        jpeg_create_compress(&cinfo);
+        
+        
+        void *userData;
+        if (!writeInitBlock(&cinfo,&userData)) {
+            return;
+        }
+        
+        /* Step 3: set parameters for compression */
+        
+        cinfo.image_width  = (int)[texture width];      /* image width and height, in pixels */
+        cinfo.image_height = (int)[texture height];
+        cinfo.input_components = 4;           /* # of color components per pixel */
+        cinfo.in_color_space   = imp_jpeg_texture_color_space(texture);
+        
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+        
+        
+        /* Step 4: Start compressor */
+        
+        jpeg_start_compress(&cinfo, TRUE);
+        
+        /* Step 5: while (scan lines remain to be written) */
+        /*           jpeg_write_scanlines(...); */
+        
+        row_stride = (int)cinfo.image_width  * cinfo.input_components; /* JSAMPLEs per row in image_buffer */
+        
+        uint    counts        = cinfo.image_width * 4;
+        uint    componentSize = sizeof(uint8_t);
+        uint8_t *tmp = NULL;
+        if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
+            tmp  = malloc(row_stride);
+            row_stride *= 2;
+            componentSize = sizeof(uint16_t);
+        }
+        
+        imp_jpeg_synchronize_texture(texture);
+        
+        void       *image_buffer  = malloc(row_stride);
+        
+        while (cinfo.next_scanline < cinfo.image_height) {
+            
+            MTLRegion region = MTLRegionMake2D(0, cinfo.next_scanline, cinfo.image_width, 1);
+            
+            [texture getBytes:image_buffer
+                  bytesPerRow:cinfo.image_width * 4 * componentSize
+                   fromRegion:region
+                  mipmapLevel:0];
+            
+            if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
+                IMPConvertRGBA16ToRGBA8(image_buffer, row_stride, tmp, counts, cinfo.image_width, 1);
+                row_pointer[0] = tmp;
+            }
+            else{
+                row_pointer[0] = image_buffer;
+            }
+            (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        }
+        
         free(image_buffer);
         if (tmp != NULL) free(tmp);
         
-        /* Step 6: Finish compression */
-        jpeg_finish_compress(&cinfo);
+        /* Step 6: Finish compression */
+        jpeg_finish_compress(&cinfo);
+        
+        /* After finish_compress, we can clear user data. */
+        writeFinishBlock(&cinfo,userData);
+        
+        /* Step 7: release JPEG compression object */
+        jpeg_destroy_compress(&cinfo);
+        
+    }
+}
+
+
++ (nullable NSData*) dataFromMTLTexture:(nonnull id<MTLTexture>)texture
+                            compression:(CGFloat)qualityIn{
+    
+    __block NSMutableData *data = [NSMutableData dataWithCapacity:BLOCK_SIZE];
+    
+    if (data) {
+        [IMPJpegturbo updateJpegWithMTLTexture:texture
+                                writeInitBlock:^BOOL(void *in_cinfo, void **userData) {
+                                    struct jpeg_compress_struct *cinfo = in_cinfo;
+                                    [data setLength:BLOCK_SIZE];
+                                    jpeg_mem_dest_dp(cinfo, data);
+                                    return YES;
+                                } writeFinishBlock:^(void *in_cinfo, void *userData) {
+                                } quality:qualityIn error:nil
+         ];
+    }
+    
+    
+    return data;
+}
+
++ (void) writeMTLTexture:(id<MTLTexture>)texture
+              toJpegFile:(NSString *)filePath
+             compression:(CGFloat)qualityIn
+                   error:(NSError *__autoreleasing *)error{
+    
+    __block const char *filename = [filePath cStringUsingEncoding:NSUTF8StringEncoding];
+    
+    [[self class] updateJpegWithMTLTexture:texture
+                            writeInitBlock:^BOOL(void *in_cinfo, void **userData) {
+                                
+                                struct jpeg_compress_struct *cinfo = in_cinfo;
+                                
+                                FILE * outfile;               /* target file */
+                                /* Step 2: specify data destination (eg, a file) */
+                                if ((outfile = fopen(filename, "wb")) == NULL) {
+                                    if (error) {
+                                        *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.write"
+                                                                             code: ENOENT
+                                                                         userInfo: @{
+                                                                                     NSLocalizedDescriptionKey:  [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be created", nil),filename],
+                                                                                     NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"File can't be created", nil),
+                                                                                     }];
+                                    }
+                                    return NO;
+                                }
+                                jpeg_stdio_dest(cinfo, outfile);
+                                
+                                *userData = outfile;
+                                
+                                return YES;
+                                
+                            } writeFinishBlock:^(void *cinfo, void *userData) {
+                                /* After finish_compress, we can close the output file. */
+                                FILE * outfile = userData;
+                                fflush(outfile);
+                                fclose(outfile);
+                            } quality:qualityIn error:error
+     ];
+}
+
++ (nullable NSData*) dataFromMTLTexture:(nonnull id<MTLTexture>)texture
+                            compression:(CGFloat)qualityIn
+                            concurrency:(NSUInteger)concurrency{
+    
+    @autoreleasepool {
+        
+        if (concurrency == 0) {
+            concurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+        }
+        
+        int           quality    = imp_jpeg_quality(qualityIn);
+        J_COLOR_SPACE colorSpace = imp_jpeg_texture_color_space(texture);
+        NSUInteger    height     = [texture height];
+        
+        //
+        // two strips per worker balance the load, strip height is aligned to 8 MCU rows
+        //
+        NSUInteger alignment = imp_jpeg_mcu_height(colorSpace, quality) * IMP_JPEG_RESTART_MARKERS;
+        NSUInteger stripRows = (height + concurrency * 2 - 1) / (concurrency * 2);
+        stripRows = (stripRows + alignment - 1) / alignment * alignment;
+        
+        NSUInteger strips = (height + stripRows - 1) / stripRows;
+        
+        if (concurrency == 1 || strips <= 1) {
+            return [IMPJpegturbo dataFromMTLTexture:texture compression:qualityIn];
+        }
+        
+        imp_jpeg_synchronize_texture(texture);
+        
+        NSMutableArray *parts = [NSMutableArray arrayWithCapacity:strips];
+        for (NSUInteger i = 0; i < strips; i++) {
+            [parts addObject:[NSNull null]];
+        }
+        
+        NSLock *lock = [NSLock new];
+        
+        dispatch_apply(strips, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t i) {
+            @autoreleasepool {
+                NSUInteger     y0   = i * stripRows;
+                NSMutableData *part = imp_jpeg_encode_strip(texture, colorSpace, quality, y0, MIN(stripRows, height - y0));
+                if (part) {
+                    [lock lock];
+                    parts[i] = part;
+                    [lock unlock];
+                }
+            }
+        });
+        
+        //
+        // stitch: headers of the first strip with the full image height, entropy coded segments
+        // of all strips separated by restart markers, EOI
+        //
+        size_t total = 0;
+        for (id part in parts) {
+            if (![part isKindOfClass:[NSData class]]) return nil;
+            total += [part length];
+        }
+        
+        size_t scanStart, heightOffset;
+        if (!imp_jpeg_strip_layout(parts[0], &scanStart, &heightOffset)) return nil;
+        
+        NSMutableData *data = [NSMutableData dataWithCapacity:total];
+        
+        [data appendBytes:[parts[0] bytes] length:scanStart];
+        
+        uint8_t *header = data.mutableBytes;
+        header[heightOffset]   = (uint8_t)(height >> 8);
+        header[heightOffset+1] = (uint8_t)(height & 0xFF);
+        
+        NSUInteger mcuRows = stripRows / (alignment / IMP_JPEG_RESTART_MARKERS);
+        
+        for (NSUInteger i = 0; i < strips; i++) {
+            
+            NSData *part = parts[i];
+            size_t  start, offset;
+            
+            if (!imp_jpeg_strip_layout(part, &start, &offset)) return nil;
+            
+            [data appendBytes:(const uint8_t*)part.bytes + start length:part.length - start - 2 /* EOI */];
+            
+            if (i + 1 < strips) {
+                uint8_t marker[2] = {0xFF, (uint8_t)(0xD0 + ((i + 1) * mcuRows - 1) % IMP_JPEG_RESTART_MARKERS)};
+                [data appendBytes:marker length:2];
+            }
+        }
+        
+        uint8_t eoi[2] = {0xFF, 0xD9};
+        [data appendBytes:eoi length:2];
+        
+        return data;
+    }
+}
+
++ (BOOL) writeMTLTexture:(nonnull id<MTLTexture>)texture
+              toJpegFile:(nonnull NSString *)filePath
+             compression:(CGFloat)quality
+             concurrency:(NSUInteger)concurrency
+                   error:(NSError *__autoreleasing *)error{
+    
+    NSData *data = [IMPJpegturbo dataFromMTLTexture:texture compression:quality concurrency:concurrency];
+    
+    if (data == nil) {
+        if (error) {
+            *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.write"
+                                                 code: ENOMEM
+                                             userInfo: @{
+                                                         NSLocalizedDescriptionKey:  NSLocalizedString(@"Not enough memory to encode jpeg file", nil),
+                                                         NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"Not enough memory", nil),
+                                                         }];
+        }
+        return NO;
+    }
+    
+    return [data writeToFile:filePath options:NSDataWritingAtomic error:error];
+}
+
++ (BOOL) writePixelBuffer:(CVPixelBufferRef)pixelBuffer
+               toJpegFile:(NSString *)path
+              compression:(CGFloat)compressionQ
+          inputColorSpace:(IMPJpegColorSpace)colorSpace
+                    error:(NSError *__autoreleasing *)error
+{
+    
+    int quality = round(compressionQ*100.0f); quality=quality<=0?10:quality>100?100:quality;
+    
+    const char *filename = [path cStringUsingEncoding:NSUTF8StringEncoding];
+    
+    int q = (int)round(quality * 100.0f); q=(q<=0?10:q>=100?100:q);
+    
+    
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    
+    FILE * outfile;               /* target file */
+    JSAMPROW row_pointer[1];      /* pointer to JSAMPLE row[s] */
+    int row_stride;               /* physical row width in image buffer */
+    
+    /* Step 1: allocate and initialize JPEG compression object */
+    
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    
+    
+    /* Step 2: specify data destination (eg, a file) */
+    if ((outfile = fopen(filename, "wb")) == NULL) {
+        if (error) {
+            *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.write"
+                                                 code: ENOENT
+                                             userInfo: @{
+                                                         NSLocalizedDescriptionKey:  [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be created", nil),filename],
+                                                         NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"File can't be created", nil),
+                                                         }];
+        }
+        return NO;
+    }
+    jpeg_stdio_dest(&cinfo, outfile);
+    
+    
+    /* Step 3: set parameters for compression */
+    
+    cinfo.image_width  = (int)CVPixelBufferGetWidth(pixelBuffer);      /* image width and height, in pixels */
+    cinfo.image_height = (int)CVPixelBufferGetHeight(pixelBuffer);
+    cinfo.input_components = 4;           /* # of color components per pixel */
+    cinfo.in_color_space = imp_jpeg_color_space(colorSpace);    /* colorspace of input image */
+    
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+    
+    
+    /* Step 4: Start compressor */
+    
+    jpeg_start_compress(&cinfo, TRUE);
+    
+    
+    /* Step 5: while (scan lines remain to be written) */
+    /*           jpeg_write_scanlines(...); */
+    
+    row_stride = (int)cinfo.image_width  * cinfo.input_components; /* JSAMPLEs per row in image_buffer */
+    
+    CVPixelBufferLockBaseAddress(pixelBuffer, 0);
+    void       *image_buffer  = CVPixelBufferGetBaseAddress(pixelBuffer);
+    
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row_pointer[0] = & image_buffer[cinfo.next_scanline * row_stride];
+        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    
+    CVPixelBufferUnlockBaseAddress(pixelBuffer, 0);
+    
+    /* Step 6: Finish compression */
+    
+    jpeg_finish_compress(&cinfo);
+    /* After finish_compress, we can close the output file. */
+    fclose(outfile);
+    
+    
+    /* Step 7: release JPEG compression object */
+    jpeg_destroy_compress(&cinfo);
+    
+    return YES;
+}
+
+@end
+
+
+#pragma mark - Buffer pool
+
+#define IMP_POOL_MIN_CLASS  (1<<16)
+
+/**
+ * Round length up to 4 steps per power of two
+ */
+static size_t imp_pool_size_class(size_t length){
+    
+    if (length <= IMP_POOL_MIN_CLASS) return IMP_POOL_MIN_CLASS;
+    
+    size_t octave = 1;
+    while (octave <= length / 2) octave <<= 1;
+    
+    size_t step = octave / 4;
+    
+    return (length + step - 1) / step * step;
+}
+
+@interface IMPJpegImage()
+@property (nonatomic,strong) NSString *filePath;
+@property (nonatomic)        NSUInteger width;
+@property (nonatomic)        NSUInteger height;
+@property (nonatomic)        size_t     bytesPerRow;
+@property (nonatomic)        void      *bytes;
+@property (nonatomic)        size_t     length;
+@property (nonatomic,weak)   IMPJpegBufferPool *pool;
+@end
+
+@interface IMPJpegBufferPool()
+- (void) recycleImage:(IMPJpegImage*)image;
+@end
+
+@implementation IMPJpegImage
+
+- (void) recycle{
+    IMPJpegBufferPool *pool = self.pool;
+    if (pool) {
+        [pool recycleImage:self];
+    }
+}
+
+- (void) dealloc{
+    if (_bytes) free(_bytes);
+}
+
+@end
+
+@implementation IMPJpegBufferPool
+{
+    NSMutableDictionary<NSNumber*,NSMutableArray<IMPJpegImage*>*> *classes;
+    NSLock *lock;
+}
+
+- (instancetype) init{
+    return [self initWithCapacity:(size_t)([[NSProcessInfo processInfo] physicalMemory] / 8)];
+}
+
+- (instancetype) initWithCapacity:(size_t)capacity{
+    self = [super init];
+    if (self) {
+        _capacity = capacity;
+        classes   = [NSMutableDictionary new];
+        lock      = [NSLock new];
+    }
+    return self;
+}
+
+- (IMPJpegImage*) imageWithLength:(size_t)length{
+    
+    size_t    sizeClass = imp_pool_size_class(length);
+    NSNumber *key       = @(sizeClass);
+    
+    [lock lock];
+    IMPJpegImage *image = [classes[key] lastObject];
+    if (image) {
+        [classes[key] removeLastObject];
+        _retainedBytes -= image.length;
+    }
+    [lock unlock];
+    
+    if (image == nil) {
+        void *bytes = malloc(sizeClass);
+        if (bytes == NULL) return nil;
+        image        = [IMPJpegImage new];
+        image.bytes  = bytes;
+        image.length = sizeClass;
+        image.pool   = self;
+    }
+    
+    return image;
+}
+
+- (void) recycleImage:(IMPJpegImage*)image{
+    
+    NSNumber *key = @(image.length);
+    
+    [lock lock];
+    if (_retainedBytes + image.length <= _capacity) {
+        NSMutableArray *list = classes[key];
+        if (list == nil) {
+            list = [NSMutableArray new];
+            classes[key] = list;
+        }
+        if (![list containsObject:image]) {
+            [list addObject:image];
+            _retainedBytes += image.length;
+        }
+    }
+    [lock unlock];
+}
+
+- (void) drain{
+    [lock lock];
+    [classes removeAllObjects];
+    _retainedBytes = 0;
+    [lock unlock];
+}
+
+@end
+
+#pragma mark - Batch decoder
+
+/**
+ * Errors are caught by the worker thread which has raised them, the libjpeg message is kept
+ * for the file error instead of printing
+ */
+struct IMPJpegWorkerErrorMgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf               setjmp_buffer;
+    char                  message[JMSG_LENGTH_MAX];
+};
+
+typedef struct {
+    DPJpegDecompressInfo           cinfo;
+    struct IMPJpegWorkerErrorMgr   jerr;
+    JSAMPARRAY                     rows;
+    NSUInteger                     rowsCapacity;
+} IMPJpegWorker;
+
+static void imp_jpeg_worker_error_exit(j_common_ptr cinfo){
+    struct IMPJpegWorkerErrorMgr *err = (struct IMPJpegWorkerErrorMgr *) cinfo->err;
+    (*cinfo->err->format_message) (cinfo, err->message);
+    longjmp(err->setjmp_buffer, 1);
+}
+
+static void imp_jpeg_worker_output_message(j_common_ptr cinfo){
+    /* warnings of batch files are skipped */
+}
+
+/**
+ * Read header and start decompressor, the decompressor is aborted on error and can be reused
+ */
+static BOOL imp_jpeg_worker_start(IMPJpegWorker *worker, IMPJpegSource *source, CGFloat maxSize){
+    
+    DPJpegDecompressInfo *cinfo = &worker->cinfo;
+    
+    if (setjmp(worker->jerr.setjmp_buffer)) {
+        jpeg_abort_decompress(cinfo);
+        return NO;
+    }
+    
+    jpeg_mem_src(cinfo, (unsigned char*)source.bytes, source.length);
+    
+    (void) jpeg_read_header(cinfo, TRUE);
+    
+    cinfo->out_color_space = JCS_EXT_RGBA;
+    
+    imp_jpeg_set_max_size(cinfo, maxSize);
+    
+    (void) jpeg_start_decompress(cinfo);
+    
+    return YES;
+}
+
+/**
+ * Read all scanlines to the buffer and finish decompression, rows array grows only for taller images
+ */
+static BOOL imp_jpeg_worker_read(IMPJpegWorker *worker, uint8_t *buffer, size_t bytesPerRow){
+    
+    DPJpegDecompressInfo *cinfo  = &worker->cinfo;
+    NSUInteger            height = cinfo->output_height;
+    
+    if (setjmp(worker->jerr.setjmp_buffer)) {
+        jpeg_abort_decompress(cinfo);
+        return NO;
+    }
+    
+    if (worker->rowsCapacity < height) {
+        JSAMPARRAY rows = realloc(worker->rows, height * sizeof(JSAMPROW));
+        if (rows == NULL) {
+            jpeg_abort_decompress(cinfo);
+            snprintf(worker->jerr.message, JMSG_LENGTH_MAX, "Not enough memory");
+            return NO;
+        }
+        worker->rows         = rows;
+        worker->rowsCapacity = height;
+    }
+    
+    for (NSUInteger y = 0; y < height; y++) {
+        worker->rows[y] = buffer + y * bytesPerRow;
+    }
+    
+    while (cinfo->output_scanline < cinfo->output_height) {
+        (void) jpeg_read_scanlines(cinfo, &worker->rows[cinfo->output_scanline], cinfo->output_height - cinfo->output_scanline);
+    }
+    
+    (void) jpeg_finish_decompress(cinfo);
+    
+    return YES;
+}
+
+typedef void (^IMPJpegBatchJob)(IMPJpegWorker *worker);
+
+@implementation IMPJpegBatchDecoder
+{
+    IMPJpegWorker         *workers;
+    IMPJpegWorker        **idle;
+    NSUInteger             idleCount;
+    NSMutableArray        *jobs;
+    NSLock                *lock;
+    dispatch_semaphore_t   pending;
+    dispatch_group_t       group;
+    dispatch_queue_t       queue;
+}
+
+- (instancetype) init{
+    NSUInteger concurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    return [self initWithConcurrency:concurrency maxPending:concurrency * 4 pool:nil];
+}
+
+- (instancetype) initWithConcurrency:(NSUInteger)concurrency maxPending:(NSUInteger)maxPending pool:(IMPJpegBufferPool*)pool{
+    self = [super init];
+    if (self) {
+        _concurrency = MAX(concurrency, 1);
+        _maxPending  = MAX(maxPending, _concurrency);
+        _pool        = pool ? pool : [IMPJpegBufferPool new];
         
-        /* After finish_compress, we can clear user data. */
-        writeFinishBlock(&cinfo,userData);
+        workers   = calloc(_concurrency, sizeof(IMPJpegWorker));
+        idle      = calloc(_concurrency, sizeof(IMPJpegWorker*));
+        idleCount = _concurrency;
         
-        /* Step 7: release JPEG compression object */
-        jpeg_destroy_compress(&cinfo);
+        for (NSUInteger i = 0; i < _concurrency; i++) {
+            IMPJpegWorker *worker = &workers[i];
+            worker->cinfo.err = jpeg_std_error(&worker->jerr.pub);
+            worker->jerr.pub.error_exit     = imp_jpeg_worker_error_exit;
+            worker->jerr.pub.output_message = imp_jpeg_worker_output_message;
+            jpeg_create_decompress(&worker->cinfo);
+            idle[i] = worker;
+        }
         
+        jobs    = [NSMutableArray new];
+        lock    = [NSLock new];
+        pending = dispatch_semaphore_create(_maxPending);
+        group   = dispatch_group_create();
+        queue   = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
     }
+    return self;
 }
 
+- (void) dealloc{
+    for (NSUInteger i = 0; i < _concurrency; i++) {
+        jpeg_destroy_decompress(&workers[i].cinfo);
+        if (workers[i].rows) free(workers[i].rows);
+    }
+    free(workers);
+    free(idle);
+}
 
-+ (nullable NSData*) dataFromMTLTexture:(nonnull id<MTLTexture>)texture
-                            compression:(CGFloat)qualityIn{
+- (void) decodeFile:(NSString *)filePath completion:(IMPJpegBatchCompletionBlock)completion{
     
-    __block NSMutableData *data = [NSMutableData dataWithCapacity:BLOCK_SIZE];
+    //
+    // back-pressure: the caller waits while maxPending files are not completed
+    //
+    dispatch_semaphore_wait(pending, DISPATCH_TIME_FOREVER);
+    [self enqueueFile:filePath completion:completion];
+}
+
+- (BOOL) tryDecodeFile:(NSString *)filePath completion:(IMPJpegBatchCompletionBlock)completion{
+    if (dispatch_semaphore_wait(pending, DISPATCH_TIME_NOW) != 0) {
+        return NO;
+    }
+    [self enqueueFile:filePath completion:completion];
+    return YES;
+}
+
+/**
+ * Queue the job of a file which has already taken a pending slot
+ */
+- (void) enqueueFile:(NSString *)filePath completion:(IMPJpegBatchCompletionBlock)completion{
     
-    if (data) {
-        [IMPJpegturbo updateJpegWithMTLTexture:texture
-                                writeInitBlock:^BOOL(void *in_cinfo, void **userData) {
-                                    struct jpeg_compress_struct *cinfo = in_cinfo;
-                                    [data setLength:BLOCK_SIZE];
-                                    jpeg_mem_dest_dp(cinfo, data);
-                                    return YES;
-                                } writeFinishBlock:^(void *in_cinfo, void *userData) {
-                                } quality:qualityIn error:nil
-         ];
+    dispatch_group_enter(group);
+    
+    CGFloat            maxSize = self.maxSize;
+    IMPJpegBufferPool *pool    = self.pool;
+    
+    IMPJpegBatchJob job = ^(IMPJpegWorker *worker){
+        NSError      *error = nil;
+        IMPJpegImage *image = [IMPJpegBatchDecoder decodeFile:filePath worker:worker maxSize:maxSize pool:pool error:&error];
+        completion(filePath, image, error);
+    };
+    
+    [lock lock];
+    [jobs addObject:job];
+    [lock unlock];
+    
+    dispatch_async(queue, ^{
+        [self drain];
+    });
+}
+
+- (void) decodeFiles:(NSArray<NSString *> *)files completion:(IMPJpegBatchCompletionBlock)completion{
+    for (NSString *file in files) {
+        [self decodeFile:file completion:completion];
     }
+}
+
+- (void) waitUntilFinished{
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+}
+
+/**
+ * Take an idle worker and run jobs until the queue is empty, no thread is blocked waiting for a worker:
+ * when all workers are busy the job is taken by the first worker which finishes its current one
+ */
+- (void) drain{
     
+    [lock lock];
+    if (idleCount == 0 || jobs.count == 0) {
+        [lock unlock];
+        return;
+    }
+    IMPJpegWorker *worker = idle[--idleCount];
     
-    return data;
+    while (jobs.count > 0) {
+        IMPJpegBatchJob job = jobs.firstObject;
+        [jobs removeObjectAtIndex:0];
+        [lock unlock];
+        
+        @autoreleasepool {
+            job(worker);
+        }
+        
+        dispatch_semaphore_signal(pending);
+        dispatch_group_leave(group);
+        
+        [lock lock];
+    }
+    
+    idle[idleCount++] = worker;
+    [lock unlock];
 }
 
-+ (void) writeMTLTexture:(id<MTLTexture>)texture
-              toJpegFile:(NSString *)filePath
-             compression:(CGFloat)qualityIn
-                   error:(NSError *__autoreleasing *)error{
++ (IMPJpegImage*) decodeFile:(NSString*)filePath
+                      worker:(IMPJpegWorker*)worker
+                     maxSize:(CGFloat)maxSize
+                        pool:(IMPJpegBufferPool*)pool
+                       error:(NSError *__autoreleasing *)error{
     
-    __block const char *filename = [filePath cStringUsingEncoding:NSUTF8StringEncoding];
+    IMPJpegSource *source __attribute__((objc_precise_lifetime)) = [IMPJpegSource sourceWithFile:filePath error:error];
     
-    [[self class] updateJpegWithMTLTexture:texture
-                            writeInitBlock:^BOOL(void *in_cinfo, void **userData) {
-                                
-                                struct jpeg_compress_struct *cinfo = in_cinfo;
-                                
-                                FILE * outfile;               /* target file */
-                                /* Step 2: specify data destination (eg, a file) */
-                                if ((outfile = fopen(filename, "wb")) == NULL) {
-                                    if (error) {
-                                        *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.write"
-                                                                             code: ENOENT
-                                                                         userInfo: @{
-                                                                                     NSLocalizedDescriptionKey:  [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be created", nil),filename],
-                                                                                     NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"File can't be created", nil),
-                                                                                     }];
-                                    }
-                                    return NO;
-                                }
-                                jpeg_stdio_dest(cinfo, outfile);
-                                
-                                *userData = outfile;
-                                
-                                return YES;
-                                
-                            } writeFinishBlock:^(void *cinfo, void *userData) {
-                                /* After finish_compress, we can close the output file. */
-                                FILE * outfile = userData;
-                                fflush(outfile);
-                                fclose(outfile);
-                            } quality:qualityIn error:error
-     ];
+    if (source == nil) return nil;
+    
+    if (!imp_jpeg_worker_start(worker, source, maxSize)) {
+        *error = imp_jpeg_read_error(EILSEQ,
+                                     [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be decoded", ""),filePath],
+                                     [NSString stringWithUTF8String:worker->jerr.message]);
+        return nil;
+    }
+    
+    NSUInteger    width       = worker->cinfo.output_width;
+    NSUInteger    height      = worker->cinfo.output_height;
+    size_t        bytesPerRow = width * worker->cinfo.output_components;
+    IMPJpegImage *image       = [pool imageWithLength:bytesPerRow * height];
+    
+    if (image == nil) {
+        jpeg_abort_decompress(&worker->cinfo);
+        *error = imp_jpeg_read_error(ENOMEM,
+                                     NSLocalizedString(@"Not enough memory to decode jpeg file", ""),
+                                     NSLocalizedString(@"Not enough memory", ""));
+        return nil;
+    }
+    
+    BOOL done = imp_jpeg_worker_read(worker, image.bytes, bytesPerRow);
+    
+    if (!done) {
+        [image recycle];
+        *error = imp_jpeg_read_error(EILSEQ,
+                                     [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be decoded", ""),filePath],
+                                     [NSString stringWithUTF8String:worker->jerr.message]);
+        return nil;
+    }
+    
+    image.filePath    = filePath;
+    image.width       = width;
+    image.height      = height;
+    image.bytesPerRow = bytesPerRow;
+    
+    return image;
 }
 
-+ (BOOL) writePixelBuffer:(CVPixelBufferRef)pixelBuffer
-               toJpegFile:(NSString *)path
-              compression:(CGFloat)compressionQ
-          inputColorSpace:(IMPJpegColorSpace)colorSpace
-                    error:(NSError *__autoreleasing *)error
+@end
+
+#pragma mark - Encoder
+
+/**
+ * Destination of the fixed arena: tjBufSize is the worst case of the image, so the arena is never full
+ */
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    JOCTET                     *buffer;
+    size_t                      capacity;
+} IMPJpegArenaDestination;
+
+METHODDEF(void) imp_jpeg_arena_init(j_compress_ptr cinfo)
+{
+    IMPJpegArenaDestination *dest = (IMPJpegArenaDestination *) cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer   = dest->capacity;
+}
+
+METHODDEF(boolean) imp_jpeg_arena_empty(j_compress_ptr cinfo)
+{
+    ERREXIT(cinfo, JERR_BUFFER_SIZE);
+    return FALSE;
+}
+
+METHODDEF(void) imp_jpeg_arena_term(j_compress_ptr cinfo)
 {
+}
+
+/**
+ * Grow only buffer, contents are not preserved
+ */
+static BOOL imp_jpeg_reserve(void **buffer, size_t *capacity, size_t size){
     
-    int quality = round(compressionQ*100.0f); quality=quality<=0?10:quality>100?100:quality;
+    if (*capacity >= size) return YES;
     
-    const char *filename = [path cStringUsingEncoding:NSUTF8StringEncoding];
+    free(*buffer);
+    *buffer   = malloc(size);
+    *capacity = *buffer ? size : 0;
     
-    int q = (int)round(quality * 100.0f); q=(q<=0?10:q>=100?100:q);
+    return *buffer != NULL;
+}
+
+static NSError *imp_jpeg_write_error(NSInteger code, NSString *description, NSString *reason){
+    return [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.write"
+                                       code: code
+                                   userInfo: @{
+                                               NSLocalizedDescriptionKey:  description,
+                                               NSLocalizedFailureReasonErrorKey: reason,
+                                               }];
+}
+
+@implementation IMPJpegEncoder
+{
+    struct jpeg_compress_struct    cinfo;
+    struct IMPJpegWorkerErrorMgr   jerr;
+    IMPJpegArenaDestination        dest;
     
+    JSAMPARRAY                     rows;
+    size_t                         rowsCapacity;
     
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    void                          *pixels;      /* texture readback */
+    size_t                         pixelsCapacity;
+    void                          *wide;        /* 16 bits texture readback */
+    size_t                         wideCapacity;
     
-    FILE * outfile;               /* target file */
-    JSAMPROW row_pointer[1];      /* pointer to JSAMPLE row[s] */
-    int row_stride;               /* physical row width in image buffer */
+    id<MTLCommandQueue>            queue;       /* texture synchronization, kept for the device */
+}
+
+- (instancetype) init{
+    return [self initWithWidth:0 height:0];
+}
+
+- (instancetype) initWithWidth:(NSUInteger)width height:(NSUInteger)height{
+    self = [super init];
+    if (self) {
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit     = imp_jpeg_worker_error_exit;
+        jerr.pub.output_message = imp_jpeg_worker_output_message;
+        jpeg_create_compress(&cinfo);
+        
+        dest.pub.init_destination    = imp_jpeg_arena_init;
+        dest.pub.empty_output_buffer = imp_jpeg_arena_empty;
+        dest.pub.term_destination    = imp_jpeg_arena_term;
+        cinfo.dest = &dest.pub;
+        
+        if (width > 0 && height > 0) {
+            imp_jpeg_reserve((void**)&dest.buffer, &dest.capacity, tjBufSize((int)width, (int)height, TJSAMP_420));
+        }
+    }
+    return self;
+}
+
+- (void) dealloc{
+    cinfo.dest = NULL;
+    jpeg_destroy_compress(&cinfo);
+    free(dest.buffer);
+    free(rows);
+    free(pixels);
+    free(wide);
+}
+
+- (size_t) capacity{
+    return dest.capacity;
+}
+
+- (IMPJpegSpan) encodeBytes:(const void *)bytes
+                bytesPerRow:(size_t)bytesPerRow
+                      width:(NSUInteger)width
+                     height:(NSUInteger)height
+                 colorSpace:(IMPJpegColorSpace)colorSpace
+                compression:(CGFloat)quality
+                      error:(NSError *__autoreleasing *)error{
+    return [self encodeBytes:bytes bytesPerRow:bytesPerRow width:width height:height
+               inColorSpace:imp_jpeg_color_space(colorSpace) compression:quality error:error];
+}
+
+- (IMPJpegSpan) encodeMTLTexture:(id<MTLTexture>)texture compression:(CGFloat)quality error:(NSError *__autoreleasing *)error{
     
-    /* Step 1: allocate and initialize JPEG compression object */
+    MTLPixelFormat format = texture.pixelFormat;
     
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
+    if (format != MTLPixelFormatRGBA8Unorm && format != MTLPixelFormatRGBA8Unorm_sRGB
+        &&
+        format != MTLPixelFormatBGRA8Unorm && format != MTLPixelFormatBGRA8Unorm_sRGB
+        &&
+        format != MTLPixelFormatRGBA16Unorm
+        ) {
+        if (error) {
+            *error = imp_jpeg_write_error(EINVAL,
+                                          NSLocalizedString(@"Texture pixel format can't be encoded to jpeg", nil),
+                                          NSLocalizedString(@"Wrong source", nil));
+        }
+        return (IMPJpegSpan){NULL, 0};
+    }
     
+    NSUInteger width       = [texture width];
+    NSUInteger height      = [texture height];
+    size_t     bytesPerRow = width * 4;
+    MTLRegion  region      = MTLRegionMake2D(0, 0, width, height);
     
-    /* Step 2: specify data destination (eg, a file) */
-    if ((outfile = fopen(filename, "wb")) == NULL) {
+    if (!imp_jpeg_reserve(&pixels, &pixelsCapacity, bytesPerRow * height)
+        ||
+        (texture.pixelFormat == MTLPixelFormatRGBA16Unorm && !imp_jpeg_reserve(&wide, &wideCapacity, bytesPerRow * height * sizeof(uint16_t)))
+        ) {
         if (error) {
-            *error = [[NSError alloc ] initWithDomain:@"com.improcessing.jpeg.write"
-                                                 code: ENOENT
-                                             userInfo: @{
-                                                         NSLocalizedDescriptionKey:  [NSString stringWithFormat:NSLocalizedString(@"Image file %@ can't be created", nil),filename],
-                                                         NSLocalizedFailureReasonErrorKey: NSLocalizedString(@"File can't be created", nil),
-                                                         }];
+            *error = imp_jpeg_write_error(ENOMEM,
+                                          NSLocalizedString(@"Not enough memory to encode jpeg file", nil),
+                                          NSLocalizedString(@"Not enough memory", nil));
         }
-        return NO;
+        return (IMPJpegSpan){NULL, 0};
     }
-    jpeg_stdio_dest(&cinfo, outfile);
-    
     
-    /* Step 3: set parameters for compression */
+    if (queue == nil || queue.device != texture.device) {
+        queue = [texture.device newCommandQueue];
+    }
     
-    cinfo.image_width  = (int)CVPixelBufferGetWidth(pixelBuffer);      /* image width and height, in pixels */
-    cinfo.image_height = (int)CVPixelBufferGetHeight(pixelBuffer);
-    cinfo.input_components = 4;           /* # of color components per pixel */
-    cinfo.in_color_space = JCS_EXT_RGBA;    /* colorspace of input image */
+    imp_jpeg_synchronize_texture_in_queue(texture, queue);
     
-    switch (colorSpace) {
-        case JPEG_TURBO_ABGR:
-            cinfo.in_color_space = JCS_EXT_ABGR;
-            break;
-            
-        case JPEG_TURBO_ARGB:
-            cinfo.in_color_space = JCS_EXT_ARGB;
-            break;
-            
-        case JPEG_TURBO_BGRA:
-            cinfo.in_color_space = JCS_EXT_BGRA;
-            break;
-            
-        case JPEG_TURBO_RGBA:
-        default:
-            break;
+    if (texture.pixelFormat == MTLPixelFormatRGBA16Unorm) {
+        [texture getBytes:wide bytesPerRow:bytesPerRow * sizeof(uint16_t) fromRegion:region mipmapLevel:0];
+        IMPConvertRGBA16ToRGBA8(wide, bytesPerRow * sizeof(uint16_t), pixels, bytesPerRow, width, height);
+    }
+    else {
+        [texture getBytes:pixels bytesPerRow:bytesPerRow fromRegion:region mipmapLevel:0];
     }
     
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+    return [self encodeBytes:pixels bytesPerRow:bytesPerRow width:width height:height
+               inColorSpace:imp_jpeg_texture_color_space(texture) compression:quality error:error];
+}
+
+/**
+ * Compress rows of the caller memory to the arena, the compressor is aborted on error and can be reused
+ */
+- (IMPJpegSpan) encodeBytes:(const void *)bytes
+                bytesPerRow:(size_t)bytesPerRow
+                      width:(NSUInteger)width
+                     height:(NSUInteger)height
+               inColorSpace:(J_COLOR_SPACE)colorSpace
+                compression:(CGFloat)quality
+                      error:(NSError *__autoreleasing *)error{
+    
+    if (width == 0 || height == 0 || bytesPerRow < width * 4) {
+        if (error) {
+            *error = imp_jpeg_write_error(EINVAL,
+                                          NSLocalizedString(@"Image is empty or its rows are too short", nil),
+                                          NSLocalizedString(@"Wrong source", nil));
+        }
+        return (IMPJpegSpan){NULL, 0};
+    }
     
+    if (!imp_jpeg_reserve((void**)&dest.buffer, &dest.capacity, tjBufSize((int)width, (int)height, TJSAMP_420))
+        ||
+        !imp_jpeg_reserve((void**)&rows, &rowsCapacity, height * sizeof(JSAMPROW))
+        ) {
+        if (error) {
+            *error = imp_jpeg_write_error(ENOMEM,
+                                          NSLocalizedString(@"Not enough memory to encode jpeg file", nil),
+                                          NSLocalizedString(@"Not enough memory", nil));
+        }
+        return (IMPJpegSpan){NULL, 0};
+    }
     
-    /* Step 4: Start compressor */
+    for (NSUInteger y = 0; y < height; y++) {
+        rows[y] = (JSAMPROW)((const uint8_t*)bytes + y * bytesPerRow);
+    }
     
-    jpeg_start_compress(&cinfo, TRUE);
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_abort_compress(&cinfo);
+        if (error) {
+            *error = imp_jpeg_write_error(EILSEQ,
+                                          NSLocalizedString(@"Image can't be encoded", nil),
+                                          [NSString stringWithUTF8String:jerr.message]);
+        }
+        return (IMPJpegSpan){NULL, 0};
+    }
     
+    cinfo.image_width      = (JDIMENSION)width;
+    cinfo.image_height     = (JDIMENSION)height;
+    cinfo.input_components = 4;
+    cinfo.in_color_space   = colorSpace;
     
-    /* Step 5: while (scan lines remain to be written) */
-    /*           jpeg_write_scanlines(...); */
+    /* default 4:2:0 sampling is the one the arena is estimated for */
     
-    row_stride = (int)cinfo.image_width  * cinfo.input_components; /* JSAMPLEs per row in image_buffer */
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, imp_jpeg_quality(quality), TRUE);
     
-    CVPixelBufferLockBaseAddress(pixelBuffer, 0);
-    void       *image_buffer  = CVPixelBufferGetBaseAddress(pixelBuffer);
+    jpeg_start_compress(&cinfo, TRUE);
     
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = & image_buffer[cinfo.next_scanline * row_stride];
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        (void) jpeg_write_scanlines(&cinfo, &rows[cinfo.next_scanline], cinfo.image_height - cinfo.next_scanline);
     }
     
-    CVPixelBufferUnlockBaseAddress(pixelBuffer, 0);
-    
-    /* Step 6: Finish compression */
-    
     jpeg_finish_compress(&cinfo);
-    /* After finish_compress, we can close the output file. */
-    fclose(outfile);
-    
     
-    /* Step 7: release JPEG compression object */
-    jpeg_destroy_compress(&cinfo);
-    
-    return YES;
+    return (IMPJpegSpan){dest.buffer, dest.capacity - dest.pub.free_in_buffer};
 }
 
 @end
@@ -0,0 +1,127 @@
+//
+//  IMPPixelConversion.h
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+#ifndef __METAL_VERSION__
+
+#ifndef IMPPixelConversion_h
+#define IMPPixelConversion_h
+
+#import <Foundation/Foundation.h>
+#import <Accelerate/Accelerate.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     *  Pixel formats conversion of 4 channels images. Every function converts width*height pixels
+     *  row by row, rows of the source and the destination can have any stride not less than the row size.
+     *  Integer conversions are vectorized by the compiler vector types, other ones use vImage, so they
+     *  run NEON kernels on iOS and SSE/AVX kernels on OS X. Big images are converted by rows strips concurrently.
+     *
+     *  All functions return kvImageNoError on success.
+     */
+
+    /**
+     *  RGBA8 -> RGBA16 widening, 255 maps to 65535 exactly (x*257)
+     */
+    vImage_Error IMPConvertRGBA8ToRGBA16(const void * _Nonnull src, size_t srcBytesPerRow,
+                                         void * _Nonnull dst, size_t dstBytesPerRow,
+                                         NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA16 -> RGBA8 narrowing with rounding (x/257)
+     */
+    vImage_Error IMPConvertRGBA16ToRGBA8(const void * _Nonnull src, size_t srcBytesPerRow,
+                                         void * _Nonnull dst, size_t dstBytesPerRow,
+                                         NSUInteger width, NSUInteger height);
+
+    /**
+     *  BGRA8 <-> RGBA8 swizzle, src and dst can be the same buffer
+     */
+    vImage_Error IMPSwapRedBlue8(const void * _Nonnull src, size_t srcBytesPerRow,
+                                 void * _Nonnull dst, size_t dstBytesPerRow,
+                                 NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA8 -> RGBA float normalized to [0,1]
+     */
+    vImage_Error IMPConvertRGBA8ToFloat(const void * _Nonnull src, size_t srcBytesPerRow,
+                                        void * _Nonnull dst, size_t dstBytesPerRow,
+                                        NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA float -> RGBA8, values are clamped to [0,1]
+     */
+    vImage_Error IMPConvertFloatToRGBA8(const void * _Nonnull src, size_t srcBytesPerRow,
+                                        void * _Nonnull dst, size_t dstBytesPerRow,
+                                        NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA16 -> RGBA float normalized to [0,1]
+     */
+    vImage_Error IMPConvertRGBA16ToFloat(const void * _Nonnull src, size_t srcBytesPerRow,
+                                         void * _Nonnull dst, size_t dstBytesPerRow,
+                                         NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA float -> RGBA16, values are clamped to [0,1]
+     */
+    vImage_Error IMPConvertFloatToRGBA16(const void * _Nonnull src, size_t srcBytesPerRow,
+                                         void * _Nonnull dst, size_t dstBytesPerRow,
+                                         NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA half float (fp16) -> RGBA float (fp32) unpacking
+     */
+    vImage_Error IMPConvertHalfToFloat(const void * _Nonnull src, size_t srcBytesPerRow,
+                                       void * _Nonnull dst, size_t dstBytesPerRow,
+                                       NSUInteger width, NSUInteger height);
+
+    /**
+     *  RGBA float (fp32) -> RGBA half float (fp16) packing, rounded to nearest even
+     */
+    vImage_Error IMPConvertFloatToHalf(const void * _Nonnull src, size_t srcBytesPerRow,
+                                       void * _Nonnull dst, size_t dstBytesPerRow,
+                                       NSUInteger width, NSUInteger height);
+
+    /**
+     *  Multiply RGB of RGBA8 pixels by alpha, src and dst can be the same buffer
+     */
+    vImage_Error IMPPremultiplyRGBA8(const void * _Nonnull src, size_t srcBytesPerRow,
+                                     void * _Nonnull dst, size_t dstBytesPerRow,
+                                     NSUInteger width, NSUInteger height);
+
+    /**
+     *  Divide RGB of RGBA8 pixels by alpha, src and dst can be the same buffer
+     */
+    vImage_Error IMPUnpremultiplyRGBA8(const void * _Nonnull src, size_t srcBytesPerRow,
+                                       void * _Nonnull dst, size_t dstBytesPerRow,
+                                       NSUInteger width, NSUInteger height);
+
+    /**
+     *  Multiply RGB of RGBA float pixels by alpha, src and dst can be the same buffer
+     */
+    vImage_Error IMPPremultiplyRGBAFloat(const void * _Nonnull src, size_t srcBytesPerRow,
+                                         void * _Nonnull dst, size_t dstBytesPerRow,
+                                         NSUInteger width, NSUInteger height);
+
+    /**
+     *  Divide RGB of RGBA float pixels by alpha, src and dst can be the same buffer
+     */
+    vImage_Error IMPUnpremultiplyRGBAFloat(const void * _Nonnull src, size_t srcBytesPerRow,
+                                           void * _Nonnull dst, size_t dstBytesPerRow,
+                                           NSUInteger width, NSUInteger height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMPPixelConversion_h */
+
+#endif
@@ -0,0 +1,241 @@
+//
+//  IMPPixelConversion.m
+//  IMProcessing
+//
+//  Created by denis svinarchuk on 19.10.16.
+//  Copyright © 2016 Dehancer.photo. All rights reserved.
+//
+
+#import "IMPPixelConversion.h"
+
+#define IMP_CHANNELS          4
+#define IMP_CONCURRENT_PIXELS (1<<16)
+
+typedef uint8_t  imp_uchar16  __attribute__((ext_vector_type(16)));
+typedef uint16_t imp_ushort16 __attribute__((ext_vector_type(16)));
+typedef uint32_t imp_uint32x16 __attribute__((ext_vector_type(16)));
+
+typedef void (^IMPRowsBlock)(NSUInteger y0, NSUInteger y1);
+
+/**
+ * Run rows block over strips of rows, small images are converted on the caller thread
+ */
+static void imp_rows_apply(NSUInteger width, NSUInteger height, IMPRowsBlock block){
+
+    NSUInteger strips = 1;
+
+    if (width * height >= IMP_CONCURRENT_PIXELS) {
+        strips = MIN([[NSProcessInfo processInfo] activeProcessorCount], height);
+    }
+
+    if (strips <= 1) {
+        block(0, height);
+        return;
+    }
+
+    NSUInteger perStrip = (height + strips - 1) / strips;
+
+    dispatch_apply(strips, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t strip) {
+        NSUInteger y0 = strip * perStrip;
+        NSUInteger y1 = MIN(y0 + perStrip, height);
+        if (y0 < y1) block(y0, y1);
+    });
+}
+
+/**
+ * Interleaved rows as a planar vImage buffer, every channel value is a planar pixel
+ */
+static vImage_Buffer imp_planar_buffer(const void *data, size_t bytesPerRow, NSUInteger width, NSUInteger height){
+    vImage_Buffer buffer = {
+        .data     = (void*)data,
+        .height   = height,
+        .width    = width * IMP_CHANNELS,
+        .rowBytes = bytesPerRow
+    };
+    return buffer;
+}
+
+static vImage_Buffer imp_interleaved_buffer(const void *data, size_t bytesPerRow, NSUInteger width, NSUInteger height){
+    vImage_Buffer buffer = {
+        .data     = (void*)data,
+        .height   = height,
+        .width    = width,
+        .rowBytes = bytesPerRow
+    };
+    return buffer;
+}
+
+static inline void imp_widen_row(const uint8_t *s, uint16_t *d, NSUInteger count){
+    NSUInteger i = 0;
+    for (; i + 16 <= count; i += 16) {
+        imp_uchar16 v;
+        memcpy(&v, s + i, sizeof(v));
+        imp_ushort16 w = __builtin_convertvector(v, imp_ushort16);
+        w = (w << 8) | w;
+        memcpy(d + i, &w, sizeof(w));
+    }
+    for (; i < count; i++) {
+        d[i] = (uint16_t)(s[i] * 257);
+    }
+}
+
+static inline void imp_narrow_row(const uint16_t *s, uint8_t *d, NSUInteger count){
+    NSUInteger i = 0;
+    for (; i + 16 <= count; i += 16) {
+        imp_ushort16 v;
+        memcpy(&v, s + i, sizeof(v));
+        imp_uint32x16 w = __builtin_convertvector(v, imp_uint32x16);
+        w = (w * 255 + 32895) >> 16;
+        imp_uchar16 n = __builtin_convertvector(w, imp_uchar16);
+        memcpy(d + i, &n, sizeof(n));
+    }
+    for (; i < count; i++) {
+        d[i] = (uint8_t)((s[i] * 255u + 32895u) >> 16);
+    }
+}
+
+vImage_Error IMPConvertRGBA8ToRGBA16(const void *src, size_t srcBytesPerRow,
+                                     void *dst, size_t dstBytesPerRow,
+                                     NSUInteger width, NSUInteger height){
+
+    NSUInteger count = width * IMP_CHANNELS;
+
+    if (srcBytesPerRow < count || dstBytesPerRow < count * sizeof(uint16_t)) return kvImageInvalidParameter;
+
+    imp_rows_apply(width, height, ^(NSUInteger y0, NSUInteger y1) {
+        for (NSUInteger y = y0; y < y1; y++) {
+            imp_widen_row((const uint8_t*)src + y * srcBytesPerRow, (uint16_t*)((uint8_t*)dst + y * dstBytesPerRow), count);
+        }
+    });
+
+    return kvImageNoError;
+}
+
+vImage_Error IMPConvertRGBA16ToRGBA8(const void *src, size_t srcBytesPerRow,
+                                     void *dst, size_t dstBytesPerRow,
+                                     NSUInteger width, NSUInteger height){
+
+    NSUInteger count = width * IMP_CHANNELS;
+
+    if (srcBytesPerRow < count * sizeof(uint16_t) || dstBytesPerRow < count) return kvImageInvalidParameter;
+
+    imp_rows_apply(width, height, ^(NSUInteger y0, NSUInteger y1) {
+        for (NSUInteger y = y0; y < y1; y++) {
+            imp_narrow_row((const uint16_t*)((const uint8_t*)src + y * srcBytesPerRow), (uint8_t*)dst + y * dstBytesPerRow, count);
+        }
+    });
+
+    return kvImageNoError;
+}
+
+vImage_Error IMPSwapRedBlue8(const void *src, size_t srcBytesPerRow,
+                             void *dst, size_t dstBytesPerRow,
+                             NSUInteger width, NSUInteger height){
+
+    const uint8_t map[4] = {2, 1, 0, 3};
+
+    vImage_Buffer s = imp_interleaved_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_interleaved_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImagePermuteChannels_ARGB8888(&s, &d, map, kvImageNoFlags);
+}
+
+vImage_Error IMPConvertRGBA8ToFloat(const void *src, size_t srcBytesPerRow,
+                                    void *dst, size_t dstBytesPerRow,
+                                    NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_planar_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_planar_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageConvert_Planar8toPlanarF(&s, &d, 1, 0, kvImageNoFlags);
+}
+
+vImage_Error IMPConvertFloatToRGBA8(const void *src, size_t srcBytesPerRow,
+                                    void *dst, size_t dstBytesPerRow,
+                                    NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_planar_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_planar_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageConvert_PlanarFtoPlanar8(&s, &d, 1, 0, kvImageNoFlags);
+}
+
+vImage_Error IMPConvertRGBA16ToFloat(const void *src, size_t srcBytesPerRow,
+                                     void *dst, size_t dstBytesPerRow,
+                                     NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_planar_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_planar_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageConvert_16UToF(&s, &d, 0, 1.0f/65535.0f, kvImageNoFlags);
+}
+
+vImage_Error IMPConvertFloatToRGBA16(const void *src, size_t srcBytesPerRow,
+                                     void *dst, size_t dstBytesPerRow,
+                                     NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_planar_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_planar_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageConvert_FTo16U(&s, &d, 0, 1.0f/65535.0f, kvImageNoFlags);
+}
+
+vImage_Error IMPConvertHalfToFloat(const void *src, size_t srcBytesPerRow,
+                                   void *dst, size_t dstBytesPerRow,
+                                   NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_planar_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_planar_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageConvert_Planar16FtoPlanarF(&s, &d, kvImageNoFlags);
+}
+
+vImage_Error IMPConvertFloatToHalf(const void *src, size_t srcBytesPerRow,
+                                   void *dst, size_t dstBytesPerRow,
+                                   NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_planar_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_planar_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageConvert_PlanarFtoPlanar16F(&s, &d, kvImageNoFlags);
+}
+
+vImage_Error IMPPremultiplyRGBA8(const void *src, size_t srcBytesPerRow,
+                                 void *dst, size_t dstBytesPerRow,
+                                 NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_interleaved_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_interleaved_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImagePremultiplyData_RGBA8888(&s, &d, kvImageNoFlags);
+}
+
+vImage_Error IMPUnpremultiplyRGBA8(const void *src, size_t srcBytesPerRow,
+                                   void *dst, size_t dstBytesPerRow,
+                                   NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_interleaved_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_interleaved_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageUnpremultiplyData_RGBA8888(&s, &d, kvImageNoFlags);
+}
+
+vImage_Error IMPPremultiplyRGBAFloat(const void *src, size_t srcBytesPerRow,
+                                     void *dst, size_t dstBytesPerRow,
+                                     NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_interleaved_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_interleaved_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImagePremultiplyData_RGBAFFFF(&s, &d, kvImageNoFlags);
+}
+
+vImage_Error IMPUnpremultiplyRGBAFloat(const void *src, size_t srcBytesPerRow,
+                                       void *dst, size_t dstBytesPerRow,
+                                       NSUInteger width, NSUInteger height){
+
+    vImage_Buffer s = imp_interleaved_buffer(src, srcBytesPerRow, width, height);
+    vImage_Buffer d = imp_interleaved_buffer(dst, dstBytesPerRow, width, height);
+
+    return vImageUnpremultiplyData_RGBAFFFF(&s, &d, kvImageNoFlags);
+}